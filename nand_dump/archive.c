@@ -0,0 +1,593 @@
+/*
+    Dump archives and the pack / unpack commands for rpi-raw-nand
+
+    A 570 MB dump is mostly erased pages and repeats. An archive (<name>.nda)
+    keeps it block by block:
+
+        header          ARCHIVE_HEADER_SIZE bytes: magic, geometry, page
+                        count, first chip page, chip ID, block table offset
+        frames          per block a struct archive_frame, then its pages
+                        that are not all 0xFF, deflated (zlib) or stored
+        block table     one struct archive_frame per block, written last
+
+    Any page is read by inflating just its block. read_full writes an
+    archive straight from its writer thread when the output file ends in
+    ARCHIVE_SUFFIX; the frames carry enough to rebuild the table of an
+    archive that never got one, a dump cut short.
+
+    dump_open() inflates an archive into memory on all cores, so every
+    offline command takes one in place of a dump.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include "nand_dump.h"
+
+#define ARCHIVE_MAGIC "NDARC01"
+#define ARCHIVE_LEVEL 6   // zlib level, fast enough to keep up with the bus
+#define PACK_BATCH    64  // blocks deflated in parallel before they are written
+
+_Static_assert(sizeof(struct archive_header) <= ARCHIVE_HEADER_SIZE, "archive header too big");
+
+static int read_all(int fd, void *buf, size_t len, uint64_t offset) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pread(fd, buf, len, offset)) <= 0) {
+			if (n < 0)
+				perror("pread archive");
+			return -1;
+		}
+		buf = (unsigned char *)buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+int is_archive(const char *file) {
+	char magic[8];
+	int fd, n;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return 0;
+	n = read(fd, magic, sizeof(magic));
+	close(fd);
+	return n == sizeof(magic) && memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) == 0;
+}
+
+// the table of an archive cut short: walk the frames
+static int rebuild_table(struct dump_archive *ar, const char *file) {
+	struct archive_frame f;
+	struct stat st;
+	uint64_t offset = ARCHIVE_HEADER_SIZE;
+	unsigned int alloc = 0;
+	void *grown;
+
+	if (fstat(ar->fd, &st) < 0) {
+		perror(file);
+		return -1;
+	}
+	ar->hdr.blocks = ar->hdr.pages = 0;
+	while (offset + sizeof(f) <= (uint64_t)st.st_size && read_all(ar->fd, &f, sizeof(f), offset) == 0) {
+		if (f.block != ar->hdr.blocks || f.offset != offset || f.pages == 0 || f.pages > PAGES_PER_BLOCK ||
+		    offset + sizeof(f) + f.size > (uint64_t)st.st_size)
+			break;
+		if (ar->hdr.blocks == alloc) {
+			alloc = alloc ? 2 * alloc : 256;
+			if ((grown = realloc(ar->table, alloc * sizeof(f))) == NULL) {
+				perror("realloc");
+				return -1;
+			}
+			ar->table = (struct archive_frame *)grown;
+		}
+		ar->table[ar->hdr.blocks++] = f;
+		ar->hdr.pages += f.pages;
+		offset += sizeof(f) + f.size;
+	}
+	printf("%s has no block table (cut short?), found %u blocks, %u pages\n", file, ar->hdr.blocks, ar->hdr.pages);
+	return 0;
+}
+
+// the table and header as archive_read_pages() and inflate_block() use
+// them: whole blocks but the last, adding up to the pages, in the file
+static int check_table(const struct dump_archive *ar, const char *file, uint64_t file_size) {
+	const struct archive_frame *f;
+	unsigned int b, pages = 0;
+
+	if (ar->hdr.blocks != (ar->hdr.pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK) {
+		printf("%s: %u blocks for %u pages\n", file, ar->hdr.blocks, ar->hdr.pages);
+		return -1;
+	}
+	for (b = 0; b < ar->hdr.blocks; b++) {
+		f = &ar->table[b];
+		if (f->pages == 0 || f->pages > PAGES_PER_BLOCK || (b + 1 < ar->hdr.blocks && f->pages != PAGES_PER_BLOCK)) {
+			printf("%s: block %u holds %u pages\n", file, b, f->pages);
+			return -1;
+		}
+		if (f->offset < ARCHIVE_HEADER_SIZE || f->offset > file_size || file_size - f->offset < sizeof(*f) + (uint64_t)f->size) {
+			printf("%s: block %u lies outside the file\n", file, b);
+			return -1;
+		}
+		pages += f->pages;
+	}
+	if (pages != ar->hdr.pages) {
+		printf("%s: the blocks hold %u pages, the header says %u\n", file, pages, ar->hdr.pages);
+		return -1;
+	}
+	return 0;
+}
+
+int archive_open(struct dump_archive *ar, const char *file) {
+	struct stat st;
+	size_t len;
+
+	memset(ar, 0, sizeof(*ar));
+	if ((ar->fd = open(file, O_RDONLY)) < 0) {
+		perror(file);
+		return -1;
+	}
+	if (read_all(ar->fd, &ar->hdr, sizeof(ar->hdr), 0) < 0 || memcmp(ar->hdr.magic, ARCHIVE_MAGIC, sizeof(ar->hdr.magic)) != 0) {
+		printf("%s is no dump archive\n", file);
+		goto fail;
+	}
+	if (ar->hdr.page_size != PAGE_SIZE || ar->hdr.pages_per_block != PAGES_PER_BLOCK ||
+	    ar->hdr.sector_size != SECTOR_SIZE || ar->hdr.sectors_per_page != SECTORS_PER_PAGE) {
+		printf("%s: %u pages of %u bytes per block, this program knows %d of %d\n", file,
+		    ar->hdr.pages_per_block, ar->hdr.page_size, PAGES_PER_BLOCK, PAGE_SIZE);
+		goto fail;
+	}
+	if (fstat(ar->fd, &st) < 0) {
+		perror(file);
+		goto fail;
+	}
+	if (ar->hdr.table == 0) {
+		if (rebuild_table(ar, file) < 0)
+			goto fail;
+	} else {
+		len = (size_t)ar->hdr.blocks * sizeof(*ar->table);
+		if (ar->hdr.table > (uint64_t)st.st_size || (uint64_t)st.st_size - ar->hdr.table < len) {
+			printf("%s: block table cut short\n", file);
+			goto fail;
+		}
+		if ((ar->table = (struct archive_frame *)malloc(len ? len : 1)) == NULL) {
+			perror("malloc");
+			goto fail;
+		}
+		if (read_all(ar->fd, ar->table, len, ar->hdr.table) < 0) {
+			printf("%s: block table cut short\n", file);
+			goto fail;
+		}
+	}
+	if (check_table(ar, file, st.st_size) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	archive_close(ar);
+	return -1;
+}
+
+void archive_close(struct dump_archive *ar) {
+	if (ar->fd >= 0)
+		close(ar->fd);
+	free(ar->table);
+	ar->table = NULL;
+	ar->fd = -1;
+}
+
+// the pages of one frame into out, erased ones filled in
+static int inflate_block(const struct dump_archive *ar, unsigned int block, unsigned char *out) {
+	const struct archive_frame *f = &ar->table[block];
+	unsigned char *in, *pages;
+	unsigned int p, stored = 0;
+	uLongf len;
+
+	for (p = 0; p < f->pages; p++)
+		stored += !(f->erased >> p & 1);
+	if (stored == 0) {
+		memset(out, 0xFF, (size_t)f->pages * PAGE_SIZE);
+		return 0;
+	}
+	if ((in = (unsigned char *)malloc(f->size)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if (read_all(ar->fd, in, f->size, f->offset + sizeof(*f)) < 0) {
+		printf("block %u cut short\n", block);
+		free(in);
+		return -1;
+	}
+	// the stored pages go to the front of out, then move up to their place from the back
+	len = (uLongf)stored * PAGE_SIZE;
+	if (f->flags & ARCHIVE_STORED) {
+		if (f->size != len) {
+			printf("block %u: %u bytes for %u pages\n", block, f->size, stored);
+			free(in);
+			return -1;
+		}
+		memcpy(out, in, len);
+	} else if (uncompress(out, &len, in, f->size) != Z_OK || len != (uLongf)stored * PAGE_SIZE) {
+		printf("block %u does not inflate\n", block);
+		free(in);
+		return -1;
+	}
+	free(in);
+	pages = out + (size_t)stored * PAGE_SIZE;
+	for (p = f->pages; p-- > 0;) {
+		if (f->erased >> p & 1) {
+			memset(out + (size_t)p * PAGE_SIZE, 0xFF, PAGE_SIZE);
+		} else {
+			pages -= PAGE_SIZE;
+			if (pages != out + (size_t)p * PAGE_SIZE)
+				memmove(out + (size_t)p * PAGE_SIZE, pages, PAGE_SIZE);
+		}
+	}
+	return 0;
+}
+
+int archive_read_pages(const struct dump_archive *ar, unsigned int page, unsigned int count, unsigned char *buf) {
+	unsigned char *block = NULL;
+	unsigned int b, first, n;
+
+	if (page + count > ar->hdr.pages || page + count < page) {
+		printf("pages %u .. %u are not in the archive (%u pages)\n", page, page + count - 1, ar->hdr.pages);
+		return -1;
+	}
+	while (count > 0) {
+		b = page / PAGES_PER_BLOCK;
+		first = page % PAGES_PER_BLOCK;
+		n = ar->table[b].pages - first < count ? ar->table[b].pages - first : count;
+		if (first == 0 && n == ar->table[b].pages) {
+			// whole block, straight into buf
+			if (inflate_block(ar, b, buf) < 0)
+				goto fail;
+		} else {
+			if (block == NULL && (block = (unsigned char *)malloc(BLOCK_SIZE)) == NULL) {
+				perror("malloc");
+				return -1;
+			}
+			if (inflate_block(ar, b, block) < 0)
+				goto fail;
+			memcpy(buf, block + (size_t)first * PAGE_SIZE, (size_t)n * PAGE_SIZE);
+		}
+		buf += (size_t)n * PAGE_SIZE;
+		page += n;
+		count -= n;
+	}
+	free(block);
+	return 0;
+
+fail:
+	free(block);
+	return -1;
+}
+
+struct load_job {
+	const struct dump_archive *ar;
+	unsigned char *out;
+	int failed;
+};
+
+static void load_block(void *ctx, unsigned long block, int worker) {
+	struct load_job *job = (struct load_job *)ctx;
+
+	(void)worker;
+	if (inflate_block(job->ar, block, job->out + block * BLOCK_SIZE) < 0)
+		job->failed = 1;
+}
+
+static int inflate_all(const struct dump_archive *ar, unsigned char *out) {
+	struct load_job job = { ar, out, 0 };
+
+	// archive_open() made sure every block but the last is whole
+	run_parallel(ar->hdr.blocks, 0, load_block, &job);
+	return job.failed ? -1 : 0;
+}
+
+int archive_load(struct dump_image *img, const char *file) {
+	struct dump_archive ar;
+	double start, seconds;
+
+	memset(img, 0, sizeof(*img));
+	img->fd = -1;
+	if (archive_open(&ar, file) < 0)
+		return -1;
+	img->pages = ar.hdr.pages;
+	img->size = (size_t)img->pages * PAGE_SIZE;
+	if (img->pages == 0) {
+		printf("%s holds no complete page\n", file);
+		archive_close(&ar);
+		return -1;
+	}
+	img->data = (unsigned char *)mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (img->data == MAP_FAILED) {
+		perror("mmap archive");
+		img->data = NULL;
+		archive_close(&ar);
+		return -1;
+	}
+	start = wall_clock();
+	if (inflate_all(&ar, img->data) < 0) {
+		archive_close(&ar);
+		dump_close(img);
+		return -1;
+	}
+	seconds = wall_clock() - start;
+	printf("%s: %u pages inflated in %.2f s\n", file, img->pages, seconds);
+	archive_close(&ar);
+	return 0;
+}
+
+int archive_create(struct archive_writer *w, const char *file, const unsigned char id[8], unsigned int first_page) {
+	memset(w, 0, sizeof(*w));
+	if ((w->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(file);
+		return -1;
+	}
+	w->block = (unsigned char *)malloc(BLOCK_SIZE);
+	w->zbuf = (unsigned char *)malloc(compressBound(BLOCK_SIZE));
+	if (w->block == NULL || w->zbuf == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+	memcpy(w->hdr.magic, ARCHIVE_MAGIC, sizeof(w->hdr.magic));
+	w->hdr.page_size = PAGE_SIZE;
+	w->hdr.pages_per_block = PAGES_PER_BLOCK;
+	w->hdr.sector_size = SECTOR_SIZE;
+	w->hdr.sectors_per_page = SECTORS_PER_PAGE;
+	w->hdr.first_page = first_page;
+	if (id != NULL)
+		memcpy(w->hdr.id, id, sizeof(w->hdr.id));
+	w->offset = ARCHIVE_HEADER_SIZE;
+	// table 0 until archive_finish(): a reader knows to walk the frames
+	if (ftruncate(w->fd, ARCHIVE_HEADER_SIZE) < 0 || write_all(w->fd, &w->hdr, sizeof(w->hdr), 0) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	free(w->block);
+	free(w->zbuf);
+	close(w->fd);
+	w->fd = -1;
+	return -1;
+}
+
+// the stored pages of a block packed to the front of buf, deflated into zbuf if that helps
+static void pack_block(const unsigned char *pages, unsigned int count, struct archive_frame *f,
+    unsigned char *buf, unsigned char *zbuf, const unsigned char **data) {
+	unsigned int p, stored = 0;
+	uLongf len;
+
+	f->pages = count;
+	f->erased = 0;
+	f->flags = 0;
+	for (p = 0; p < count; p++) {
+		if (all_ff(pages + (size_t)p * PAGE_SIZE, PAGE_SIZE)) {
+			f->erased |= (uint64_t)1 << p;
+		} else {
+			if (buf + (size_t)stored * PAGE_SIZE != pages + (size_t)p * PAGE_SIZE)
+				memmove(buf + (size_t)stored * PAGE_SIZE, pages + (size_t)p * PAGE_SIZE, PAGE_SIZE);
+			stored++;
+		}
+	}
+	f->size = 0;
+	*data = NULL;
+	if (stored == 0)
+		return;
+	len = compressBound((uLong)stored * PAGE_SIZE);
+	if (compress2(zbuf, &len, buf, (uLong)stored * PAGE_SIZE, ARCHIVE_LEVEL) == Z_OK && len < (uLongf)stored * PAGE_SIZE) {
+		f->size = len;
+		*data = zbuf;
+	} else {
+		f->size = stored * PAGE_SIZE;
+		f->flags |= ARCHIVE_STORED;
+		*data = buf;
+	}
+}
+
+// frame header and data at the end, entry in the table
+static int put_frame(struct archive_writer *w, struct archive_frame *f, const unsigned char *data) {
+	void *grown;
+
+	if (w->hdr.blocks == w->alloc) {
+		w->alloc = w->alloc ? 2 * w->alloc : 1024;
+		if ((grown = realloc(w->table, w->alloc * sizeof(*f))) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		w->table = (struct archive_frame *)grown;
+	}
+	f->block = w->hdr.blocks;
+	f->offset = w->offset;
+	if (write_all(w->fd, f, sizeof(*f), w->offset) < 0 ||
+	    (f->size && write_all(w->fd, data, f->size, w->offset + sizeof(*f)) < 0))
+		return -1;
+	w->offset += sizeof(*f) + f->size;
+	w->table[w->hdr.blocks++] = *f;
+	w->hdr.pages += f->pages;
+	return 0;
+}
+
+static int flush_block(struct archive_writer *w) {
+	struct archive_frame f;
+	const unsigned char *data;
+
+	if (w->fill == 0)
+		return 0;
+	memset(&f, 0, sizeof(f));
+	pack_block(w->block, w->fill, &f, w->block, w->zbuf, &data);
+	w->fill = 0;
+	return put_frame(w, &f, data);
+}
+
+int archive_write_page(struct archive_writer *w, const unsigned char *page) {
+	memcpy(w->block + (size_t)w->fill * PAGE_SIZE, page, PAGE_SIZE);
+	if (++w->fill < PAGES_PER_BLOCK)
+		return 0;
+	return flush_block(w);
+}
+
+int archive_finish(struct archive_writer *w) {
+	int ret = -1;
+
+	if (flush_block(w) < 0)
+		goto out;
+	w->hdr.table = w->offset;
+	if (write_all(w->fd, w->table, (size_t)w->hdr.blocks * sizeof(*w->table), w->offset) < 0 ||
+	    write_all(w->fd, &w->hdr, sizeof(w->hdr), 0) < 0)
+		goto out;
+	ret = 0;
+out:
+	if (close(w->fd) < 0) {
+		perror("close archive");
+		ret = -1;
+	}
+	w->fd = -1;
+	free(w->block);
+	free(w->zbuf);
+	free(w->table);
+	w->block = w->zbuf = NULL;
+	w->table = NULL;
+	return ret;
+}
+
+struct pack_job {
+	const struct dump_image *img;
+	unsigned long first;    // block of batch slot 0
+	unsigned char *buf[PACK_BATCH], *zbuf[PACK_BATCH];
+	struct archive_frame frame[PACK_BATCH];
+	const unsigned char *data[PACK_BATCH];
+};
+
+static void pack_slot(void *ctx, unsigned long slot, int worker) {
+	struct pack_job *job = (struct pack_job *)ctx;
+	unsigned long page = (job->first + slot) * PAGES_PER_BLOCK;
+	unsigned int count = job->img->pages - page < PAGES_PER_BLOCK ? job->img->pages - page : PAGES_PER_BLOCK;
+
+	(void)worker;
+	memset(&job->frame[slot], 0, sizeof(job->frame[slot]));
+	memcpy(job->buf[slot], dump_page(job->img, page), (size_t)count * PAGE_SIZE);
+	pack_block(job->buf[slot], count, &job->frame[slot], job->buf[slot], job->zbuf[slot], &job->data[slot]);
+}
+
+int pack_dump(char *infile, char *outfile) {
+	struct dump_image img;
+	struct archive_writer w;
+	struct pack_job *job;
+	unsigned long blocks, b, n, erased = 0;
+	struct stat st;
+	double start, seconds;
+	int i, p, ret = -1;
+
+	if (is_archive(infile)) {
+		printf("%s is an archive already\n", infile);
+		return -1;
+	}
+	if (dump_open(&img, infile) < 0)
+		return -1;
+	if ((job = (struct pack_job *)calloc(1, sizeof(*job))) == NULL) {
+		perror("calloc");
+		dump_close(&img);
+		return -1;
+	}
+	job->img = &img;
+	for (i = 0; i < PACK_BATCH; i++) {
+		job->buf[i] = (unsigned char *)malloc(BLOCK_SIZE);
+		job->zbuf[i] = (unsigned char *)malloc(compressBound(BLOCK_SIZE));
+		if (job->buf[i] == NULL || job->zbuf[i] == NULL) {
+			perror("malloc");
+			goto out;
+		}
+	}
+	if (archive_create(&w, outfile, NULL, 0) < 0)
+		goto out;
+
+	printf("Packing %u pages into %s\n", img.pages, outfile);
+	start = wall_clock();
+	blocks = (img.pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+	for (b = 0; b < blocks; b += n) {
+		n = blocks - b < PACK_BATCH ? blocks - b : PACK_BATCH;
+		job->first = b;
+		run_parallel(n, 0, pack_slot, job);
+		// in block order, the frames follow each other
+		for (i = 0; i < (int)n; i++) {
+			for (p = 0; p < (int)job->frame[i].pages; p++)
+				erased += job->frame[i].erased >> p & 1;
+			if (put_frame(&w, &job->frame[i], job->data[i]) < 0) {
+				archive_finish(&w);
+				goto out;
+			}
+		}
+		printf("Packed %lu of %lu blocks, %lu%%\r", b + n, blocks, 100 * (b + n) / blocks);
+		fflush(stdout);
+	}
+	if (archive_finish(&w) < 0)
+		goto out;
+	seconds = wall_clock() - start;
+	if (stat(outfile, &st) < 0) {
+		perror(outfile);
+		goto out;
+	}
+	printf("\nPacked %lu MB into %lu MB (%.1f%%, %lu erased pages left out) in %.2f s (%.0f MB/s)\n",
+	    (unsigned long)(img.size >> 20), (unsigned long)(st.st_size >> 20), 100.0 * st.st_size / img.size, erased,
+	    seconds, seconds > 0 ? img.size / (double)(1 << 20) / seconds : 0.0);
+	ret = 0;
+
+out:
+	for (i = 0; i < PACK_BATCH; i++) {
+		free(job->buf[i]);
+		free(job->zbuf[i]);
+	}
+	free(job);
+	dump_close(&img);
+	return ret;
+}
+
+int unpack_dump(char *infile, char *outfile) {
+	struct dump_archive ar;
+	struct dump_image out;
+	double start, seconds;
+	int i, id = 0;
+
+	if (archive_open(&ar, infile) < 0)
+		return -1;
+	for (i = 0; i < (int)sizeof(ar.hdr.id); i++)
+		id |= ar.hdr.id[i];
+	printf("%s: %u pages from chip page %u", infile, ar.hdr.pages, ar.hdr.first_page);
+	if (id) {
+		printf(", chip ID");
+		for (i = 0; i < 6; i++)
+			printf(" %02x", ar.hdr.id[i]);
+	}
+	printf("\n");
+	if (dump_create(&out, outfile, (size_t)ar.hdr.pages * PAGE_SIZE) < 0) {
+		archive_close(&ar);
+		return -1;
+	}
+	start = wall_clock();
+	if (out.pages > 0 && inflate_all(&ar, out.data) < 0) {
+		dump_close(&out);
+		archive_close(&ar);
+		return -1;
+	}
+	seconds = wall_clock() - start;
+	printf("Unpacked %u pages to %s in %.2f s (%.0f MB/s)\n", out.pages, outfile, seconds,
+	    seconds > 0 ? out.size / (double)(1 << 20) / seconds : 0.0);
+	dump_close(&out);
+	archive_close(&ar);
+	return 0;
+}
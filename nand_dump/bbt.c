@@ -0,0 +1,274 @@
+/*
+    Bad block table and the bbt / read_bbt commands for rpi-raw-nand
+
+    dumpreader.js badBlockTable() returns pages 131008 and 130944 as they
+    are. Those are page 0 of the last two blocks, where the kernel keeps
+    its on-flash bad block table (nand_bbt.c with NAND_BBT_NO_OOB, as
+    mtk_nand sets it up), the table and its mirror, in the data area:
+
+        0 .. 3   "Bbt0", the mirror "1tbB"
+        4        version, the higher one is the current table
+        5 ..     2 bits per block, block 0 in the low bits of the first
+                 byte: 11 good, 00 factory bad (or the table's own block),
+                 10 and 01 worn out in use
+
+    Both are looked for in the last BBT_SCAN_BLOCKS blocks like the kernel
+    does. The page is scrambled and ECC protected like any other, so it is
+    descrambled and corrected first unless the dump is descrambled already.
+
+    The factory marks a bad block with a non 0xFF first spare byte, column
+    4096, of page 0 or 1. The NFI puts byte 832 of sector 3 there, which on
+    a written page reads as the page's XOR key: with a key a block is
+    marked if that byte is neither 0xFF nor the key byte, without one only
+    if it is 0x00. A descrambled dump has lost the markers.
+
+    Table and markers go into one struct bad_blocks, saved to BBT_FILE;
+    the chip commands load it and leave the bad blocks alone, they are not
+    read (0xFF in the dump), written or erased.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+
+#define BBT_MAGIC        "NDBBT01"
+#define BBT_PATTERN_LEN  4
+#define BBT_TABLE_OFFSET (BBT_PATTERN_LEN + 1) // after pattern and version
+#define BBM_COLUMN       4096 // factory marker, the first byte of the chip's spare area
+#define BBM_PAGES        2    // marked in page 0 or 1
+
+_Static_assert(BBT_TABLE_OFFSET + CHIP_BLOCKS / 4 <= SECTOR_DATA, "the table fits in sector 0");
+
+static const struct {
+	const char *pattern;
+	const char *name;
+} tables[] = {
+	{ "Bbt0", "table" },
+	{ "1tbB", "mirror" },
+};
+
+static const char *state_name[] = { "good", "worn", "bbt", "factory bad" };
+
+// sector 0 of page 0 of <block>, plain or descrambled and corrected; the table's version or -1
+static int find_table(const struct bbt_reader *rd, unsigned int block, const char *pattern,
+    const unsigned char *key, int ecc, unsigned char *sector) {
+	unsigned char page[PAGE_SIZE];
+	int i, flips;
+
+	if (rd->read(rd->ctx, block * PAGES_PER_BLOCK, 1, page) < 0)
+		return -1;
+	memcpy(sector, page, SECTOR_SIZE);
+	// not in a descrambled dump
+	if (memcmp(sector, pattern, BBT_PATTERN_LEN) != 0) {
+		if (key == NULL)
+			return -1;
+		for (i = 0; i < SECTOR_SIZE; i++)
+			sector[i] ^= key[i];
+	}
+	if (ecc && ecc_check_sector(sector, 1, &flips) == ECC_UNCORRECTABLE) {
+		// only worth a word if it looks like a table
+		if (memcmp(sector, pattern, BBT_PATTERN_LEN) == 0)
+			printf("Block %u: bad block table fails ECC, ignored\n", block);
+		return -1;
+	}
+	if (memcmp(sector, pattern, BBT_PATTERN_LEN) != 0)
+		return -1;
+	return sector[BBT_PATTERN_LEN];
+}
+
+int bbt_build(struct bad_blocks *bb, const struct bbt_reader *rd, const struct dump_image *img, const char *xordir) {
+	unsigned char key[BBM_PAGES][SECTOR_SIZE], sector[SECTOR_SIZE], table[SECTOR_SIZE], page[PAGE_SIZE], code;
+	unsigned int block, b, p, listed = 0, marked = 0, unlisted = 0;
+	struct rand_model model;
+	int have_key[BBM_PAGES], have_model, ecc, t, v;
+	int32_t *found;
+
+	memset(bb, 0, sizeof(*bb));
+	memcpy(bb->magic, BBT_MAGIC, sizeof(bb->magic));
+	bb->blocks = CHIP_BLOCKS;
+	bb->version = bb->table_block = bb->mirror_block = -1;
+	have_model = rand_load(&model, xordir) == 0;
+	for (p = 0; p < BBM_PAGES; p++)
+		have_key[p] = load_xor_key(img, p, xordir, have_model ? &model : NULL, key[p]) != XOR_KEY_NONE;
+	if (!have_key[0])
+		printf("No key for page 0 in %s, only a descrambled table is found\n", xordir);
+	ecc = ecc_init() == 0;
+
+	// search_bbt(): from the last block down, the first copy found counts
+	for (t = 0; t < 2; t++) {
+		found = t == 0 ? &bb->table_block : &bb->mirror_block;
+		for (b = 0; b < BBT_SCAN_BLOCKS; b++) {
+			block = CHIP_BLOCKS - 1 - b;
+			if (block >= rd->blocks)
+				continue;
+			if ((v = find_table(rd, block, tables[t].pattern, have_key[0] ? key[0] : NULL, ecc, sector)) < 0)
+				continue;
+			printf("Bad block %s found in block %u (page %u), version %d\n", tables[t].name, block, block * PAGES_PER_BLOCK, v);
+			*found = block;
+			// the table wins a tie, it is looked at first
+			if (v > bb->version) {
+				bb->version = v;
+				memcpy(table, sector, SECTOR_SIZE);
+			}
+			break;
+		}
+	}
+	if (bb->version < 0) {
+		if (rd->blocks < CHIP_BLOCKS)
+			printf("No bad block table, it is in the last %d blocks and there are only %u\n", BBT_SCAN_BLOCKS, rd->blocks);
+		else
+			printf("No bad block table in the last %d blocks\n", BBT_SCAN_BLOCKS);
+	} else {
+		for (block = 0; block < CHIP_BLOCKS; block++) {
+			code = table[BBT_TABLE_OFFSET + block / 4] >> (block % 4 * 2) & 3;
+			// read_bbt(): 11 good, 00 factory bad, anything else worn
+			bb->state[block] = code == 3 ? BLOCK_GOOD : code == 0 ? BLOCK_FACTORY_BAD : BLOCK_WORN;
+			listed += code != 3;
+		}
+	}
+	// the table's own blocks read as 00, but they are fine to read
+	for (t = 0; t < 2; t++) {
+		if ((v = t == 0 ? bb->table_block : bb->mirror_block) < 0)
+			continue;
+		listed -= bb->state[v] != BLOCK_GOOD;
+		bb->state[v] = BLOCK_RESERVED;
+	}
+
+	printf("Scanning the factory bad block markers of %u blocks\n", rd->blocks);
+	for (block = 0; block < rd->blocks && block < CHIP_BLOCKS; block++) {
+		if (block % 128 == 0 || block == rd->blocks - 1) {
+			printf("Block %u of %u\r", block + 1, rd->blocks);
+			fflush(stdout);
+		}
+		if (bb->state[block] == BLOCK_RESERVED)
+			continue;
+		for (p = 0; p < BBM_PAGES; p++) {
+			if (rd->read(rd->ctx, block * PAGES_PER_BLOCK + p, 1 << 3, page) < 0)
+				return -1;
+			code = page[BBM_COLUMN];
+			if (code != 0xFF && (have_key[p] ? code != key[p][BBM_COLUMN - 3 * SECTOR_SIZE] : code == 0x00))
+				break;
+		}
+		if (p == BBM_PAGES)
+			continue;
+		marked++;
+		if (bb->state[block] == BLOCK_GOOD) {
+			if (bb->version >= 0)
+				printf("\nBlock %u: factory marker in page %u, but good in the table\n", block, p);
+			bb->state[block] = BLOCK_FACTORY_BAD;
+			unlisted++;
+		}
+	}
+	printf("\n");
+
+	for (block = 0; block < CHIP_BLOCKS; block++) {
+		if (bb->state[block] != BLOCK_WORN && bb->state[block] != BLOCK_FACTORY_BAD)
+			continue;
+		bb->bitmap[block / 64] |= 1ULL << (block % 64);
+		bb->bad++;
+	}
+	printf("%u bad blocks: %u in the table, %u factory markers (%u not in the table)\n", bb->bad, listed, marked, unlisted);
+	return 0;
+}
+
+void bbt_print(const struct bad_blocks *bb) {
+	unsigned int block;
+
+	for (block = 0; block < bb->blocks; block++)
+		if (bb->state[block] != BLOCK_GOOD)
+			printf("block %4u  pages %6u .. %6u  %s\n", block, block * PAGES_PER_BLOCK,
+			    (block + 1) * PAGES_PER_BLOCK - 1, state_name[bb->state[block] & 3]);
+}
+
+int bbt_save(const struct bad_blocks *bb) {
+	char dir[256], *p;
+	FILE *fp;
+
+	snprintf(dir, sizeof(dir), "%s", BBT_FILE);
+	if ((p = strrchr(dir, '/')) != NULL) {
+		*p = '\0';
+		if (make_dirs(dir) < 0)
+			return -1;
+	}
+	if ((fp = fopen(BBT_FILE, "wb")) == NULL) {
+		perror(BBT_FILE);
+		return -1;
+	}
+	if (fwrite(bb, sizeof(*bb), 1, fp) != 1) {
+		perror(BBT_FILE);
+		fclose(fp);
+		return -1;
+	}
+	if (fclose(fp) != 0) {
+		perror(BBT_FILE);
+		return -1;
+	}
+	return 0;
+}
+
+int bbt_load(struct bad_blocks *bb) {
+	FILE *fp;
+	size_t n;
+
+	memset(bb, 0, sizeof(*bb));
+	if ((fp = fopen(BBT_FILE, "rb")) == NULL)
+		return -1;
+	n = fread(bb, sizeof(*bb), 1, fp);
+	fclose(fp);
+	if (n != 1 || memcmp(bb->magic, BBT_MAGIC, sizeof(bb->magic)) != 0 || bb->blocks != CHIP_BLOCKS) {
+		printf(BBT_FILE " is not a bad block table of this chip, ignored\n");
+		memset(bb, 0, sizeof(*bb));
+		return -1;
+	}
+	return 0;
+}
+
+static int dump_read(void *ctx, unsigned int page, unsigned int sectors, unsigned char *buf) {
+	const struct dump_image *img = (const struct dump_image *)ctx;
+	int s;
+
+	if (page >= img->pages)
+		return -1;
+	for (s = 0; s < SECTORS_PER_PAGE; s++)
+		if (sectors & 1 << s)
+			memcpy(buf + s * SECTOR_SIZE, dump_page(img, page) + s * SECTOR_SIZE, SECTOR_SIZE);
+	return 0;
+}
+
+int bbt_dump(char *infile, char *xordir) {
+	struct dump_image img;
+	struct bbt_reader rd;
+	struct bad_blocks *bb;
+	int ret = -1;
+
+	if (dump_open(&img, infile) < 0)
+		return -1;
+	if ((bb = (struct bad_blocks *)malloc(sizeof(*bb))) == NULL) {
+		perror("malloc");
+		dump_close(&img);
+		return -1;
+	}
+	rd.read = dump_read;
+	rd.ctx = &img;
+	rd.blocks = img.pages / PAGES_PER_BLOCK;
+	if (bbt_build(bb, &rd, &img, xordir) == 0) {
+		bbt_print(bb);
+		if (bbt_save(bb) == 0) {
+			printf("Written to " BBT_FILE ", the chip commands skip these blocks\n");
+			ret = 0;
+		}
+	}
+	free(bb);
+	dump_close(&img);
+	return ret;
+}
@@ -0,0 +1,267 @@
+/*
+    build_image command for rpi-raw-nand
+
+    The way back from partitions: turn a plain partition image into raw
+    pages write_full can put on the chip. For every page of the partition
+
+        data      3 * 1024 bytes of the image per page, or the ubiData()
+                  block layout for persist/userdata (see gpt.c)
+        FDM       the 8 free bytes the page had in the raw dump, else 0xFF
+        parity    BCH over data + protected FDM byte (mtk_ecc.c)
+        scramble  sectors 0 .. 2 XORed with the page % 64 key, sector 3
+                  is the key itself, as read_full finds it
+
+    A page of the image that is all 0xFF stays erased: no parity, not
+    scrambled. Blocks are built in parallel straight into the mapped output.
+
+    With a raw dump the output is that dump with the partition replaced,
+    the GPT found in its descrambled pages and the keys taken from it as
+    descramble does; write it with write_full 0 <pages>. Without one only
+    the partition's pages are built, placed by the built-in table; the
+    file still has chip page n at page n (a hole before the partition), as
+    write_full reads it, so write it with write_full <first page> <pages>.
+    The command prints which.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+
+#define GPT_PAGES 16 // header and entries, descrambled to find the partitions
+
+struct build_job {
+	const struct dump_image *base;  // raw dump, or NULL
+	const struct dump_image *image; // partition image
+	struct dump_image *out;
+	struct partition part;
+	unsigned int first_block;       // run_parallel() item 0; output page n is chip page n
+	int ubi;
+	unsigned char keys[PAGES_PER_BLOCK][SECTOR_SIZE];
+	unsigned long pages, erased;
+};
+
+// the image bytes of partition page <p>, NULL where the image has none; 3 * 1024 bytes
+static const unsigned char *image_bytes(const struct build_job *job, unsigned int p, size_t *avail) {
+	size_t off;
+
+	if (job->ubi) {
+		// ubiData(): pages 0 and 1 at 4096 each, the rest collapsed
+		off = (size_t)(p / PAGES_PER_BLOCK) * UBI_PEB_SIZE;
+		if (p % PAGES_PER_BLOCK < 2)
+			off += (p % PAGES_PER_BLOCK) * 4096;
+		else
+			off += 2 * 4096 + (p % PAGES_PER_BLOCK - 2) * PAGE_DATA;
+	} else {
+		off = (size_t)p * PAGE_DATA;
+	}
+	if (off >= job->image->size)
+		return NULL;
+	*avail = job->image->size - off;
+	return job->image->data + off;
+}
+
+static void build_page(struct build_job *job, unsigned int p, unsigned char *out) {
+	const unsigned char *data, *key = job->keys[(job->part.first_page + p) % PAGES_PER_BLOCK];
+	const unsigned char *raw = NULL;
+	unsigned char sector[SECTOR_SIZE], *dst;
+	size_t avail = 0;
+	int s, i;
+
+	data = image_bytes(job, p, &avail);
+	if (avail > PAGE_DATA)
+		avail = PAGE_DATA;
+	if (data == NULL || all_ff(data, avail)) {
+		memset(out, 0xFF, PAGE_SIZE);
+		__atomic_fetch_add(&job->erased, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (job->base != NULL)
+		raw = dump_page(job->base, job->part.first_page + p);
+
+	for (s = 0; s < SECTORS_PER_PAGE - 1; s++) {
+		memset(sector, 0xFF, SECTOR_SIZE);
+		if (avail > (size_t)s * SECTOR_DATA)
+			memcpy(sector, data + s * SECTOR_DATA, avail - s * SECTOR_DATA < SECTOR_DATA ? avail - s * SECTOR_DATA : SECTOR_DATA);
+		// keep the FDM (bad block mark, file system bytes) the page had
+		if (raw != NULL && !all_ff(raw + s * SECTOR_SIZE, SECTOR_SIZE))
+			for (i = SECTOR_DATA; i < ECC_PARITY_OFFSET; i++)
+				sector[i] = raw[s * SECTOR_SIZE + i] ^ key[i];
+		ecc_encode(sector, sector + ECC_PARITY_OFFSET);
+		dst = out + s * SECTOR_SIZE;
+		for (i = 0; i < SECTOR_SIZE; i++)
+			dst[i] = sector[i] ^ key[i];
+	}
+	memcpy(out + (SECTORS_PER_PAGE - 1) * SECTOR_SIZE, key, SECTOR_SIZE);
+}
+
+static void build_block(void *ctx, unsigned long block, int worker) {
+	struct build_job *job = (struct build_job *)ctx;
+	unsigned int page = (job->first_block + block) * PAGES_PER_BLOCK;
+	unsigned int last = page + PAGES_PER_BLOCK;
+
+	(void)worker;
+	if (last > job->out->pages)
+		last = job->out->pages;
+	for (; page < last; page++) {
+		if (page >= job->part.first_page && page - job->part.first_page < job->part.pages) {
+			build_page(job, page - job->part.first_page, dump_page(job->out, page));
+			__atomic_fetch_add(&job->pages, 1, __ATOMIC_RELAXED);
+		} else if (job->base != NULL) {
+			memcpy(dump_page(job->out, page), dump_page(job->base, page), PAGE_SIZE);
+		} else {
+			memset(dump_page(job->out, page), 0xFF, PAGE_SIZE);
+		}
+	}
+}
+
+// dump_open() wants whole pages, the image is plain bytes
+static int map_image(const char *file, struct dump_image *img, size_t capacity, const char *partname) {
+	struct stat st;
+
+	if ((img->fd = open(file, O_RDONLY)) < 0 || fstat(img->fd, &st) < 0) {
+		perror(file);
+		return -1;
+	}
+	if ((size_t)st.st_size > capacity) {
+		printf("%s is %lu bytes, %s holds %lu\n", file, (unsigned long)st.st_size, partname, (unsigned long)capacity);
+		return -1;
+	}
+	img->size = st.st_size;
+	if (img->size == 0)
+		return 0;
+	img->data = (unsigned char *)mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+	if (img->data == MAP_FAILED) {
+		perror(file);
+		img->data = NULL;
+		return -1;
+	}
+	madvise(img->data, img->size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+// the partitions of a raw dump: descramble the GPT pages into a scratch image
+static int raw_partitions(const struct dump_image *base, const char *xordir, struct partition *parts) {
+	struct dump_image gpt;
+	unsigned char key[SECTOR_SIZE];
+	struct rand_model model;
+	unsigned int page;
+	int s, i, n, have_model;
+
+	gpt = *base;
+	gpt.data = (unsigned char *)mmap(NULL, base->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (gpt.data == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	have_model = rand_load(&model, xordir) == 0;
+	// only these pages get touched, the rest of the mapping stays unbacked
+	for (page = 0; page < GPT_PAGES && page < base->pages; page++) {
+		if (load_xor_key(base, page % PAGES_PER_BLOCK, xordir, have_model ? &model : NULL, key) == XOR_KEY_NONE)
+			continue;
+		for (s = 0; s < SECTORS_PER_PAGE - 1; s++)
+			for (i = 0; i < SECTOR_SIZE; i++)
+				dump_page(&gpt, page)[s * SECTOR_SIZE + i] = dump_page(base, page)[s * SECTOR_SIZE + i] ^ key[i];
+	}
+	n = read_partitions(&gpt, parts, MAX_PARTITIONS);
+	munmap(gpt.data, base->size);
+	return n;
+}
+
+int build_image(char *imagefile, char *partname, char *outfile, char *basefile, char *xordir) {
+	struct dump_image image, base, out, none;
+	struct partition parts[MAX_PARTITIONS];
+	struct build_job *job;
+	size_t capacity;
+	struct rand_model model;
+	double start, seconds;
+	unsigned int first;
+	int n, i, mod, have_model, missing = 0, ret = -1;
+
+	if (ecc_init() < 0 || (job = (struct build_job *)calloc(1, sizeof(*job))) == NULL)
+		return -1;
+	memset(&image, 0, sizeof(image));
+	memset(&base, 0, sizeof(base));
+	image.fd = base.fd = -1;
+	if (basefile != NULL) {
+		if (dump_open(&base, basefile) < 0)
+			goto out;
+		job->base = &base;
+		n = raw_partitions(&base, xordir, parts);
+	} else {
+		memset(&none, 0, sizeof(none));
+		n = read_partitions(&none, parts, MAX_PARTITIONS); // the built-in table
+	}
+	for (i = 0; i < n && strcmp(parts[i].name, partname) != 0; i++)
+		;
+	if (i >= n) {
+		printf("no partition %s\n", partname);
+		goto out;
+	}
+	job->part = parts[i];
+	job->ubi = is_ubi(&job->part);
+	if (basefile != NULL && job->part.first_page + job->part.pages > base.pages) {
+		printf("%s ends after the dump (page %u)\n", partname, base.pages);
+		goto out;
+	}
+
+	capacity = job->ubi ? (size_t)(job->part.pages / PAGES_PER_BLOCK) * UBI_PEB_SIZE : (size_t)job->part.pages * PAGE_DATA;
+	if (map_image(imagefile, &image, capacity, partname) < 0)
+		goto out;
+	job->image = &image;
+
+	have_model = rand_load(&model, xordir) == 0;
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++) {
+		if (load_xor_key(job->base, mod, xordir, have_model ? &model : NULL, job->keys[mod]) == XOR_KEY_NONE) {
+			printf("no key for page %% 64 = %d\n", mod);
+			missing++;
+		}
+	}
+	if (missing) {
+		printf("%d keys missing, run xor_keys (and rand_fit) on a dump first\n", missing);
+		goto out;
+	}
+
+	if (basefile != NULL) {
+		job->first_block = 0;
+		first = 0;
+		if (dump_create(&out, outfile, (size_t)base.pages * PAGE_SIZE) < 0)
+			goto out;
+	} else {
+		job->first_block = job->part.first_page / PAGES_PER_BLOCK;
+		first = job->part.first_page;
+		if (dump_create(&out, outfile, (size_t)(job->part.first_page + job->part.pages) * PAGE_SIZE) < 0)
+			goto out;
+	}
+	job->out = &out;
+
+	printf("Building %s (pages %u .. %u%s) from %s\n", partname, job->part.first_page,
+	    job->part.first_page + job->part.pages - 1, job->ubi ? ", UBI layout" : "", imagefile);
+	start = wall_clock();
+	run_parallel((out.pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK - job->first_block, 0, build_block, job);
+	seconds = wall_clock() - start;
+	printf("Built %lu pages (%lu left erased) in %.2f s (%.0f MB/s)\n", job->pages, job->erased, seconds,
+	    seconds > 0 ? (out.pages - first) * (double)PAGE_SIZE / (1 << 20) / seconds : 0.0);
+	printf("Write it with: write_full %u %u %s\n", first, out.pages - first, outfile);
+	dump_close(&out);
+	ret = 0;
+
+out:
+	dump_close(&image);
+	if (job->base != NULL)
+		dump_close(&base);
+	free(job);
+	return ret;
+}
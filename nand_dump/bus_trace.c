@@ -0,0 +1,206 @@
+/*
+    Bus activity trace for rpi-raw-nand, see bus_trace.h
+
+    The ring is single producer (the thread driving the bus) and single
+    consumer (the VCD writer). When it is full the producer waits for the
+    writer instead of dropping transitions, so memory stays bounded at
+    TRACE_RING_SIZE records and the waveform stays complete; the number of
+    such stalls is reported when the trace is closed.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "bus_trace.h"
+#include "nand_pins.h"
+
+#define TRACE_RING_SIZE (1 << 20) // records, 16 bytes each
+#define MAX_GPIO        64
+
+struct trace_record {
+	uint64_t ns;
+	uint8_t signal;
+	uint8_t value;
+};
+
+static const char *vcd_names[TRACE_IO0] = { "WP_n", "ALE", "CE_n", "WE_n", "RB_n", "RE_n", "CLE" };
+
+static struct trace_record *ring;
+static unsigned long head;      // next record, written by the producer
+static unsigned long tail;      // next record to write out, written by the writer
+static unsigned long stalls;
+static int stop;
+static int tracing;
+
+static signed char gpio_signal[MAX_GPIO];
+static signed char last_value[TRACE_SIGNALS];
+static uint64_t start_ns;
+
+static FILE *vcd;
+static pthread_t writer;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_push(uint64_t ns, int signal, int value) {
+	unsigned long h = head;
+
+	if (last_value[signal] == value)
+		return;
+	last_value[signal] = value;
+
+	// ring full: wait for the writer
+	while (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+		stalls++;
+		sched_yield();
+	}
+	ring[h % TRACE_RING_SIZE].ns = ns;
+	ring[h % TRACE_RING_SIZE].signal = signal;
+	ring[h % TRACE_RING_SIZE].value = value;
+	__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+void trace_gpio(int gpio, int value) {
+	if (!tracing || gpio < 0 || gpio >= MAX_GPIO || gpio_signal[gpio] < 0)
+		return;
+	trace_push(now_ns() - start_ns, gpio_signal[gpio], value != 0);
+}
+
+void trace_signal_at(uint64_t ns, int signal, int value) {
+	if (!tracing || signal < 0 || signal >= TRACE_SIGNALS)
+		return;
+	trace_push(ns, signal, value != 0);
+}
+
+static void write_io(unsigned io) {
+	int bit;
+
+	fputc('b', vcd);
+	for (bit = 7; bit >= 0; bit--)
+		fputc(io & (1 << bit) ? '1' : '0', vcd);
+	fputs(" (\n", vcd);
+}
+
+static void *trace_writer(void *arg) {
+	struct trace_record *r;
+	uint64_t last_ns = 0;
+	unsigned long h, t = 0;
+	unsigned io = 0;
+	struct timespec pause = { 0, 1000000 };
+	int first = 1, io_changed = 0;
+
+	(void)arg;
+	for (;;) {
+		h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		if (t == h) {
+			if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE) && t == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+				break;
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		for (; t != h; t++) {
+			r = &ring[t % TRACE_RING_SIZE];
+			// GTKWave wants time to only go forward
+			if (first || r->ns > last_ns) {
+				// the I/O bits of one time step go out as one vector change
+				if (io_changed)
+					write_io(io);
+				io_changed = 0;
+				if (!first || r->ns > 0)
+					fprintf(vcd, "#%llu\n", (unsigned long long)r->ns);
+				last_ns = r->ns;
+				first = 0;
+			}
+			if (r->signal >= TRACE_IO0) {
+				io = (io & ~(1u << (r->signal - TRACE_IO0))) | (r->value << (r->signal - TRACE_IO0));
+				io_changed = 1;
+			} else {
+				fprintf(vcd, "%d%c\n", r->value, '!' + r->signal);
+			}
+		}
+		if (io_changed)
+			write_io(io);
+		io_changed = 0;
+		__atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+int trace_open(const char *vcdfile) {
+	static const int data_map[8] = DATA_TO_GPIO_MAP;
+	time_t now = time(NULL);
+	int i;
+
+	if ((ring = (struct trace_record *)malloc(TRACE_RING_SIZE * sizeof(*ring))) == NULL) {
+		perror("malloc trace ring");
+		return -1;
+	}
+	if ((vcd = fopen(vcdfile, "w")) == NULL) {
+		perror("fopen trace file");
+		free(ring);
+		return -1;
+	}
+
+	memset(gpio_signal, -1, sizeof(gpio_signal));
+	gpio_signal[WRITE_PROTECT] = TRACE_WP;
+	gpio_signal[ADDRESS_LATCH_ENABLE] = TRACE_ALE;
+	gpio_signal[CHIP_ENABLE] = TRACE_CE;
+	gpio_signal[WRITE_ENABLE] = TRACE_WE;
+	gpio_signal[READY_BUSY] = TRACE_RB;
+	gpio_signal[READ_ENABLE] = TRACE_RE;
+	gpio_signal[COMMAND_LATCH_ENABLE] = TRACE_CLE;
+	for (i = 0; i < 8; i++)
+		gpio_signal[data_map[i]] = TRACE_IO0 + i;
+	memset(last_value, -1, sizeof(last_value));
+
+	fprintf(vcd, "$date %s$end\n", ctime(&now));
+	fprintf(vcd, "$version rpi-raw-nand bus trace $end\n");
+	fprintf(vcd, "$timescale 1ns $end\n");
+	fprintf(vcd, "$scope module nand $end\n");
+	for (i = 0; i < TRACE_IO0; i++)
+		fprintf(vcd, "$var wire 1 %c %s $end\n", '!' + i, vcd_names[i]);
+	fprintf(vcd, "$var wire 8 ( IO [7:0] $end\n");
+	fprintf(vcd, "$upscope $end\n");
+	fprintf(vcd, "$enddefinitions $end\n");
+	fprintf(vcd, "#0\n$dumpvars\n");
+	for (i = 0; i < TRACE_IO0; i++)
+		fprintf(vcd, "x%c\n", '!' + i);
+	fprintf(vcd, "bxxxxxxxx (\n$end\n");
+
+	head = tail = stalls = 0;
+	stop = 0;
+	start_ns = now_ns();
+	if (pthread_create(&writer, NULL, trace_writer, NULL) != 0) {
+		perror("pthread_create trace writer");
+		fclose(vcd);
+		free(ring);
+		return -1;
+	}
+	tracing = 1;
+	atexit(trace_close);
+	return 0;
+}
+
+void trace_close(void) {
+	if (!tracing)
+		return;
+	tracing = 0;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	fclose(vcd);
+	free(ring);
+	printf("Bus trace: %lu transitions written, producer waited %lu times on a full ring\n", head, stalls);
+}
@@ -0,0 +1,44 @@
+/*
+    Bus activity trace for rpi-raw-nand
+
+    With -DBUS_TRACE every pin transition the GPIO backend makes or samples
+    (and every cycle the FT2232H mock simulates) is time stamped in ns and
+    put in a fixed size ring. A background thread empties the ring into a
+    Value Change Dump file that GTKWave can show next to a logic analyzer
+    capture. Without BUS_TRACE the hooks compile to nothing.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef BUS_TRACE_H
+#define BUS_TRACE_H
+
+#include <stdint.h>
+
+// traced signals, the order is the order in the VCD file
+enum {
+	TRACE_WP, TRACE_ALE, TRACE_CE, TRACE_WE, TRACE_RB, TRACE_RE, TRACE_CLE,
+	TRACE_IO0, TRACE_SIGNALS = TRACE_IO0 + 8
+};
+
+#ifdef BUS_TRACE
+
+int trace_open(const char *vcdfile);
+void trace_close(void);
+void trace_gpio(int gpio, int value);                       // GPIO number from nand_pins.h, now
+void trace_signal_at(uint64_t ns, int signal, int value);   // simulated time
+
+#define TRACE_GPIO(g, v)             trace_gpio(g, v)
+#define TRACE_SIGNAL_AT(ns, sig, v)  trace_signal_at(ns, sig, v)
+
+#else
+
+#define TRACE_GPIO(g, v)             do { } while (0)
+#define TRACE_SIGNAL_AT(ns, sig, v)  do { } while (0)
+
+#endif
+
+#endif
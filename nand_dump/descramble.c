@@ -0,0 +1,206 @@
+/*
+    descramble command for rpi-raw-nand
+
+    The native version of FlashDumpReader.descramble() in
+    descramble/dumpreader.js. Every page uses one of 64 keys of SECTOR_SIZE
+    bytes, picked by page % 64, the same way the JS picks them:
+
+        mod 0       sector 2 of page 0 of the dump
+        mod 1 .. 4  sector 3 of page 1 .. 4
+        other       generated from <xordir>/seeds.txt (rand_fit) if the
+                    LFSR model has a seed for it, else
+                    <xordir>/<mod>_xor.bin if it is there
+        otherwise   guessed for each page from its own four sectors
+
+    Sectors 0 .. 2 of a page are XORed with the key, sector 3 becomes 0xFF;
+    pages starting with 0xFF are erased and copied as they are.
+
+    Input and output are both mapped, the XOR goes straight from one mapping
+    into the other 32 bytes at a time (SECTOR_SIZE is 34 of those), and the
+    blocks are spread over all cores. Build with -march=native to get AVX2
+    for the vector type, plain -O2 gives SSE2 pairs.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "nand_dump.h"
+
+typedef unsigned char xor_vec __attribute__((vector_size(32)));
+
+#define XOR_VECS (SECTOR_SIZE / sizeof(xor_vec))
+
+// the pages known to hold a usable key, dumpreader.js xorMap
+static const struct { int mod, page, sector; } xor_map[] = {
+	{ 0, 0, 2 },
+	{ 1, 1, 3 },
+	{ 2, 2, 3 },
+	{ 3, 3, 3 },
+	{ 4, 4, 3 },
+};
+
+struct descramble_job {
+	const struct dump_image *in;
+	struct dump_image *out;
+	unsigned char (*keys)[SECTOR_SIZE];
+	int have_key[PAGES_PER_BLOCK];
+	unsigned long guessed[PAGES_PER_BLOCK]; // per page % 64, summed by the workers
+};
+
+int load_xor_key(const struct dump_image *img, int mod, const char *xordir, const struct rand_model *model,
+    unsigned char key[SECTOR_SIZE]) {
+	char file[256];
+	FILE *fp;
+	unsigned int i;
+	size_t n;
+
+	for (i = 0; i < sizeof(xor_map) / sizeof(xor_map[0]); i++) {
+		if (img != NULL && xor_map[i].mod == mod && (unsigned int)xor_map[i].page < img->pages) {
+			memcpy(key, dump_page(img, xor_map[i].page) + xor_map[i].sector * SECTOR_SIZE, SECTOR_SIZE);
+			return XOR_KEY_PAGE;
+		}
+	}
+
+	// a fitted randomizer model beats a statistical key
+	if (model != NULL && model->have_seed[mod]) {
+		rand_stream(model, model->seed[mod], key, SECTOR_SIZE);
+		return XOR_KEY_MODEL;
+	}
+
+	snprintf(file, sizeof(file), "%s/%d_xor.bin", xordir, mod);
+	if ((fp = fopen(file, "rb")) == NULL)
+		return XOR_KEY_NONE;
+	n = fread(key, 1, SECTOR_SIZE, fp);
+	fclose(fp);
+	if (n != SECTOR_SIZE) {
+		printf("%s: short key (%lu bytes), ignored\n", file, (unsigned long)n);
+		return XOR_KEY_NONE;
+	}
+	return XOR_KEY_FILE;
+}
+
+// Page.guessXor(): a value that shows up in two sectors at the same offset is
+// most likely the key over a run of identical (padding) data
+static void guess_xor_key(const unsigned char *page, unsigned char key[SECTOR_SIZE]) {
+	const unsigned char *s0 = page, *s1 = page + SECTOR_SIZE;
+	const unsigned char *s2 = page + 2 * SECTOR_SIZE, *s3 = page + 3 * SECTOR_SIZE;
+	int i;
+
+	for (i = 0; i < SECTOR_SIZE; i++) {
+		if (s3[i] == s2[i] || s3[i] == s1[i] || s3[i] == s0[i])
+			key[i] = s3[i];
+		else if (s2[i] == s1[i] || s2[i] == s0[i])
+			key[i] = s2[i];
+		else
+			key[i] = 0x00;
+	}
+}
+
+static void xor_sector(unsigned char *out, const unsigned char *in, const unsigned char *key) {
+	xor_vec a, k;
+	unsigned int i;
+
+	// memcpy keeps it legal for any alignment, gcc turns it into plain vector loads
+	for (i = 0; i < XOR_VECS; i++) {
+		memcpy(&a, in + i * sizeof(xor_vec), sizeof(xor_vec));
+		memcpy(&k, key + i * sizeof(xor_vec), sizeof(xor_vec));
+		a ^= k;
+		memcpy(out + i * sizeof(xor_vec), &a, sizeof(xor_vec));
+	}
+}
+
+static void descramble_block(void *ctx, unsigned long block, int worker) {
+	struct descramble_job *job = (struct descramble_job *)ctx;
+	unsigned int page = block * PAGES_PER_BLOCK;
+	unsigned int last = page + PAGES_PER_BLOCK;
+	unsigned char guessed[SECTOR_SIZE];
+	const unsigned char *in, *key;
+	unsigned char *out;
+	int mod, s;
+
+	(void)worker;
+	if (last > job->in->pages)
+		last = job->in->pages;
+	for (; page < last; page++) {
+		in = dump_page(job->in, page);
+		out = dump_page(job->out, page);
+		mod = page % PAGES_PER_BLOCK;
+
+		// erased page, keep it
+		if (in[0] == 0xFF) {
+			memcpy(out, in, PAGE_SIZE);
+			continue;
+		}
+
+		if (job->have_key[mod]) {
+			key = job->keys[mod];
+		} else {
+			guess_xor_key(in, guessed);
+			key = guessed;
+			__atomic_fetch_add(&job->guessed[mod], 1, __ATOMIC_RELAXED);
+		}
+		for (s = 0; s < SECTORS_PER_PAGE - 1; s++)
+			xor_sector(out + s * SECTOR_SIZE, in + s * SECTOR_SIZE, key);
+		memset(out + (SECTORS_PER_PAGE - 1) * SECTOR_SIZE, 0xFF, SECTOR_SIZE);
+	}
+}
+
+int descramble_dump(char *infile, char *outfile, char *xordir) {
+	static const char *key_source[] = { "none, guessed per page", "dump", "file", "LFSR model" };
+	struct dump_image in, out;
+	struct descramble_job job;
+	unsigned long guessed = 0;
+	unsigned int blocks;
+	struct rand_model model;
+	double start, seconds;
+	int mod, src, have_model;
+
+	if (dump_open(&in, infile) < 0)
+		return -1;
+	if (dump_create(&out, outfile, (size_t)in.pages * PAGE_SIZE) < 0) {
+		dump_close(&in);
+		return -1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.in = &in;
+	job.out = &out;
+	if ((job.keys = malloc(PAGES_PER_BLOCK * SECTOR_SIZE)) == NULL) {
+		perror("malloc keys");
+		dump_close(&out);
+		dump_close(&in);
+		return -1;
+	}
+
+	have_model = rand_load(&model, xordir) == 0;
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++) {
+		src = load_xor_key(&in, mod, xordir, have_model ? &model : NULL, job.keys[mod]);
+		job.have_key[mod] = src != XOR_KEY_NONE;
+		printf("key %2d: from %s\n", mod, key_source[src]);
+	}
+
+	blocks = (in.pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+	printf("Descrambling %u pages (%u blocks) on %d threads\n", in.pages, blocks, worker_count());
+	start = wall_clock();
+	run_parallel(blocks, 0, descramble_block, &job);
+	seconds = wall_clock() - start;
+
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++)
+		guessed += job.guessed[mod];
+	if (guessed)
+		printf("%lu pages had no key and were descrambled with a guessed one\n", guessed);
+	printf("Descrambled %lu MB in %.2f s (%.0f MB/s) into %s\n", (unsigned long)(in.size >> 20), seconds,
+	    seconds > 0 ? (in.pages * (double)PAGE_SIZE / (1 << 20)) / seconds : 0.0, outfile);
+
+	free(job.keys);
+	dump_close(&out);
+	dump_close(&in);
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*
+    Memory mapped dump files (archives inflated, see archive.c) and a small
+    work splitter, see nand_dump.h
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+
+int dump_open(struct dump_image *img, const char *file) {
+	struct stat st;
+
+	if (is_archive(file))
+		return archive_load(img, file);
+	memset(img, 0, sizeof(*img));
+	if ((img->fd = open(file, O_RDONLY)) < 0) {
+		perror("open dump");
+		return -1;
+	}
+	if (fstat(img->fd, &st) < 0) {
+		perror("fstat dump");
+		close(img->fd);
+		return -1;
+	}
+	img->size = st.st_size;
+	img->pages = img->size / PAGE_SIZE;
+	if (img->pages == 0) {
+		printf("%s holds no complete page\n", file);
+		close(img->fd);
+		return -1;
+	}
+	img->data = (unsigned char *)mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+	if (img->data == MAP_FAILED) {
+		perror("mmap dump");
+		close(img->fd);
+		return -1;
+	}
+	// the workers walk the file front to back, roughly
+	madvise(img->data, img->size, MADV_SEQUENTIAL);
+	if (img->size % PAGE_SIZE)
+		printf("%s: ignoring %lu bytes after the last whole page\n", file, (unsigned long)(img->size % PAGE_SIZE));
+	return 0;
+}
+
+int dump_create(struct dump_image *img, const char *file, size_t size) {
+	memset(img, 0, sizeof(*img));
+	if ((img->fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open output");
+		return -1;
+	}
+	if (ftruncate(img->fd, size) < 0) {
+		perror("ftruncate output");
+		close(img->fd);
+		return -1;
+	}
+	img->size = size;
+	img->pages = size / PAGE_SIZE;
+	if (size == 0)
+		return 0;
+	img->data = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, 0);
+	if (img->data == MAP_FAILED) {
+		perror("mmap output");
+		close(img->fd);
+		return -1;
+	}
+	return 0;
+}
+
+void dump_close(struct dump_image *img) {
+	if (img->data != NULL && img->data != MAP_FAILED)
+		munmap(img->data, img->size);
+	if (img->fd >= 0)
+		close(img->fd);
+	img->data = NULL;
+	img->fd = -1;
+}
+
+int worker_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	return n > MAX_WORKERS ? MAX_WORKERS : (int)n;
+}
+
+struct parallel_job {
+	void (*fn)(void *ctx, unsigned long item, int worker);
+	void *ctx;
+	unsigned long items;
+	unsigned long next;
+};
+
+struct parallel_worker {
+	struct parallel_job *job;
+	int id;
+};
+
+static void *parallel_worker(void *arg) {
+	struct parallel_worker *w = (struct parallel_worker *)arg;
+	struct parallel_job *job = w->job;
+	unsigned long item;
+
+	// items are handed out one by one, a slow item does not hold up a whole share
+	while ((item = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->items)
+		job->fn(job->ctx, item, w->id);
+	return NULL;
+}
+
+void run_parallel(unsigned long items, int n, void (*fn)(void *ctx, unsigned long item, int worker), void *ctx) {
+	struct parallel_job job = { fn, ctx, items, 0 };
+	struct parallel_worker workers[MAX_WORKERS];
+	pthread_t threads[MAX_WORKERS];
+	int i;
+
+	if (n <= 0 || n > MAX_WORKERS)
+		n = worker_count();
+	if ((unsigned long)n > items)
+		n = items > 0 ? items : 1;
+	for (i = 0; i < n; i++) {
+		workers[i].job = &job;
+		workers[i].id = i;
+	}
+	// worker 0 is this thread
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, parallel_worker, &workers[i]) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	parallel_worker(&workers[0]);
+	while (--i > 0)
+		pthread_join(threads[i], NULL);
+}
+
+int write_all(int fd, const void *buf, size_t len, off_t offset) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(fd, buf, len, offset)) <= 0) {
+			perror("pwrite");
+			return -1;
+		}
+		buf = (const unsigned char *)buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+int erased_sector(const unsigned char *sector) {
+	int i, zeros;
+
+	// what the controller calls erased: a few 0 bits at most, never scrambled
+	for (i = 0, zeros = 0; i < SECTOR_SIZE && zeros <= ECC_T; i++)
+		zeros += 8 - __builtin_popcount(sector[i]);
+	return zeros <= ECC_T;
+}
+
+int all_ff(const unsigned char *p, size_t len) {
+	while (len--)
+		if (*p++ != 0xFF)
+			return 0;
+	return 1;
+}
+
+int make_dirs(const char *path) {
+	char dir[256];
+	char *p, c;
+
+	if (*path == '\0')
+		return 0;
+	if (strlen(path) >= sizeof(dir)) {
+		printf("path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(dir, path);
+	for (p = dir + 1; ; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		c = *p;
+		*p = '\0';
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			perror(dir);
+			return -1;
+		}
+		if ((*p = c) == '\0')
+			break;
+	}
+	return 0;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+	static uint32_t table[256];
+	static int ready;
+	const unsigned char *p = (const unsigned char *)buf;
+	uint32_t c;
+	int i, k;
+
+	if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+		// the same values whichever thread gets here first
+		for (i = 0; i < 256; i++) {
+			for (c = i, k = 0; k < 8; k++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+	}
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+int iov_flush(struct iov_writer *w) {
+	ssize_t n;
+	int i = 0;
+
+	while (i < w->count) {
+		n = pwritev(w->fd, w->iov + i, w->count - i, w->offset);
+		if (n <= 0) {
+			perror("pwritev");
+			return -1;
+		}
+		w->offset += n;
+		// skip what went out, a short write can end inside an iovec
+		for (; i < w->count && (size_t)n >= w->iov[i].iov_len; i++)
+			n -= w->iov[i].iov_len;
+		if (n > 0) {
+			w->iov[i].iov_base = (char *)w->iov[i].iov_base + n;
+			w->iov[i].iov_len -= n;
+		}
+	}
+	w->count = 0;
+	return 0;
+}
+
+int iov_add(struct iov_writer *w, const void *buf, size_t len) {
+	if (w->count == IOV_BATCH && iov_flush(w) < 0)
+		return -1;
+	w->iov[w->count].iov_base = (void *)buf;
+	w->iov[w->count].iov_len = len;
+	w->count++;
+	return 0;
+}
+
+double wall_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,306 @@
+/*
+    FT2232H bus backend for rpi-raw-nand
+
+    Channel A of the FT2232H runs in MCU host bus emulation mode, the same
+    setup dump_flash_tool/flashdevice.py uses:
+
+        AD0 .. AD7  -> I/O0 .. I/O7
+        RD#         -> RE#
+        WR#         -> WE#
+        AH4         -> CE#   (ADR_CE)
+        AH5         -> WP#   (ADR_WP)
+        AH6         -> CLE   (ADR_CL)
+        AH7         -> ALE   (ADR_AL)
+        I/O1        -> R/B#  (the pin "wait on I/O high" watches)
+
+    Every MPSSE read/write command is a single RE#/WE# cycle with the control
+    lines on the upper address byte. Nothing is sent until the tool needs an
+    answer (read_data or ready), so a page read - 00h, five address cycles,
+    30h, wait on R/B#, 4352 read cycles - is one USB write, and the page data
+    comes back in one USB read that is submitted before the write.
+
+    Build with -DFTDI_MOCK to run against ftdi_mock.c instead of libftdi.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef FTDI_MOCK
+#include "ftdi_mock.h"
+#else
+#include <ftdi.h>
+#endif
+
+#include "nand_bus.h"
+
+#define FT_VENDOR  0x0403
+#define FT_PRODUCT 0x6010 // FT2232H
+
+// control lines on the upper address byte
+#define ADR_CE 0x10 // Chip Enable, high = deselected
+#define ADR_WP 0x20 // Write Protect, high = writes allowed
+#define ADR_CL 0x40 // Command Latch Enable
+#define ADR_AL 0x80 // Address Latch Enable
+
+// MPSSE / MCU host bus emulation opcodes (FTDI AN_108)
+#define READ_SHORT       0x90
+#define READ_EXTENDED    0x91
+#define WRITE_SHORT      0x92
+#define WRITE_EXTENDED   0x93
+#define SEND_IMMEDIATE   0x87
+#define WAIT_ON_HIGH     0x88
+#define SET_BITS_HIGH    0x82
+#define GET_BITS_HIGH    0x83
+#define DISABLE_CLK_DIV5 0x8A
+#define ENABLE_CLK_DIV5  0x8B
+
+// R/B# as seen by GET_BITS_HIGH, flashdevice.py checks the same bits
+#define FT_RB_MASK 0x06
+
+// 1: clock the FT2232H at 12MHz instead of 60MHz. In this mode every read
+// cycle returns two bytes (seen with flashdevice.py), only the first is data.
+#define FT_SLOW_CLOCK 0
+
+#define FT_BUF_SIZE  65536
+#define FT_MAX_READ  16384 // read cycles per transfer, 2 command bytes each
+#define FT_TIMEOUT   1000  // ms for a read to come back, tBERS is 3.5 ms at most
+
+static struct ftdi_context *ftdi;
+static unsigned char cmd_buf[FT_BUF_SIZE];
+static int cmd_len;
+static int sent_hi = -1;        // upper address byte the FT2232H holds, -1 = unknown
+static unsigned char ctrl = ADR_WP | ADR_CE;
+static int ft_failed;
+
+#if FT_SLOW_CLOCK
+static unsigned char rx_buf[2 * FT_MAX_READ];
+#endif
+
+static void ft_error(const char *what) {
+	if (!ft_failed)
+		printf("\nFT2232H: %s: %s\n", what, ftdi_get_error_string(ftdi));
+	ft_failed = 1;
+}
+
+static long ft_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// ftdi_transfer_data_done() with a deadline, -1 when it passed. A
+// WAIT_ON_HIGH on an R/B# that never goes high stalls the FT2232H, which
+// still sends its two status bytes every latency period; libftdi submits
+// the read again on each, so no USB timeout ever ends it.
+static int ft_read_done(struct ftdi_transfer_control *tc, int timeout) {
+	struct timeval tv = { 0, 1000 };
+	long deadline = ft_ms() + timeout;
+
+	while (!tc->completed && ft_ms() < deadline)
+		libusb_handle_events_timeout_completed(ftdi->usb_ctx, &tv, &tc->completed);
+	if (!tc->completed) {
+		tv.tv_usec = 100000;
+		ftdi_transfer_data_cancel(tc, &tv);
+		return -1;
+	}
+	return ftdi_transfer_data_done(tc);
+}
+
+// send the queued commands, and collect in_len answer bytes
+static int ft_transfer(unsigned char *in, int in_len) {
+	struct ftdi_transfer_control *tc = NULL;
+	int ret = 0, n;
+
+	if (in_len > 0 && (tc = ftdi_read_data_submit(ftdi, in, in_len)) == NULL) {
+		ft_error("read submit");
+		ret = -1;
+	}
+	if (ret == 0 && cmd_len > 0 && ftdi_write_data(ftdi, cmd_buf, cmd_len) != cmd_len) {
+		ft_error("write");
+		ret = -1;
+	}
+	// after a failed write the answer never comes
+	if (tc != NULL && (n = ft_read_done(tc, ret == 0 ? FT_TIMEOUT : 0)) != in_len) {
+		if (n < 0 && ret == 0 && !ft_failed)
+			printf("\nFT2232H: no answer in %d ms, R/B# stuck low?\n", FT_TIMEOUT);
+		else
+			ft_error("read");
+		ft_failed = 1;
+		ret = -1;
+	}
+	cmd_len = 0;
+	if (ret < 0) {
+		sent_hi = -1;
+		memset(in, 0xFF, in_len);
+	}
+	return ret;
+}
+
+static void ft_reserve(int n) {
+	if (cmd_len + n > FT_BUF_SIZE)
+		ft_transfer(NULL, 0);
+}
+
+static void ft_queue_write(unsigned char lines, unsigned char data) {
+	ft_reserve(4);
+	if (lines != sent_hi) {
+		cmd_buf[cmd_len++] = WRITE_EXTENDED;
+		cmd_buf[cmd_len++] = lines;
+		sent_hi = lines;
+	} else {
+		cmd_buf[cmd_len++] = WRITE_SHORT;
+	}
+	cmd_buf[cmd_len++] = 0;
+	cmd_buf[cmd_len++] = data;
+}
+
+static void ft_queue_read(unsigned char lines) {
+	ft_reserve(3);
+	if (lines != sent_hi) {
+		cmd_buf[cmd_len++] = READ_EXTENDED;
+		cmd_buf[cmd_len++] = lines;
+		sent_hi = lines;
+	} else {
+		cmd_buf[cmd_len++] = READ_SHORT;
+	}
+	cmd_buf[cmd_len++] = 0;
+}
+
+static int ft2232h_open(void) {
+	if ((ftdi = ftdi_new()) == NULL) {
+		printf("ftdi_new failed\n");
+		return -1;
+	}
+	ftdi_set_interface(ftdi, INTERFACE_A);
+	if (ftdi_usb_open(ftdi, FT_VENDOR, FT_PRODUCT) < 0) {
+		printf("Open FT2232H: %s\n", ftdi_get_error_string(ftdi));
+		ftdi_free(ftdi);
+		ftdi = NULL;
+		return -1;
+	}
+
+	if (ftdi_set_bitmode(ftdi, 0, BITMODE_RESET) < 0 ||
+	    ftdi_set_bitmode(ftdi, 0, BITMODE_MCU) < 0) {
+		printf("FT2232H MCU mode: %s\n", ftdi_get_error_string(ftdi));
+		ftdi_usb_close(ftdi);
+		ftdi_free(ftdi);
+		ftdi = NULL;
+		return -1;
+	}
+	ftdi_set_latency_timer(ftdi, 1);
+	ftdi_write_data_set_chunksize(ftdi, FT_BUF_SIZE);
+	ftdi_read_data_set_chunksize(ftdi, FT_BUF_SIZE);
+	ftdi_usb_purge_buffers(ftdi);
+
+	cmd_len = 0;
+	sent_hi = -1;
+	ft_failed = 0;
+	cmd_buf[cmd_len++] = FT_SLOW_CLOCK ? ENABLE_CLK_DIV5 : DISABLE_CLK_DIV5;
+	return ft_transfer(NULL, 0);
+}
+
+static void ft2232h_close(void) {
+	if (ftdi == NULL)
+		return;
+	ft_transfer(NULL, 0);
+	ftdi_set_bitmode(ftdi, 0, BITMODE_RESET);
+	ftdi_usb_close(ftdi);
+	ftdi_free(ftdi);
+	ftdi = NULL;
+}
+
+static void ft2232h_init(int chips) {
+	// one CE# and one wait pin, chips > 1 is refused through max_chips
+	(void)chips;
+	ctrl = ADR_WP | ADR_CE;
+}
+
+static void ft2232h_select_chip(int chip) {
+	// takes effect with the next bus cycle
+	if (chip == 0)
+		ctrl &= ~ADR_CE;
+	else
+		ctrl |= ADR_CE;
+}
+
+static void ft2232h_command(unsigned char cmd) {
+	ft_queue_write(ctrl | ADR_CL, cmd);
+}
+
+static void ft2232h_address(const unsigned char *cycles, int count) {
+	int i;
+
+	for (i = 0; i < count; i++)
+		ft_queue_write(ctrl | ADR_AL, cycles[i]);
+}
+
+static void ft2232h_write_data(const unsigned char *buf, unsigned int len) {
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		ft_queue_write(ctrl, buf[i]);
+}
+
+static void ft2232h_read_data(unsigned char *buf, unsigned int len) {
+	unsigned int i, n;
+
+	while (len > 0) {
+		n = len > FT_MAX_READ ? FT_MAX_READ : len;
+		// room for all read cycles, nothing may be flushed in between
+		ft_reserve(3 * n + 1);
+		for (i = 0; i < n; i++)
+			ft_queue_read(ctrl);
+		cmd_buf[cmd_len++] = SEND_IMMEDIATE;
+#if FT_SLOW_CLOCK
+		ft_transfer(rx_buf, 2 * n);
+		for (i = 0; i < n; i++)
+			buf[i] = rx_buf[2 * i];
+#else
+		ft_transfer(buf, n);
+#endif
+		buf += n;
+		len -= n;
+	}
+}
+
+static int ft2232h_ready(int chip) {
+	unsigned char bits;
+
+	if (chip != 0)
+		return 0;
+	ft_reserve(2);
+	cmd_buf[cmd_len++] = GET_BITS_HIGH;
+	cmd_buf[cmd_len++] = SEND_IMMEDIATE;
+	if (ft_transfer(&bits, 1) < 0)
+		return 0;
+	return (bits & FT_RB_MASK) == FT_RB_MASK;
+}
+
+static int ft2232h_wait_ready(int chip) {
+	(void)chip;
+
+	// R/B# only drops tWB (100ns max) after the confirm command. Two write
+	// cycles with CE# high are ignored by the chip and cover that time.
+	ft_queue_write(ctrl | ADR_CE, 0);
+	ft_queue_write(ctrl | ADR_CE, 0);
+	// the MPSSE waits as long as R/B# stays low; ft_read_done() gives up
+	// on the answer after FT_TIMEOUT, and from then on this fails
+	ft_reserve(1);
+	cmd_buf[cmd_len++] = WAIT_ON_HIGH;
+	return ft_failed ? -1 : 0;
+}
+
+struct nand_bus ft2232h_bus = {
+	"ft2232h", 1,
+	ft2232h_open, ft2232h_close, ft2232h_init, ft2232h_select_chip,
+	ft2232h_command, ft2232h_address, ft2232h_write_data, ft2232h_read_data,
+	ft2232h_ready, ft2232h_wait_ready
+};
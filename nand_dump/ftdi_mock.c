@@ -0,0 +1,593 @@
+/*
+    Mock libftdi1 for the FT2232H backend, see ftdi_mock.h
+
+    Without a recording to replay, the mock decodes the MPSSE MCU host bus
+    commands the backend sends and answers them from a simulated
+    MX30LF4G28AD: read ID, status, page read (00h/30h), random data out
+    (05h/E0h), page program (80h/10h/15h) and block erase (60h/D0h). The
+    simulated array is a private mapping of FTDI_MOCK_IMAGE, programs and
+    erases never reach the file.
+
+    In a -DBUS_TRACE build the simulated pin activity goes to the bus trace,
+    on a simulated clock: four FT2232H clocks per bus cycle and datasheet
+    busy times for tR, tPROG and tBERS.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ftdi_mock.h"
+#include "bus_trace.h"
+
+#define MOCK_BLOCK_PAGES 64
+
+// control lines on the upper address byte, as wired in ft2232h_bus.c
+#define ADR_CE 0x10
+#define ADR_WP 0x20
+#define ADR_CL 0x40
+#define ADR_AL 0x80
+
+// simulated timing in ns
+#define SIM_CLOCK       17      // 60MHz, 83 with the clock divided by 5
+#define SIM_tWB         100
+#define SIM_tR          25000
+#define SIM_tPROG       300000
+#define SIM_tBERS       3000000
+
+static const unsigned char mock_id[6] = { 0xc2, 0xdc, 0x90, 0xa2, 0x57, 0x03 };
+
+// ---------------------------- recording ----------------------------
+
+static void log_transfer(struct ftdi_context *ftdi, char type, const unsigned char *buf, int size) {
+	unsigned char len[4];
+
+	if (ftdi->record == NULL)
+		return;
+	len[0] = size;
+	len[1] = size >> 8;
+	len[2] = size >> 16;
+	len[3] = size >> 24;
+	fputc(type, ftdi->record);
+	fwrite(len, 4, 1, ftdi->record);
+	fwrite(buf, 1, size, ftdi->record);
+}
+
+// next recorded transfer, returns its length or -1 at the end / on a type mismatch
+static int replay_next(struct ftdi_context *ftdi, char type, unsigned char **data) {
+	unsigned char len[4];
+	int type_read, size;
+
+	type_read = fgetc(ftdi->replay);
+	if (type_read == EOF || fread(len, 4, 1, ftdi->replay) != 1) {
+		ftdi->error_str = "replay: recording ends here";
+		return -1;
+	}
+	size = len[0] | (len[1] << 8) | (len[2] << 16) | (len[3] << 24);
+	if ((*data = (unsigned char *)malloc(size ? size : 1)) == NULL ||
+	    fread(*data, 1, size, ftdi->replay) != (size_t)size) {
+		ftdi->error_str = "replay: truncated recording";
+		free(*data);
+		return -1;
+	}
+	if (type_read != type) {
+		ftdi->error_str = type == 'W' ? "replay: got a write, recording has a read"
+		                               : "replay: got a read, recording has a write";
+		free(*data);
+		return -1;
+	}
+	return size;
+}
+
+// ---------------------------- simulated NAND ----------------------------
+
+static unsigned char *nand_page(struct ftdi_context *ftdi, unsigned int page) {
+	size_t offset = (size_t)page * MOCK_PAGE_SIZE;
+
+	if (ftdi->image == NULL || offset + MOCK_PAGE_SIZE > ftdi->image_size)
+		return NULL;
+	return ftdi->image + offset;
+}
+
+static unsigned int nand_row(struct ftdi_context *ftdi, int first) {
+	return ftdi->addr[first] | (ftdi->addr[first + 1] << 8) | (ftdi->addr[first + 2] << 16);
+}
+
+static uint64_t sim_clock(struct ftdi_context *ftdi) {
+	return ftdi->div5 ? 5 * SIM_CLOCK : SIM_CLOCK;
+}
+
+// R/B# drops after the confirm cycle, traced a bit early (tWB) so that
+// the trace never goes back in time
+static void sim_busy(struct ftdi_context *ftdi, uint64_t ns) {
+	TRACE_SIGNAL_AT(ftdi->sim_ns, TRACE_RB, 0);
+	ftdi->busy_until = ftdi->sim_ns + SIM_tWB + ns;
+}
+
+// R/B# high again, time skips ahead when something waits for it
+static void sim_ready(struct ftdi_context *ftdi) {
+	if (ftdi->busy_until == 0)
+		return;
+	if (ftdi->sim_ns < ftdi->busy_until)
+		ftdi->sim_ns = ftdi->busy_until;
+	TRACE_SIGNAL_AT(ftdi->busy_until, TRACE_RB, 1);
+	ftdi->busy_until = 0;
+}
+
+static void sim_io(struct ftdi_context *ftdi, uint64_t ns, unsigned char b) {
+	int i;
+
+	// TRACE_SIGNAL_AT() is empty without -DBUS_TRACE
+	(void)ftdi;
+	(void)ns;
+	(void)b;
+	for (i = 0; i < 8; i++)
+		TRACE_SIGNAL_AT(ns, TRACE_IO0 + i, (b >> i) & 1);
+}
+
+static void sim_lines(struct ftdi_context *ftdi) {
+	(void)ftdi;
+	TRACE_SIGNAL_AT(ftdi->sim_ns, TRACE_CE, (ftdi->hi & ADR_CE) != 0);
+	TRACE_SIGNAL_AT(ftdi->sim_ns, TRACE_WP, (ftdi->hi & ADR_WP) != 0);
+	TRACE_SIGNAL_AT(ftdi->sim_ns, TRACE_CLE, (ftdi->hi & ADR_CL) != 0);
+	TRACE_SIGNAL_AT(ftdi->sim_ns, TRACE_ALE, (ftdi->hi & ADR_AL) != 0);
+}
+
+// WE# low with the data on the bus, high after two clocks
+static void sim_write_cycle(struct ftdi_context *ftdi, unsigned char data) {
+	uint64_t clk = sim_clock(ftdi);
+
+	sim_lines(ftdi);
+	TRACE_SIGNAL_AT(ftdi->sim_ns, TRACE_WE, 1);
+	TRACE_SIGNAL_AT(ftdi->sim_ns + clk, TRACE_WE, 0);
+	sim_io(ftdi, ftdi->sim_ns + clk, data);
+	TRACE_SIGNAL_AT(ftdi->sim_ns + 3 * clk, TRACE_WE, 1);
+	ftdi->sim_ns += 4 * clk;
+}
+
+// RE# low, data valid after two clocks and sampled when RE# goes high
+static void sim_read_cycle(struct ftdi_context *ftdi, unsigned char data) {
+	uint64_t clk = sim_clock(ftdi);
+
+	sim_lines(ftdi);
+	TRACE_SIGNAL_AT(ftdi->sim_ns, TRACE_RE, 1);
+	TRACE_SIGNAL_AT(ftdi->sim_ns + clk, TRACE_RE, 0);
+	sim_io(ftdi, ftdi->sim_ns + 2 * clk, data);
+	TRACE_SIGNAL_AT(ftdi->sim_ns + 3 * clk, TRACE_RE, 1);
+	ftdi->sim_ns += 4 * clk;
+}
+
+static void nand_command(struct ftdi_context *ftdi, unsigned char cmd) {
+	unsigned char *page;
+	unsigned int i;
+
+	switch (cmd) {
+	case 0x00: // page read, address follows
+	case 0x05: // random data out
+	case 0x60: // block erase
+	case 0x90: // read ID
+		ftdi->addr_n = 0;
+		break;
+	case 0x80: // page program
+		ftdi->addr_n = 0;
+		memset(ftdi->page_reg, 0xFF, MOCK_PAGE_SIZE);
+		break;
+	case 0x30:
+		page = nand_page(ftdi, nand_row(ftdi, 2));
+		if (page != NULL)
+			memcpy(ftdi->page_reg, page, MOCK_PAGE_SIZE);
+		else
+			memset(ftdi->page_reg, 0xFF, MOCK_PAGE_SIZE);
+		ftdi->col = ftdi->addr[0] | (ftdi->addr[1] << 8);
+		ftdi->out_mode = OUT_DATA;
+		break;
+	case 0xE0:
+		ftdi->col = ftdi->addr[0] | (ftdi->addr[1] << 8);
+		ftdi->out_mode = OUT_DATA;
+		break;
+	case 0x10:
+	case 0x15:
+		// programming can only clear bits
+		if ((page = nand_page(ftdi, nand_row(ftdi, 2))) != NULL) {
+			for (i = 0; i < MOCK_PAGE_SIZE; i++)
+				page[i] &= ftdi->page_reg[i];
+		}
+		ftdi->status = 0xE0;
+		break;
+	case 0xD0:
+		for (i = 0; i < MOCK_BLOCK_PAGES; i++) {
+			page = nand_page(ftdi, (nand_row(ftdi, 0) & ~(MOCK_BLOCK_PAGES - 1)) + i);
+			if (page != NULL)
+				memset(page, 0xFF, MOCK_PAGE_SIZE);
+		}
+		ftdi->status = 0xE0;
+		break;
+	case 0x70:
+		ftdi->out_mode = OUT_STATUS;
+		break;
+	case 0xFF:
+		ftdi->out_mode = OUT_DATA;
+		ftdi->status = 0xE0;
+		break;
+	default:
+		break;
+	}
+	ftdi->cmd = cmd;
+	switch (cmd) {
+	case 0x30: sim_busy(ftdi, SIM_tR); break;
+	case 0x10: case 0x15: sim_busy(ftdi, SIM_tPROG); break;
+	case 0xD0: sim_busy(ftdi, SIM_tBERS); break;
+	}
+	if (cmd == 0x90) {
+		ftdi->out_mode = OUT_ID;
+		ftdi->id_pos = 0;
+	}
+}
+
+static void nand_write_cycle(struct ftdi_context *ftdi, unsigned char data) {
+	sim_write_cycle(ftdi, data);
+	if (ftdi->hi & ADR_CE)
+		return;
+	if (ftdi->hi & ADR_CL) {
+		nand_command(ftdi, data);
+	} else if (ftdi->hi & ADR_AL) {
+		if (ftdi->addr_n < 5)
+			ftdi->addr[ftdi->addr_n++] = data;
+		if (ftdi->cmd == 0x80 && ftdi->addr_n == 2)
+			ftdi->col = ftdi->addr[0] | (ftdi->addr[1] << 8);
+	} else if (ftdi->col < MOCK_PAGE_SIZE) {
+		ftdi->page_reg[ftdi->col++] = data;
+	}
+}
+
+static unsigned char nand_read_cycle(struct ftdi_context *ftdi) {
+	if (ftdi->hi & ADR_CE)
+		return 0xFF;
+	switch (ftdi->out_mode) {
+	case OUT_ID:
+		return mock_id[ftdi->id_pos++ % 6];
+	case OUT_STATUS:
+		return ftdi->status;
+	default:
+		return ftdi->col < MOCK_PAGE_SIZE ? ftdi->page_reg[ftdi->col++] : 0xFF;
+	}
+}
+
+// ---------------------------- MPSSE engine ----------------------------
+
+static void out_byte(struct ftdi_context *ftdi, unsigned char b) {
+	if (ftdi->out_len == ftdi->out_size) {
+		ftdi->out_size = ftdi->out_size ? 2 * ftdi->out_size : 65536;
+		ftdi->out = (unsigned char *)realloc(ftdi->out, ftdi->out_size);
+	}
+	ftdi->out[ftdi->out_len++] = b;
+}
+
+static int mpsse_length(unsigned char op) {
+	switch (op) {
+	case 0x90: return 2; // read short
+	case 0x91: return 3; // read extended
+	case 0x92: return 3; // write short
+	case 0x93: return 4; // write extended
+	case 0x80: case 0x82: case 0x86: return 3;
+	default:   return 1;
+	}
+}
+
+// returns the number of bytes used, 0 if the command is not complete yet
+static int mpsse_run(struct ftdi_context *ftdi, const unsigned char *cmd, int len) {
+	int n = mpsse_length(cmd[0]);
+	unsigned char b;
+
+	if (len < n)
+		return 0;
+	switch (cmd[0]) {
+	case 0x91:
+		ftdi->hi = cmd[1];
+		/* fall through */
+	case 0x90:
+		b = nand_read_cycle(ftdi);
+		sim_read_cycle(ftdi, b);
+		out_byte(ftdi, b);
+		if (ftdi->div5)
+			out_byte(ftdi, b);
+		break;
+	case 0x93:
+		ftdi->hi = cmd[1];
+		nand_write_cycle(ftdi, cmd[3]);
+		break;
+	case 0x92:
+		nand_write_cycle(ftdi, cmd[2]);
+		break;
+	case 0x83: // R/B# reads high, the simulated busy time is skipped
+	case 0x81:
+		if (ftdi->stuck_rb && ftdi->busy_until) {
+			out_byte(ftdi, 0x00);
+			break;
+		}
+		sim_ready(ftdi);
+		out_byte(ftdi, 0xFF);
+		break;
+	case 0x88:
+		// the real MPSSE waits as long as it takes, nothing after runs
+		if (ftdi->stuck_rb && ftdi->busy_until) {
+			ftdi->stalled = 1;
+			break;
+		}
+		sim_ready(ftdi);
+		break;
+	case 0x8A:
+		ftdi->div5 = 0;
+		break;
+	case 0x8B:
+		ftdi->div5 = 1;
+		break;
+	case 0x80: case 0x82: case 0x86:
+	case 0x87: case 0x89:
+		break;
+	default:
+		// bad command answer of the MPSSE
+		out_byte(ftdi, 0xFA);
+		out_byte(ftdi, cmd[0]);
+		break;
+	}
+	return n;
+}
+
+static void mpsse_feed(struct ftdi_context *ftdi, const unsigned char *buf, int size) {
+	int n;
+
+	if (ftdi->stalled)
+		return;
+
+	// finish a command split over two writes first
+	while (ftdi->carry_len > 0 && size > 0) {
+		ftdi->carry[ftdi->carry_len++] = *buf++;
+		size--;
+		if (mpsse_run(ftdi, ftdi->carry, ftdi->carry_len) > 0)
+			ftdi->carry_len = 0;
+	}
+	while (size > 0 && !ftdi->stalled) {
+		if ((n = mpsse_run(ftdi, buf, size)) == 0) {
+			memcpy(ftdi->carry, buf, size);
+			ftdi->carry_len = size;
+			return;
+		}
+		buf += n;
+		size -= n;
+	}
+}
+
+// a submitted read completes once the engine has put out all of its bytes
+static void read_complete(struct ftdi_context *ftdi) {
+	struct ftdi_transfer_control *tc = ftdi->pending;
+
+	if (tc == NULL || (ftdi->replay == NULL && ftdi->out_len < tc->size))
+		return;
+	tc->offset = ftdi_read_data(ftdi, tc->buf, tc->size);
+	tc->completed = 1;
+	ftdi->pending = NULL;
+}
+
+// ---------------------------- libftdi API ----------------------------
+
+struct ftdi_context *ftdi_new(void) {
+	struct ftdi_context *ftdi = (struct ftdi_context *)calloc(1, sizeof(*ftdi));
+
+	if (ftdi != NULL) {
+		ftdi->error_str = "";
+		ftdi->status = 0xE0;
+	}
+	return ftdi;
+}
+
+void ftdi_free(struct ftdi_context *ftdi) {
+	if (ftdi == NULL)
+		return;
+	if (ftdi->is_open)
+		ftdi_usb_close(ftdi);
+	free(ftdi->out);
+	free(ftdi);
+}
+
+int ftdi_set_interface(struct ftdi_context *ftdi, enum ftdi_interface interface) {
+	ftdi->interface = interface;
+	return 0;
+}
+
+int ftdi_usb_open(struct ftdi_context *ftdi, int vendor, int product) {
+	const char *image = getenv("FTDI_MOCK_IMAGE");
+	const char *record = getenv("FTDI_MOCK_RECORD");
+	const char *replay = getenv("FTDI_MOCK_REPLAY");
+	const char *stuck = getenv("FTDI_MOCK_STUCK_RB");
+	struct stat st;
+	int fd;
+
+	(void)vendor;
+	(void)product;
+
+	if (replay != NULL) {
+		if ((ftdi->replay = fopen(replay, "rb")) == NULL) {
+			ftdi->error_str = "cannot open FTDI_MOCK_REPLAY";
+			return -3;
+		}
+	} else if (image != NULL) {
+		if ((fd = open(image, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+			ftdi->error_str = "cannot open FTDI_MOCK_IMAGE";
+			if (fd >= 0)
+				close(fd);
+			return -3;
+		}
+		ftdi->image_size = st.st_size;
+		ftdi->image = (unsigned char *)mmap(NULL, ftdi->image_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (ftdi->image == MAP_FAILED) {
+			ftdi->image = NULL;
+			ftdi->error_str = "cannot map FTDI_MOCK_IMAGE";
+			return -3;
+		}
+	}
+
+	if (record != NULL && (ftdi->record = fopen(record, "wb")) == NULL) {
+		ftdi->error_str = "cannot create FTDI_MOCK_RECORD";
+		return -3;
+	}
+	ftdi->stuck_rb = stuck != NULL && atoi(stuck) != 0;
+	ftdi->is_open = 1;
+	return 0;
+}
+
+int ftdi_usb_close(struct ftdi_context *ftdi) {
+	if (ftdi->record != NULL)
+		fclose(ftdi->record);
+	if (ftdi->replay != NULL)
+		fclose(ftdi->replay);
+	if (ftdi->image != NULL)
+		munmap(ftdi->image, ftdi->image_size);
+	ftdi->record = ftdi->replay = NULL;
+	ftdi->image = NULL;
+	ftdi->is_open = 0;
+	return 0;
+}
+
+int ftdi_set_bitmode(struct ftdi_context *ftdi, unsigned char bitmask, unsigned char mode) {
+	(void)bitmask;
+	if (!ftdi->is_open) {
+		ftdi->error_str = "USB device unavailable";
+		return -2;
+	}
+	ftdi->mode = mode;
+	return 0;
+}
+
+int ftdi_set_latency_timer(struct ftdi_context *ftdi, unsigned char latency) {
+	(void)ftdi;
+	(void)latency;
+	return 0;
+}
+
+int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize) {
+	(void)ftdi;
+	(void)chunksize;
+	return 0;
+}
+
+int ftdi_read_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize) {
+	(void)ftdi;
+	(void)chunksize;
+	return 0;
+}
+
+int ftdi_usb_purge_buffers(struct ftdi_context *ftdi) {
+	ftdi->out_len = 0;
+	ftdi->carry_len = 0;
+	return 0;
+}
+
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size) {
+	unsigned char *rec;
+	int n, i;
+
+	ftdi->transfers++;
+	if (ftdi->replay != NULL) {
+		if ((n = replay_next(ftdi, 'W', &rec)) < 0)
+			return -1;
+		for (i = 0; i < n && i < size && rec[i] == buf[i]; i++)
+			;
+		free(rec);
+		if (i != n || n != size) {
+			fprintf(stderr, "ftdi_mock: transfer %d (write, %d bytes) differs from the recording at byte %d\n",
+				ftdi->transfers, size, i);
+			ftdi->error_str = "replay: write differs from recording";
+			return -1;
+		}
+	} else {
+		log_transfer(ftdi, 'W', buf, size);
+		if (ftdi->mode == BITMODE_MCU)
+			mpsse_feed(ftdi, buf, size);
+	}
+	read_complete(ftdi);
+	return size;
+}
+
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size) {
+	unsigned char *rec;
+	int n;
+
+	ftdi->transfers++;
+	if (ftdi->replay != NULL) {
+		if ((n = replay_next(ftdi, 'R', &rec)) < 0)
+			return -1;
+		if (n > size)
+			n = size;
+		memcpy(buf, rec, n);
+		free(rec);
+		return n;
+	}
+
+	n = ftdi->out_len < size ? ftdi->out_len : size;
+	memcpy(buf, ftdi->out, n);
+	memmove(ftdi->out, ftdi->out + n, ftdi->out_len - n);
+	ftdi->out_len -= n;
+	log_transfer(ftdi, 'R', buf, n);
+	return n;
+}
+
+// the read is carried out by the write that produces its data, see
+// read_complete(), or else by ftdi_transfer_data_done
+struct ftdi_transfer_control *ftdi_read_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size) {
+	struct ftdi_transfer_control *tc = (struct ftdi_transfer_control *)calloc(1, sizeof(*tc));
+
+	if (tc == NULL)
+		return NULL;
+	tc->ftdi = ftdi;
+	tc->buf = buf;
+	tc->size = size;
+	ftdi->pending = tc;
+	return tc;
+}
+
+int ftdi_transfer_data_done(struct ftdi_transfer_control *tc) {
+	int n = tc->completed ? tc->offset : ftdi_read_data(tc->ftdi, tc->buf, tc->size);
+
+	if (tc->ftdi->pending == tc)
+		tc->ftdi->pending = NULL;
+	free(tc);
+	return n;
+}
+
+void ftdi_transfer_data_cancel(struct ftdi_transfer_control *tc, struct timeval *to) {
+	(void)to;
+	if (tc->ftdi->pending == tc)
+		tc->ftdi->pending = NULL;
+	free(tc);
+}
+
+// nothing completes in the background here, only the time goes by
+int libusb_handle_events_timeout_completed(struct libusb_context *ctx, struct timeval *tv, int *completed) {
+	struct timespec pause;
+
+	(void)ctx;
+	if (completed != NULL && *completed)
+		return 0;
+	pause.tv_sec = tv->tv_sec;
+	pause.tv_nsec = tv->tv_usec * 1000;
+	nanosleep(&pause, NULL);
+	return 0;
+}
+
+const char *ftdi_get_error_string(struct ftdi_context *ftdi) {
+	return ftdi->error_str;
+}
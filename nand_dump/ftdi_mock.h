@@ -0,0 +1,120 @@
+/*
+    Stand-in for the part of libftdi1 used by ft2232h_bus.c
+
+    Build the tool with -DFTDI_MOCK and ftdi_mock.c to run the FT2232H
+    backend without hardware. Environment variables:
+
+        FTDI_MOCK_IMAGE=<file>   raw dump (PAGE_SIZE pages) the simulated
+                                 chip is loaded from, erased chip if unset
+        FTDI_MOCK_RECORD=<file>  log every write and read transfer
+        FTDI_MOCK_REPLAY=<file>  play back a log instead of simulating: each
+                                 write must match the recording byte for
+                                 byte, reads return the recorded data
+        FTDI_MOCK_STUCK_RB=1     R/B# never comes back after a page read,
+                                 program or erase, as with a dead chip or
+                                 a loose wire
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef FTDI_MOCK_H
+#define FTDI_MOCK_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define MOCK_PAGE_SIZE 4352
+#define MOCK_CARRY     8     // longest MPSSE command we decode
+
+enum ftdi_interface {
+	INTERFACE_ANY = 0,
+	INTERFACE_A   = 1,
+	INTERFACE_B   = 2,
+	INTERFACE_C   = 3,
+	INTERFACE_D   = 4
+};
+
+enum ftdi_mpsse_mode {
+	BITMODE_RESET = 0x00,
+	BITMODE_MPSSE = 0x02,
+	BITMODE_MCU   = 0x08
+};
+
+enum mock_out { OUT_DATA, OUT_ID, OUT_STATUS };
+
+struct libusb_context;
+
+// public like libftdi's own: ft2232h_bus.c waits on usb_ctx and
+// tc->completed, the rest is the mock's
+struct ftdi_context {
+	struct libusb_context *usb_ctx; // no libusb here, NULL
+	int interface;
+	int is_open;
+	int mode;
+	const char *error_str;
+	FILE *record;
+	FILE *replay;
+	int transfers;
+	struct ftdi_transfer_control *pending; // submitted, its data not there yet
+
+	// MPSSE engine
+	int div5;
+	unsigned char hi;
+	unsigned char carry[MOCK_CARRY];
+	int carry_len;
+	unsigned char *out;
+	int out_len, out_size;
+
+	// simulated NAND
+	unsigned char *image;
+	size_t image_size;
+	unsigned char page_reg[MOCK_PAGE_SIZE];
+	unsigned char cmd;
+	unsigned char addr[5];
+	int addr_n;
+	enum mock_out out_mode;
+	unsigned int col;
+	int id_pos;
+	unsigned char status;
+	int stuck_rb;   // FTDI_MOCK_STUCK_RB: R/B# stays low after tR, tPROG, tBERS
+	int stalled;    // WAIT_ON_HIGH on a stuck R/B#, the engine takes no more commands
+
+	// simulated time for the bus trace
+	uint64_t sim_ns;
+	uint64_t busy_until;
+};
+
+struct ftdi_transfer_control {
+	int completed;
+	unsigned char *buf;
+	int size;
+	int offset;
+	struct ftdi_context *ftdi;
+};
+
+struct ftdi_context *ftdi_new(void);
+void ftdi_free(struct ftdi_context *ftdi);
+int ftdi_set_interface(struct ftdi_context *ftdi, enum ftdi_interface interface);
+int ftdi_usb_open(struct ftdi_context *ftdi, int vendor, int product);
+int ftdi_usb_close(struct ftdi_context *ftdi);
+int ftdi_set_bitmode(struct ftdi_context *ftdi, unsigned char bitmask, unsigned char mode);
+int ftdi_set_latency_timer(struct ftdi_context *ftdi, unsigned char latency);
+int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize);
+int ftdi_read_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize);
+int ftdi_usb_purge_buffers(struct ftdi_context *ftdi);
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size);
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size);
+struct ftdi_transfer_control *ftdi_read_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size);
+int ftdi_transfer_data_done(struct ftdi_transfer_control *tc);
+void ftdi_transfer_data_cancel(struct ftdi_transfer_control *tc, struct timeval *to);
+const char *ftdi_get_error_string(struct ftdi_context *ftdi);
+
+// libusb, for the wait on a submitted read
+int libusb_handle_events_timeout_completed(struct libusb_context *ctx, struct timeval *tv, int *completed);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+    GPT parsing and the partitions command for rpi-raw-nand
+
+    The native version of gpt()/efi() and exportAllPartitions() /
+    exportRawPartition() in descramble/dumpreader.js. The GPT header is in
+    the data of page 3 of a descrambled dump, the entries follow in page 4
+    and on; LBAs count pages. If there is no "EFI PART" header the built-in
+    table of dumpreader.js (the Echo Dot layout) is used.
+
+    Partitions are exported from the mapped dump without building them in
+    memory first:
+
+        raw   whole pages, one contiguous range: a reflink (FICLONERANGE)
+              where the file system can share the blocks, else
+              copy_file_range() so the kernel does the copy
+        data  the 3 * 1024 data bytes of each page (finalData()), or the
+              UBI block layout of ubiData() for persist/userdata; written
+              with pwritev() straight from the mapping, 1024 byte pieces
+              and zero padding gathered into one call per IOV_BATCH
+        sparse  the data export as an Android sparse image, <name>.simg
+              (sparse.c)
+
+    Every partition is its own work item, the biggest go first so they all
+    finish at about the same time.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#undef BLOCK_SIZE // linux/fs.h has one too
+#include "nand_dump.h"
+
+#define GPT_HEADER_PAGE  3
+#define GPT_ENTRY_PAGE   4
+#define GPT_ENTRY_SIZE   128
+
+// dumpreader.js partitionTable, start and size in pages
+static const struct partition builtin_table[] = {
+	{ "brhgptpl_0", 0x0,    0x40 },
+	{ "reserve0",   0x40,   0xC0 },
+	{ "lk_a",       0x100,  0x180 },
+	{ "lk_b",       0x280,  0x180 },
+	{ "brhgptpl_1", 0x400,  0x40 },
+	{ "reserve1",   0x440,  0x1C0 },
+	{ "idme_nand",  0x600,  0x200 },
+	{ "brhgptpl_2", 0x800,  0x40 },
+	{ "reserve2",   0x840,  0x1C0 },
+	{ "misc",       0xA00,  0x200 },
+	{ "brhgptpl_3", 0xC00,  0x40 },
+	{ "reserve3",   0xC40,  0x1C0 },
+	{ "tee1",       0xE00,  0x500 },
+	{ "boot_a",     0x1300, 0xF40 },
+	{ "tee2",       0x2240, 0x500 },
+	{ "boot_b",     0x2740, 0xF40 },
+	{ "persist",    0x3680, 0x800 },
+	{ "userdata",   0x3E80, 0x1BF80 },
+};
+
+static uint32_t get_le32(const unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+	return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+// finalData(): the data bytes of a page without the spare
+static void page_data(const struct dump_image *img, unsigned int page, unsigned char *buf) {
+	int s;
+
+	for (s = 0; s < 3; s++)
+		memcpy(buf + s * SECTOR_DATA, dump_page(img, page) + s * SECTOR_SIZE, SECTOR_DATA);
+}
+
+int read_gpt(const struct dump_image *img, struct partition *parts, int max, unsigned int pages) {
+	unsigned char hdr[PAGE_DATA], data[PAGE_DATA];
+	const unsigned char *e;
+	uint32_t entries, entry_size, crc;
+	uint64_t first, last;
+	unsigned int i, c, page, n = 0;
+
+	if (img->pages <= GPT_ENTRY_PAGE)
+		return 0;
+	page_data(img, GPT_HEADER_PAGE, hdr);
+	if (memcmp(hdr, "EFI PART", 8) != 0) {
+		printf("No GPT header in page %d\n", GPT_HEADER_PAGE);
+		return 0;
+	}
+	entries = get_le32(hdr + 80);
+	entry_size = get_le32(hdr + 84);
+	if (entry_size != GPT_ENTRY_SIZE || get_le32(hdr + 12) > PAGE_DATA) {
+		printf("GPT header looks wrong (entry size %u)\n", entry_size);
+		return 0;
+	}
+	crc = get_le32(hdr + 16);
+	memset(hdr + 16, 0, 4);
+	if (crc32_update(0, hdr, get_le32(hdr + 12)) != crc)
+		printf("GPT header CRC mismatch, bad read? Going on anyway\n");
+
+	page = GPT_ENTRY_PAGE;
+	for (i = 0; i < entries && n < (unsigned int)max; i++) {
+		if (i % (PAGE_DATA / GPT_ENTRY_SIZE) == 0) {
+			if (page >= img->pages)
+				break;
+			page_data(img, page++, data);
+		}
+		e = data + (i % (PAGE_DATA / GPT_ENTRY_SIZE)) * GPT_ENTRY_SIZE;
+		// unused entry: zero type GUID
+		for (c = 0; c < 16 && e[c] == 0; c++)
+			;
+		if (c == 16)
+			continue;
+		first = get_le64(e + 32);
+		last = get_le64(e + 40);
+		if (last < first || last >= pages) {
+			printf("GPT entry %u: pages %llu .. %llu are out of range, skipped\n", i,
+			    (unsigned long long)first, (unsigned long long)last);
+			continue;
+		}
+		// UTF-16LE name, keep it a plain file name
+		for (c = 0; c < sizeof(parts[n].name) - 1 && c < 36; c++) {
+			unsigned int ch = e[56 + 2 * c] | e[57 + 2 * c] << 8;
+			if (ch == 0)
+				break;
+			parts[n].name[c] = (ch < 0x80 && ch > ' ' && ch != '/') ? ch : '_';
+		}
+		parts[n].name[c] = '\0';
+		parts[n].first_page = first;
+		parts[n].pages = last - first + 1;
+		n++;
+	}
+	if (n == 0)
+		printf("GPT holds no partitions\n");
+	return n;
+}
+
+int read_partitions(const struct dump_image *img, struct partition *parts, int max) {
+	unsigned int n;
+
+	if ((n = read_gpt(img, parts, max, img->pages)) > 0)
+		return n;
+	if (img->pages > GPT_ENTRY_PAGE)
+		printf("Using the built-in partition table\n");
+	for (n = 0; n < sizeof(builtin_table) / sizeof(builtin_table[0]) && n < (unsigned int)max; n++)
+		parts[n] = builtin_table[n];
+	return n;
+}
+
+// getPartitionData() treats these as UBI
+int is_ubi(const struct partition *part) {
+	return strcmp(part->name, "persist") == 0 || strcmp(part->name, "userdata") == 0;
+}
+
+struct export_job {
+	const struct dump_image *img;
+	const char *outdir;
+	int raw, sparse;
+	struct partition parts[MAX_PARTITIONS];
+	int failed;
+};
+
+// raw export: reflink if the range is block aligned and the fs allows it, else copy_file_range
+static int export_raw(const struct dump_image *img, int fd, const struct partition *part, int *reflinked) {
+	struct file_clone_range clone;
+	loff_t in_off = (loff_t)part->first_page * PAGE_SIZE, out_off = 0;
+	size_t len = (size_t)part->pages * PAGE_SIZE;
+	ssize_t n;
+
+	clone.src_fd = img->fd;
+	clone.src_offset = in_off;
+	clone.src_length = len;
+	clone.dest_offset = 0;
+	*reflinked = img->fd >= 0 && ioctl(fd, FICLONERANGE, &clone) == 0;
+	if (*reflinked)
+		return 0;
+
+	while (len > 0) {
+		// an archive has no file of pages to copy from
+		n = img->fd >= 0 ? copy_file_range(img->fd, &in_off, fd, &out_off, len, 0) : -1;
+		if (n < 0 && (img->fd < 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+			// old kernel or other fs: write from the mapping
+			n = pwrite(fd, img->data + in_off, len > (1 << 20) ? (1 << 20) : len, out_off);
+			if (n > 0) {
+				in_off += n;
+				out_off += n;
+			}
+		}
+		if (n <= 0) {
+			perror("copy_file_range");
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+static int export_data(const struct dump_image *img, int fd, const struct partition *part) {
+	static const unsigned char zero[UBI_PEB_SIZE];
+	struct iov_writer w;
+	unsigned int page, last = part->first_page + part->pages;
+	size_t block_fill = 0;
+	int s, ubi = is_ubi(part);
+
+	w.fd = fd;
+	w.offset = 0;
+	w.count = 0;
+	for (page = part->first_page; page < last; page++) {
+		for (s = 0; s < 3; s++)
+			if (iov_add(&w, dump_page(img, page) + s * SECTOR_SIZE, SECTOR_DATA) < 0)
+				return -1;
+		if (!ubi)
+			continue;
+		// ubiData(): pages 0 and 1 of a block (EC and VID header) padded to 4096,
+		// the rest collapsed, the block padded to UBI_PEB_SIZE
+		block_fill += PAGE_DATA;
+		if (page % PAGES_PER_BLOCK < 2) {
+			if (iov_add(&w, zero, 4096 - PAGE_DATA) < 0)
+				return -1;
+			block_fill += 4096 - PAGE_DATA;
+		}
+		if (page % PAGES_PER_BLOCK == PAGES_PER_BLOCK - 1 || page == last - 1) {
+			if (iov_add(&w, zero, UBI_PEB_SIZE - block_fill) < 0)
+				return -1;
+			block_fill = 0;
+		}
+	}
+	return iov_flush(&w);
+}
+
+static void export_partition(void *ctx, unsigned long item, int worker) {
+	struct export_job *job = (struct export_job *)ctx;
+	const struct partition *part = &job->parts[item];
+	char file[512];
+	int fd, ret, reflinked = 0;
+
+	(void)worker;
+	snprintf(file, sizeof(file), "%s/%s%s", job->outdir, part->name, job->raw ? "_raw.bin" : job->sparse ? ".simg" : ".bin");
+	if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(file);
+		job->failed = 1;
+		return;
+	}
+	if (job->raw)
+		ret = export_raw(job->img, fd, part, &reflinked);
+	else if (job->sparse)
+		ret = export_sparse(job->img, fd, part);
+	else
+		ret = export_data(job->img, fd, part);
+	if (close(fd) < 0 || ret < 0) {
+		printf("exporting %s failed\n", part->name);
+		job->failed = 1;
+		return;
+	}
+	printf("exported partition %s to %s%s\n", part->name, file, reflinked ? " (reflink)" : "");
+}
+
+static int by_size(const void *a, const void *b) {
+	const struct partition *pa = (const struct partition *)a, *pb = (const struct partition *)b;
+
+	return pa->pages < pb->pages ? 1 : pa->pages > pb->pages ? -1 : 0;
+}
+
+int export_partitions(char *infile, char *outdir, char *mode) {
+	struct dump_image img;
+	struct export_job *job;
+	double start, seconds;
+	unsigned long bytes = 0;
+	int i, n;
+
+	if (mode != NULL && strcmp(mode, "raw") != 0 && strcmp(mode, "data") != 0 && strcmp(mode, "sparse") != 0 &&
+	    strcmp(mode, "list") != 0) {
+		printf("unknown export mode '%s', use data, raw, sparse or list\n", mode);
+		return -1;
+	}
+	if (dump_open(&img, infile) < 0)
+		return -1;
+	if ((job = (struct export_job *)calloc(1, sizeof(*job))) == NULL) {
+		perror("calloc");
+		dump_close(&img);
+		return -1;
+	}
+	job->img = &img;
+	job->outdir = outdir;
+	job->raw = mode != NULL && strcmp(mode, "raw") == 0;
+	job->sparse = mode != NULL && strcmp(mode, "sparse") == 0;
+	n = read_partitions(&img, job->parts, MAX_PARTITIONS);
+
+	printf("-------------------------------------------------------------\n");
+	for (i = 0; i < n; i++)
+		printf("%2d: %-12s start page: %6u pages: %6u size: %lu bytes\n", i, job->parts[i].name,
+		    job->parts[i].first_page, job->parts[i].pages, (unsigned long)job->parts[i].pages * PAGE_SIZE);
+	printf("-------------------------------------------------------------\n");
+	if (mode != NULL && strcmp(mode, "list") == 0)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (job->parts[i].first_page + job->parts[i].pages > img.pages) {
+			printf("%s ends after the dump (%u pages), cut short\n", job->parts[i].name, img.pages);
+			job->parts[i].pages = job->parts[i].first_page < img.pages ? img.pages - job->parts[i].first_page : 0;
+		}
+		bytes += (unsigned long)job->parts[i].pages * PAGE_SIZE;
+	}
+	if (make_dirs(outdir) < 0) {
+		job->failed = 1;
+		goto out;
+	}
+	qsort(job->parts, n, sizeof(job->parts[0]), by_size);
+	start = wall_clock();
+	run_parallel(n, 0, export_partition, job);
+	seconds = wall_clock() - start;
+	printf("Exported %d partitions (%lu MB of dump) in %.2f s\n", n, bytes >> 20, seconds);
+
+out:
+	i = job->failed ? -1 : 0;
+	free(job);
+	dump_close(&img);
+	return i;
+}
@@ -0,0 +1,604 @@
+/*
+    la_decode - turn logic analyzer captures of the NAND bus into a
+    transaction log
+
+    Streams a CSV export (KingstVIS "Time [s],Channel 0,Channel 1,..." with a
+    row per transition, or a row per sample) with constant memory and decodes
+    the CLE/ALE/WE#/RE# edges into commands, address cycles and data bursts.
+    At the end the bus timing that was actually achieved is printed: tWP,
+    tWC, tREA, tRC and the busy times tR, tPROG and tBERS.
+
+    Channel mapping, first match wins:
+      -m WE=3,RE=5,IO0=7,...   explicit channel numbers
+      CSV column names         WP#, ALE, CE, WE, R/B, RE, CLE, I/O n, GPIOnn
+      -k settings.kvset        chnShowNameN entries, same names as above
+      built in                 rpi_nand_la_settings.kvset layout on channels
+                               0..6, I/O 0..7 on channels 7..14
+    GPIOnn names are resolved with the dumper's wiring from nand_pins.h.
+
+    Build:
+      gcc -O2 -o la_decode la_decode.c
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "nand_pins.h"
+
+#define MAX_CHANNELS  32
+#define MAX_COLUMNS   (MAX_CHANNELS + 1)
+#define READ_CHUNK    (1 << 20)
+#define MAX_LINE      4096
+#define BURST_SHOWN   16     // bytes of a data burst printed without -x
+#define CYCLE_GAP_NS  100000 // longer gaps between strobes start a new burst for tWC/tRC
+
+enum {
+	SIG_WP, SIG_ALE, SIG_CE, SIG_WE, SIG_RB, SIG_RE, SIG_CLE,
+	SIG_IO0, SIG_COUNT = SIG_IO0 + 8
+};
+
+static const char *sig_names[SIG_IO0] = { "WP#", "ALE", "CE#", "WE#", "R/B#", "RE#", "CLE" };
+
+// channel -> signal from -k or the built in layout, -m overrides
+static int channel_sig[MAX_CHANNELS];
+static int forced_sig[MAX_CHANNELS];
+static int col_sig[MAX_COLUMNS];
+static int columns;
+static int dump_all;
+
+struct timing {
+	const char *name;
+	long long count;
+	int64_t min, max;
+	double sum;
+};
+
+static struct timing t_wp   = { .name = "tWP   (WE# low)" };
+static struct timing t_wc   = { .name = "tWC   (WE# cycle)" };
+static struct timing t_rp   = { .name = "tRP   (RE# low)" };
+static struct timing t_rc   = { .name = "tRC   (RE# cycle)" };
+static struct timing t_rea  = { .name = "tREA  (RE# low to data)" };
+static struct timing t_r    = { .name = "tR    (page read busy)" };
+static struct timing t_prog = { .name = "tPROG (program busy)" };
+static struct timing t_bers = { .name = "tBERS (erase busy)" };
+static struct timing t_busy = { .name = "other busy" };
+
+static void add_timing(struct timing *t, int64_t ns) {
+	if (ns < 0)
+		return;
+	if (t->count == 0 || ns < t->min)
+		t->min = ns;
+	if (t->count == 0 || ns > t->max)
+		t->max = ns;
+	t->count++;
+	t->sum += ns;
+}
+
+static void print_timing(struct timing *t) {
+	if (t->count == 0)
+		printf("  %-26s -\n", t->name);
+	else if (t->max >= 10000)
+		printf("  %-26s min %10.3f us  avg %10.3f us  max %10.3f us  (%lld)\n", t->name,
+			t->min / 1000.0, t->sum / t->count / 1000.0, t->max / 1000.0, t->count);
+	else
+		printf("  %-26s min %10lld ns  avg %10.0f ns  max %10lld ns  (%lld)\n", t->name,
+			(long long)t->min, t->sum / t->count, (long long)t->max, t->count);
+}
+
+static void print_time(int64_t ns) {
+	if (ns < 0) {
+		putchar('-');
+		ns = -ns;
+	}
+	printf("%lld.%09lld ", (long long)(ns / 1000000000), (long long)(ns % 1000000000));
+}
+
+// ------------------------------ channel names ------------------------------
+
+static int gpio_to_signal(int g) {
+	static const int data_map[8] = DATA_TO_GPIO_MAP;
+	int i;
+
+	switch (g) {
+	case WRITE_PROTECT:        return SIG_WP;
+	case READY_BUSY:           return SIG_RB;
+	case ADDRESS_LATCH_ENABLE: return SIG_ALE;
+	case COMMAND_LATCH_ENABLE: return SIG_CLE;
+	case READ_ENABLE:          return SIG_RE;
+	case WRITE_ENABLE:         return SIG_WE;
+	case CHIP_ENABLE:          return SIG_CE;
+	}
+	for (i = 0; i < 8; i++) {
+		if (data_map[i] == g)
+			return SIG_IO0 + i;
+	}
+	return -1;
+}
+
+// WP#, ALE, CE, WE, R/B, RE, CLE, I/O n, IOn, GPIOnn; case, blanks and # ignored
+static int name_to_signal(const char *name) {
+	char n[32];
+	int i, len = 0;
+
+	for (; *name && len < (int)sizeof(n) - 1; name++) {
+		if (*name != ' ' && *name != '#' && *name != '_' && *name != '"')
+			n[len++] = toupper((unsigned char)*name);
+	}
+	n[len] = 0;
+
+	if (strcmp(n, "RB") == 0 || strcmp(n, "R/B") == 0)
+		return SIG_RB;
+	for (i = 0; i < SIG_IO0; i++) {
+		char s[8];
+		int k, j = 0;
+		for (k = 0; sig_names[i][k]; k++) {
+			if (sig_names[i][k] != '#')
+				s[j++] = sig_names[i][k];
+		}
+		s[j] = 0;
+		if (strcmp(n, s) == 0)
+			return i;
+	}
+	if (strncmp(n, "I/O", 3) == 0 && n[3] >= '0' && n[3] <= '7' && n[4] == 0)
+		return SIG_IO0 + n[3] - '0';
+	if (strncmp(n, "IO", 2) == 0 && n[2] >= '0' && n[2] <= '7' && n[3] == 0)
+		return SIG_IO0 + n[2] - '0';
+	if (strncmp(n, "GPIO", 4) == 0 && isdigit((unsigned char)n[4]))
+		return gpio_to_signal(atoi(n + 4));
+	return -1;
+}
+
+static void builtin_channels(void) {
+	int i;
+
+	for (i = 0; i < MAX_CHANNELS; i++)
+		channel_sig[i] = i < SIG_COUNT ? i : -1;
+}
+
+static int load_kvset(const char *filename) {
+	char line[MAX_LINE], *p, *end;
+	int ch, found = 0;
+	FILE *f = fopen(filename, "r");
+
+	if (f == NULL) {
+		perror("fopen kvset");
+		return -1;
+	}
+	for (ch = 0; ch < MAX_CHANNELS; ch++)
+		channel_sig[ch] = -1;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((p = strstr(line, "<chnShowName")) == NULL)
+			continue;
+		ch = atoi(p + 12);
+		if ((p = strchr(p, '>')) == NULL || p[-1] == '/' || (end = strchr(p, '<')) == NULL)
+			continue;
+		*end = 0;
+		if (ch >= 0 && ch < MAX_CHANNELS && (channel_sig[ch] = name_to_signal(p + 1)) >= 0)
+			found++;
+	}
+	fclose(f);
+	if (found == 0)
+		printf("%s: no NAND signal names found\n", filename);
+	return 0;
+}
+
+// -m WE=3,RE=5,IO0=7
+static int parse_map(char *spec) {
+	char *item, *eq;
+	int sig, ch;
+
+	for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+		if ((eq = strchr(item, '=')) == NULL)
+			return -1;
+		*eq = 0;
+		sig = name_to_signal(item);
+		ch = atoi(eq + 1);
+		if (sig < 0 || ch < 0 || ch >= MAX_CHANNELS) {
+			printf("bad channel mapping '%s=%s'\n", item, eq + 1);
+			return -1;
+		}
+		forced_sig[ch] = sig;
+	}
+	return 0;
+}
+
+static int parse_header(char *line) {
+	char *name, *next;
+	int ch, sig, present = 0;
+
+	// first column is the time
+	if ((next = strchr(line, ',')) == NULL)
+		return -1;
+	for (columns = 1; next != NULL && columns < MAX_COLUMNS; columns++) {
+		name = next + 1;
+		if ((next = strchr(name, ',')) != NULL)
+			*next = 0;
+		name[strcspn(name, "\r\n")] = 0;
+		while (*name == ' ')
+			name++;
+
+		ch = columns - 1;
+		if (strncasecmp(name, "Channel", 7) == 0)
+			ch = atoi(name + 7);
+		sig = -1;
+		if (ch >= 0 && ch < MAX_CHANNELS && forced_sig[ch] >= 0)
+			sig = forced_sig[ch];
+		else if ((sig = name_to_signal(name)) < 0 && ch >= 0 && ch < MAX_CHANNELS)
+			sig = channel_sig[ch];
+		col_sig[columns] = sig;
+		if (sig >= 0)
+			present |= 1 << sig;
+		if (sig < 0)
+			printf("# column %d '%s' -> unused\n", columns, name);
+		else if (sig < SIG_IO0)
+			printf("# column %d '%s' -> %s\n", columns, name, sig_names[sig]);
+		else
+			printf("# column %d '%s' -> I/O %d\n", columns, name, sig - SIG_IO0);
+	}
+	if (!(present & (1 << SIG_WE)) || !(present & (1 << SIG_RE))) {
+		printf("capture has no WE# or RE# channel, check the channel mapping\n");
+		return -1;
+	}
+	if ((present & (0xFF << SIG_IO0)) != (0xFF << SIG_IO0))
+		printf("# not all I/O lines captured, missing bits read as 0\n");
+	return 0;
+}
+
+// ------------------------------ decoder ------------------------------
+
+static unsigned state;          // bit per signal
+static int have_state;
+static int64_t we_fall = -1, we_prev_fall = -1;
+static int64_t re_fall = -1, re_prev_fall = -1, io_change = -1;
+static int64_t rb_fall = -1;
+static unsigned char last_cmd;
+
+static unsigned char addr[8];
+static int addr_n;
+static int64_t addr_time;
+
+static char burst_dir;          // 'W' data in, 'R' data out, 0 none
+static long long burst_len;
+static int64_t burst_time;
+static unsigned char burst[BURST_SHOWN];
+
+static long long n_cmd, n_addr, n_in, n_out;
+
+static const char *command_name(unsigned char cmd) {
+	switch (cmd) {
+	case 0x00: return "read";
+	case 0x30: return "read confirm";
+	case 0x31: return "cache read";
+	case 0x3F: return "cache read end";
+	case 0x05: return "random data out";
+	case 0xE0: return "random data out confirm";
+	case 0x80: return "program";
+	case 0x85: return "random data in";
+	case 0x10: return "program confirm";
+	case 0x15: return "cache program";
+	case 0x60: return "block erase";
+	case 0xD0: return "erase confirm";
+	case 0x70: return "read status";
+	case 0x90: return "read ID";
+	case 0xEC: return "read parameter page";
+	case 0xEE: return "get feature";
+	case 0xEF: return "set feature";
+	case 0xFF: return "reset";
+	default:   return "?";
+	}
+}
+
+static void flush_addr(void) {
+	int i;
+
+	if (addr_n == 0)
+		return;
+	print_time(addr_time);
+	printf("ADDR");
+	for (i = 0; i < addr_n; i++)
+		printf(" %02X", addr[i]);
+	if (addr_n == 5)
+		printf("  (page %u col %u)", addr[2] | (addr[3] << 8) | (addr[4] << 16), addr[0] | (addr[1] << 8));
+	else if (addr_n == 3)
+		printf("  (page %u)", addr[0] | (addr[1] << 8) | (addr[2] << 16));
+	printf("\n");
+	addr_n = 0;
+}
+
+static void flush_burst(void) {
+	long long i, shown;
+
+	if (burst_dir == 0)
+		return;
+	if (!dump_all) {
+		print_time(burst_time);
+		printf("%s %lld bytes ", burst_dir == 'W' ? "DIN " : "DOUT", burst_len);
+		shown = burst_len < BURST_SHOWN ? burst_len : BURST_SHOWN;
+		for (i = 0; i < shown; i++)
+			printf(" %02X", burst[i]);
+		printf("%s\n", burst_len > BURST_SHOWN ? " ..." : "");
+	} else if (burst_len % BURST_SHOWN) {
+		printf("\n");
+	}
+	burst_dir = 0;
+	burst_len = 0;
+}
+
+static void data_byte(int64_t t, char dir, unsigned char b) {
+	if (burst_dir != dir) {
+		flush_addr();
+		flush_burst();
+		burst_dir = dir;
+		burst_time = t;
+		if (dump_all) {
+			print_time(t);
+			printf("%s\n", dir == 'W' ? "DIN" : "DOUT");
+		}
+	}
+	if (dump_all) {
+		printf("%s%02X", burst_len % BURST_SHOWN ? " " : "    ", b);
+		if (burst_len % BURST_SHOWN == BURST_SHOWN - 1)
+			printf("\n");
+	} else if (burst_len < BURST_SHOWN) {
+		burst[burst_len] = b;
+	}
+	burst_len++;
+}
+
+static unsigned char io_byte(unsigned s) {
+	return (s >> SIG_IO0) & 0xFF;
+}
+
+#define HIGH(s, sig) (((s) >> (sig)) & 1)
+
+static void write_cycle(int64_t t, unsigned s) {
+	unsigned char b = io_byte(s);
+
+	if (HIGH(s, SIG_CLE)) {
+		flush_addr();
+		flush_burst();
+		print_time(t);
+		printf("CMD  %02X  %s\n", b, command_name(b));
+		last_cmd = b;
+		n_cmd++;
+	} else if (HIGH(s, SIG_ALE)) {
+		flush_burst();
+		if (addr_n == 0)
+			addr_time = t;
+		if (addr_n < (int)sizeof(addr))
+			addr[addr_n++] = b;
+		n_addr++;
+	} else {
+		data_byte(t, 'W', b);
+		n_in++;
+	}
+}
+
+static void busy_done(int64_t t, int64_t ns) {
+	struct timing *tm;
+
+	switch (last_cmd) {
+	case 0x30: case 0x31: case 0x3F: tm = &t_r; break;
+	case 0x10: case 0x15:            tm = &t_prog; break;
+	case 0xD0:                       tm = &t_bers; break;
+	default:                         tm = &t_busy; break;
+	}
+	add_timing(tm, ns);
+	flush_addr();
+	flush_burst();
+	print_time(t);
+	printf("BUSY %.3f us after %02X\n", ns / 1000.0, last_cmd);
+}
+
+static void sample(int64_t t, unsigned s) {
+	unsigned changed;
+	int selected;
+
+	if (!have_state) {
+		state = s;
+		have_state = 1;
+		return;
+	}
+	if ((changed = state ^ s) == 0)
+		return;
+	selected = !HIGH(state, SIG_CE);
+
+	if ((changed & (0xFF << SIG_IO0)) && !HIGH(s, SIG_RE))
+		io_change = t;
+
+	// rising strobes latch what was on the bus before this row
+	if (HIGH(changed, SIG_WE) && HIGH(s, SIG_WE) && we_fall >= 0) {
+		add_timing(&t_wp, t - we_fall);
+		if (selected)
+			write_cycle(t, state);
+	}
+	if (HIGH(changed, SIG_RE) && HIGH(s, SIG_RE) && re_fall >= 0) {
+		add_timing(&t_rp, t - re_fall);
+		if (io_change >= re_fall)
+			add_timing(&t_rea, io_change - re_fall);
+		if (selected) {
+			data_byte(t, 'R', io_byte(state));
+			n_out++;
+		}
+	}
+
+	if (HIGH(changed, SIG_WE) && !HIGH(s, SIG_WE)) {
+		if (we_prev_fall >= 0 && t - we_prev_fall < CYCLE_GAP_NS)
+			add_timing(&t_wc, t - we_prev_fall);
+		we_fall = we_prev_fall = t;
+	}
+	if (HIGH(changed, SIG_RE) && !HIGH(s, SIG_RE)) {
+		if (re_prev_fall >= 0 && t - re_prev_fall < CYCLE_GAP_NS)
+			add_timing(&t_rc, t - re_prev_fall);
+		re_fall = re_prev_fall = t;
+		io_change = -1;
+	}
+	if (HIGH(changed, SIG_RB)) {
+		if (!HIGH(s, SIG_RB))
+			rb_fall = t;
+		else if (rb_fall >= 0)
+			busy_done(t, t - rb_fall);
+	}
+	state = s;
+}
+
+// ------------------------------ CSV ------------------------------
+
+// seconds with up to 9 decimals to ns, strtod for anything fancier
+static int64_t parse_time(const char *p, const char **end) {
+	int64_t sec = 0, frac = 0;
+	int digits = 0, neg = 0;
+	const char *start = p;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+		sec = sec * 10 + (*p++ - '0');
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++) {
+			if (digits < 9) {
+				frac = frac * 10 + (*p - '0');
+				digits++;
+			}
+		}
+	}
+	if (*p == 'e' || *p == 'E') {
+		char *e;
+		double v = strtod(start, &e);
+		*end = e;
+		return (int64_t)(v * 1e9 + (v < 0 ? -0.5 : 0.5));
+	}
+	for (; digits < 9; digits++)
+		frac *= 10;
+	*end = p;
+	return neg ? -(sec * 1000000000 + frac) : sec * 1000000000 + frac;
+}
+
+static void parse_row(const char *p) {
+	unsigned s;
+	int col, sig;
+	int64_t t;
+
+	t = parse_time(p, &p);
+	// missing signals keep their idle level, CE# reads as selected
+	s = have_state ? state : (1 << SIG_WP) | (1 << SIG_WE) | (1 << SIG_RE) | (1 << SIG_RB);
+	for (col = 1; *p == ',' && col < columns; col++) {
+		p++;
+		while (*p == ' ')
+			p++;
+		if ((sig = col_sig[col]) >= 0) {
+			if (*p == '1')
+				s |= 1u << sig;
+			else if (*p == '0')
+				s &= ~(1u << sig);
+		}
+		while (*p && *p != ',')
+			p++;
+	}
+	sample(t, s);
+}
+
+int main(int argc, char **argv) {
+	static char buf[READ_CHUNK + MAX_LINE + 1];
+	char header[MAX_LINE];
+	char *kvset = NULL, *map = NULL, *line, *nl;
+	size_t len = 0, n;
+	long long rows = 0;
+	int i, opt;
+	FILE *f;
+
+	for (i = 0; i < MAX_CHANNELS; i++)
+		forced_sig[i] = -1;
+
+	for (opt = 1; opt < argc - 1 && argv[opt][0] == '-' && argv[opt][1]; opt++) {
+		if (strcmp(argv[opt], "-k") == 0 && opt + 1 < argc - 1)
+			kvset = argv[++opt];
+		else if (strcmp(argv[opt], "-m") == 0 && opt + 1 < argc - 1)
+			map = argv[++opt];
+		else if (strcmp(argv[opt], "-x") == 0)
+			dump_all = 1;
+		else
+			goto usage;
+	}
+	if (opt != argc - 1) {
+usage:
+		printf("usage: %s [-k settings.kvset] [-m SIG=channel,...] [-x] <capture.csv | ->\n\n" \
+		    " -k  take channel names from a KingstVIS settings file\n" \
+		    " -m  map signals to channels, e.g. WE=3,RE=5,CLE=6,IO0=7\n" \
+		    " -x  print every data byte instead of the first %d of a burst\n\n" \
+		    "Signals: WP# ALE CE# WE# R/B# RE# CLE IO0..IO7 (or I/O n, GPIOnn)\n",
+		    argv[0], BURST_SHOWN);
+		return -1;
+	}
+
+	builtin_channels();
+	if (kvset != NULL && load_kvset(kvset) < 0)
+		return -1;
+	if (map != NULL && parse_map(map) < 0)
+		goto usage;
+
+	if (strcmp(argv[opt], "-") == 0)
+		f = stdin;
+	else if ((f = fopen(argv[opt], "r")) == NULL) {
+		perror("fopen capture");
+		return -1;
+	}
+
+	if (fgets(header, sizeof(header), f) == NULL || parse_header(header) < 0) {
+		printf("%s: not a logic analyzer CSV export\n", argv[opt]);
+		return -1;
+	}
+
+	// stream the rows, only a partial line is carried over between reads
+	while ((n = fread(buf + len, 1, READ_CHUNK, f)) > 0 || len > 0) {
+		len += n;
+		if (n == 0)
+			buf[len++] = '\n';
+		buf[len] = 0;
+		line = buf;
+		while ((nl = memchr(line, '\n', buf + len - line)) != NULL) {
+			*nl = 0;
+			if ((*line >= '0' && *line <= '9') || *line == '-') {
+				parse_row(line);
+				rows++;
+			}
+			line = nl + 1;
+		}
+		len = buf + len - line;
+		if (len > MAX_LINE) {
+			printf("line too long after row %lld\n", rows);
+			return -1;
+		}
+		memmove(buf, line, len);
+	}
+	if (f != stdin)
+		fclose(f);
+	flush_addr();
+	flush_burst();
+
+	printf("\n%lld rows, %lld commands, %lld address cycles, %lld bytes in, %lld bytes out\n\n",
+		rows, n_cmd, n_addr, n_in, n_out);
+	printf("Achieved timing:\n");
+	print_timing(&t_wp);
+	print_timing(&t_wc);
+	print_timing(&t_rp);
+	print_timing(&t_rc);
+	print_timing(&t_rea);
+	print_timing(&t_r);
+	print_timing(&t_prog);
+	print_timing(&t_bers);
+	print_timing(&t_busy);
+	return 0;
+}
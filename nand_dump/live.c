@@ -0,0 +1,459 @@
+/*
+    Live pipeline for rpi-raw-nand: chip to partition images in one pass
+
+    read_full, descramble, ecc_check and partitions are four passes over
+    570 MB. Here the pages go through once, a block at a time:
+
+        bus      the calling thread reads the block's pages off the chip
+                 (bad blocks in BBT_FILE are not read, 0xFF)
+        workers  descramble and ECC correct sectors 0 .. 2 of every page,
+                 block n goes to worker n % workers
+                 (the raw block goes to the dump first, if one was asked
+                 for)
+        sink     writes the data bytes into <dir>/<name>.bin at the offset
+                 the partitions data export puts them (UBI layout for
+                 persist/userdata)
+
+    The stages pass block buffers through single producer, single consumer
+    rings (head and tail with acquire/release, as bus_trace.c), bus to each
+    worker, each worker to the sink and the sink back to the bus. There are
+    LIVE_BUFFERS buffers and every ring holds them all, so a push never
+    fails; the bus waiting for a free buffer is the backpressure, and how
+    long it waited tells which side is the bottleneck.
+
+    The images are written with pwrite() into files made full size up
+    front, so blocks can land in any order and the zero padding of the UBI
+    layout is a hole. Once the bus has read the last page only the blocks
+    still in the rings are left to do.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+
+#define LIVE_RING    64 // power of 2, at least LIVE_BUFFERS
+#define LIVE_BUFFERS 16 // blocks in flight
+#define LIVE_SEGS    PAGES_PER_BLOCK
+
+struct live_seg {
+	int fd;
+	off_t offset;
+	unsigned int first, count; // pages of the block's data
+};
+
+struct live_block {
+	unsigned int block;
+	unsigned int pages;        // PAGES_PER_BLOCK, 0: the end, no more blocks
+	int skip;                  // bad, not read
+	int segs;
+	struct live_seg seg[LIVE_SEGS];
+	unsigned char raw[BLOCK_SIZE];
+	unsigned char data[PAGES_PER_BLOCK * PAGE_DATA];
+};
+
+struct live_ring {
+	unsigned long head;        // next to push, written by the producer
+	char pad[64 - sizeof(unsigned long)];
+	unsigned long tail;        // next to pop, written by the consumer
+	struct live_block *item[LIVE_RING];
+};
+
+struct live_stats {
+	unsigned long clean, corrected, erased, uncorrectable;
+	double busy;               // seconds spent on blocks
+};
+
+struct live_job {
+	const struct partition *parts;
+	int n;
+	int *fd;
+	int dump_fd;
+	unsigned char keys[PAGES_PER_BLOCK][SECTOR_SIZE];
+	int have_key[PAGES_PER_BLOCK];
+	int ecc;
+	int workers;
+	struct live_ring to_worker[MAX_WORKERS];
+	struct live_ring to_sink[MAX_WORKERS];
+	struct live_ring to_bus;
+	struct live_stats stats[MAX_WORKERS];
+	FILE *badlog;
+	int failed;
+	double sink_busy;
+};
+
+struct live_worker {
+	struct live_job *job;
+	int id;
+};
+
+static void ring_push(struct live_ring *r, struct live_block *b) {
+	unsigned long h = r->head;
+
+	// never full, see LIVE_RING
+	r->item[h % LIVE_RING] = b;
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+static struct live_block *ring_pop(struct live_ring *r) {
+	unsigned long t = r->tail;
+	struct live_block *b;
+
+	if (t == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	b = r->item[t % LIVE_RING];
+	__atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+	return b;
+}
+
+// nothing to do: yield a few times, then sleep, a waiting stage should not take a core from the bus
+static void idle(unsigned int *waits) {
+	struct timespec pause = { 0, 100000 };
+
+	if ((*waits)++ < 64)
+		sched_yield();
+	else
+		nanosleep(&pause, NULL);
+}
+
+// file offset of the data of <page> in the partitions data export of <part>, as export_data() in gpt.c
+static off_t data_offset(const struct partition *part, unsigned int page) {
+	unsigned int start, pip, q;
+	off_t offset;
+
+	if (!is_ubi(part))
+		return (off_t)(page - part->first_page) * PAGE_DATA;
+	start = page / PAGES_PER_BLOCK == part->first_page / PAGES_PER_BLOCK ? part->first_page % PAGES_PER_BLOCK : 0;
+	pip = page % PAGES_PER_BLOCK;
+	offset = (off_t)(page / PAGES_PER_BLOCK - part->first_page / PAGES_PER_BLOCK) * UBI_PEB_SIZE + (off_t)(pip - start) * PAGE_DATA;
+	for (q = start; q < pip && q < 2; q++)
+		offset += 4096 - PAGE_DATA;
+	return offset;
+}
+
+static off_t image_size(const struct partition *part) {
+	unsigned int last = part->first_page + part->pages - 1;
+
+	if (!is_ubi(part))
+		return (off_t)part->pages * PAGE_DATA;
+	return (off_t)(last / PAGES_PER_BLOCK - part->first_page / PAGES_PER_BLOCK + 1) * UBI_PEB_SIZE;
+}
+
+static void live_page(struct live_job *job, struct live_stats *st, unsigned int page, unsigned char *raw, unsigned char *data) {
+	const unsigned char *key = job->keys[page % PAGES_PER_BLOCK];
+	unsigned int bad = 0;
+	int s, i, flips, res;
+
+	for (s = 0; s < SECTORS_PER_PAGE - 1; s++, raw += SECTOR_SIZE, data += SECTOR_DATA) {
+		if (erased_sector(raw)) {
+			// never scrambled; its bit flips go, as ecc_check does
+			if (job->ecc)
+				memset(raw, 0xFF, SECTOR_SIZE);
+			st->erased++;
+		} else {
+			for (i = 0; i < SECTOR_SIZE; i++)
+				raw[i] ^= key[i];
+			res = job->ecc ? ecc_check_sector(raw, 1, &flips) : ECC_CLEAN;
+			if (res == ECC_UNCORRECTABLE) {
+				st->uncorrectable++;
+				bad |= 1 << s;
+			} else if (res == ECC_CORRECTED) {
+				st->corrected++;
+			} else {
+				st->clean++;
+			}
+		}
+		memcpy(data, raw, SECTOR_DATA);
+	}
+	if (bad)
+		fprintf(job->badlog, "page %u: sectors 0x%x fail ECC, written uncorrected\n", page, bad);
+}
+
+// the runs of pages that go to one file at consecutive offsets
+static void live_route(struct live_job *job, struct live_block *b) {
+	const struct partition *part;
+	struct live_seg *seg;
+	unsigned int i, page;
+	off_t offset;
+	int p = 0;
+
+	b->segs = 0;
+	for (i = 0; i < b->pages; i++) {
+		page = b->block * PAGES_PER_BLOCK + i;
+		for (p = 0; p < job->n; p++)
+			if (page >= job->parts[p].first_page && page - job->parts[p].first_page < job->parts[p].pages)
+				break;
+		if (p == job->n)
+			continue;
+		part = &job->parts[p];
+		offset = data_offset(part, page);
+		seg = b->segs > 0 ? &b->seg[b->segs - 1] : NULL;
+		if (seg != NULL && seg->fd == job->fd[p] && seg->first + seg->count == i &&
+		    seg->offset + (off_t)seg->count * PAGE_DATA == offset) {
+			seg->count++;
+			continue;
+		}
+		seg = &b->seg[b->segs++];
+		seg->fd = job->fd[p];
+		seg->offset = offset;
+		seg->first = i;
+		seg->count = 1;
+	}
+}
+
+static void *live_worker(void *arg) {
+	struct live_worker *w = (struct live_worker *)arg;
+	struct live_job *job = w->job;
+	struct live_stats *st = &job->stats[w->id];
+	struct live_block *b;
+	unsigned int i, waits = 0;
+	double start;
+
+	for (;;) {
+		if ((b = ring_pop(&job->to_worker[w->id])) == NULL) {
+			idle(&waits);
+			continue;
+		}
+		waits = 0;
+		if (b->pages > 0) {
+			start = wall_clock();
+			if (job->dump_fd >= 0 && pwrite(job->dump_fd, b->raw, (size_t)b->pages * PAGE_SIZE,
+			    (off_t)b->block * BLOCK_SIZE) != (ssize_t)b->pages * PAGE_SIZE) {
+				perror("pwrite dump");
+				__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+			}
+			for (i = 0; i < b->pages; i++)
+				if (b->skip)
+					memset(b->data + i * PAGE_DATA, 0xFF, PAGE_DATA);
+				else
+					live_page(job, st, b->block * PAGES_PER_BLOCK + i, b->raw + i * PAGE_SIZE, b->data + i * PAGE_DATA);
+			live_route(job, b);
+			st->busy += wall_clock() - start;
+		}
+		ring_push(&job->to_sink[w->id], b);
+		if (b->pages == 0)
+			return NULL;
+	}
+}
+
+static void *live_sink(void *arg) {
+	struct live_job *job = (struct live_job *)arg;
+	struct live_block *b;
+	struct live_seg *seg;
+	size_t len;
+	unsigned int waits = 0;
+	double start;
+	int w, done = 0, got, s;
+
+	while (done < job->workers) {
+		for (w = 0, got = 0; w < job->workers; w++) {
+			if ((b = ring_pop(&job->to_sink[w])) == NULL)
+				continue;
+			got = 1;
+			if (b->pages == 0) {
+				done++;
+				continue;
+			}
+			start = wall_clock();
+			for (s = 0; s < b->segs; s++) {
+				seg = &b->seg[s];
+				len = (size_t)seg->count * PAGE_DATA;
+				if (pwrite(seg->fd, b->data + seg->first * PAGE_DATA, len, seg->offset) != (ssize_t)len) {
+					perror("pwrite image");
+					__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+				}
+			}
+			job->sink_busy += wall_clock() - start;
+			ring_push(&job->to_bus, b);
+		}
+		if (got)
+			waits = 0;
+		else
+			idle(&waits);
+	}
+	return NULL;
+}
+
+int live_dump(const struct partition *parts, int n, unsigned int blocks, const struct live_source *src,
+    const struct bad_blocks *bb, const char *outdir, const char *dumpfile) {
+	static struct live_job job;
+	struct live_worker workers[MAX_WORKERS];
+	pthread_t threads[MAX_WORKERS], sink;
+	struct live_block *pool = NULL, *b, *spare = NULL;
+	struct live_stats total;
+	char file[512];
+	unsigned int block, page, buffers, waits, keys = 0;
+	unsigned long skipped = 0;
+	double start, seconds = 0, stalled = 0, t = 0;
+	struct rand_model model;
+	int p, w, mod, have_model, started = 0, sink_started = 0, ret = -1;
+
+	memset(&job, 0, sizeof(job));
+	job.parts = parts;
+	job.n = n;
+	job.dump_fd = -1;
+	have_model = rand_load(&model, XOR_DIR) == 0;
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++) {
+		job.have_key[mod] = load_xor_key(NULL, mod, XOR_DIR, have_model ? &model : NULL, job.keys[mod]) != XOR_KEY_NONE;
+		keys += job.have_key[mod];
+	}
+	if (keys < PAGES_PER_BLOCK) {
+		printf("Only %u of %d keys in " XOR_DIR ", the images need all (run xor_keys on a dump first)\n", keys, PAGES_PER_BLOCK);
+		return -1;
+	}
+	if (!(job.ecc = ecc_init() == 0))
+		printf("No ECC, the pages are only descrambled\n");
+	// bus, sink and the workers share the cores
+	job.workers = worker_count() - 1;
+	if (job.workers < 1)
+		job.workers = 1;
+	buffers = 2 * job.workers + 2 < LIVE_BUFFERS ? LIVE_BUFFERS : 2 * job.workers + 2;
+	if (buffers > LIVE_RING)
+		buffers = LIVE_RING;
+
+	if (make_dirs(outdir) < 0)
+		return -1;
+	if ((job.fd = (int *)malloc(n * sizeof(int))) == NULL ||
+	    (pool = (struct live_block *)malloc(buffers * sizeof(*pool))) == NULL) {
+		perror("malloc");
+		free(job.fd);
+		return -1;
+	}
+	for (p = 0; p < n; p++)
+		job.fd[p] = -1;
+	if ((job.badlog = fopen("bad.log", "w+")) == NULL) {
+		perror("fopen bad.log");
+		goto out;
+	}
+	for (p = 0; p < n; p++) {
+		snprintf(file, sizeof(file), "%s/%s.bin", outdir, parts[p].name);
+		if ((job.fd[p] = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(job.fd[p], image_size(&parts[p])) < 0) {
+			perror(file);
+			goto out;
+		}
+	}
+	if (dumpfile != NULL && ((job.dump_fd = open(dumpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+	    ftruncate(job.dump_fd, (off_t)blocks * BLOCK_SIZE) < 0)) {
+		perror(dumpfile);
+		goto out;
+	}
+
+	for (page = 0; page < buffers; page++)
+		ring_push(&job.to_bus, &pool[page]);
+	for (w = 0; w < job.workers; w++) {
+		workers[w].job = &job;
+		workers[w].id = w;
+		if (pthread_create(&threads[w], NULL, live_worker, &workers[w]) != 0) {
+			perror("pthread_create");
+			goto stop;
+		}
+		started++;
+	}
+	if (pthread_create(&sink, NULL, live_sink, &job) != 0) {
+		perror("pthread_create");
+		goto stop;
+	}
+	sink_started = 1;
+
+	printf("Reading %u blocks into %d partition images in %s, %d workers\n\n", blocks, n, outdir, job.workers);
+	start = wall_clock();
+	for (block = 0; block < blocks && !__atomic_load_n(&job.failed, __ATOMIC_RELAXED); block++) {
+		// backpressure: every buffer is still with the workers or the sink
+		t = wall_clock();
+		for (waits = 0; (b = ring_pop(&job.to_bus)) == NULL; )
+			idle(&waits);
+		stalled += wall_clock() - t;
+
+		b->block = block;
+		b->pages = PAGES_PER_BLOCK;
+		if ((b->skip = block_is_bad(bb, block))) {
+			memset(b->raw, 0xFF, BLOCK_SIZE);
+			fprintf(job.badlog, "block %u: bad in " BBT_FILE ", not read\n", block);
+			skipped++;
+		} else {
+			for (page = 0; page < PAGES_PER_BLOCK; page++)
+				if (src->read(src->ctx, block * PAGES_PER_BLOCK + page, b->raw + page * PAGE_SIZE) < 0)
+					break;
+			if (page < PAGES_PER_BLOCK) {
+				// not handed on, the blocks before it finish
+				__atomic_store_n(&job.failed, 1, __ATOMIC_RELAXED);
+				spare = b;
+				break;
+			}
+		}
+		ring_push(&job.to_worker[block % job.workers], b);
+		if (block % 8 == 0 || block == blocks - 1) {
+			seconds = wall_clock() - start;
+			printf("Block %u of %u, %.2f MB/s\r", block + 1, blocks,
+			    seconds > 0 ? (block + 1) * (double)BLOCK_SIZE / (1 << 20) / seconds : 0.0);
+			fflush(stdout);
+		}
+	}
+	t = wall_clock();
+	seconds = t - start;
+
+stop:
+	// the end marker takes a buffer like any block
+	for (w = 0; w < started; w++) {
+		if ((b = spare) != NULL)
+			spare = NULL;
+		else
+			for (waits = 0; (b = ring_pop(&job.to_bus)) == NULL; )
+				idle(&waits);
+		b->pages = 0;
+		ring_push(&job.to_worker[w], b);
+	}
+	for (w = 0; w < started; w++)
+		pthread_join(threads[w], NULL);
+	if (sink_started) {
+		pthread_join(sink, NULL);
+		ret = job.failed ? -1 : 0;
+	}
+	if (ret == 0) {
+		memset(&total, 0, sizeof(total));
+		for (w = 0; w < job.workers; w++) {
+			total.clean += job.stats[w].clean;
+			total.corrected += job.stats[w].corrected;
+			total.erased += job.stats[w].erased;
+			total.uncorrectable += job.stats[w].uncorrectable;
+			total.busy += job.stats[w].busy;
+		}
+		printf("\n\nRead in %.2f s (%.2f MB/s), the images were done %.3f s after the last page\n", seconds,
+		    seconds > 0 ? blocks * (double)BLOCK_SIZE / (1 << 20) / seconds : 0.0, wall_clock() - t);
+		printf("Bus waited %.2f s for free buffers, workers busy %.2f s, sink %.2f s\n", stalled, total.busy, job.sink_busy);
+		printf("ECC: %lu clean, %lu corrected, %lu erased, %lu uncorrectable sectors (see bad.log)\n",
+		    total.clean, total.corrected, total.erased, total.uncorrectable);
+		if (skipped)
+			printf("%lu bad blocks not read, 0xFF in the images\n", skipped);
+		for (p = 0; p < n; p++)
+			printf("%s/%s.bin\n", outdir, parts[p].name);
+		if (dumpfile != NULL)
+			printf("Raw pages in %s\n", dumpfile);
+	}
+
+out:
+	for (p = 0; p < n; p++)
+		if (job.fd[p] >= 0)
+			close(job.fd[p]);
+	if (job.dump_fd >= 0)
+		close(job.dump_fd);
+	if (job.badlog != NULL)
+		fclose(job.badlog);
+	free(pool);
+	free(job.fd);
+	return ret;
+}
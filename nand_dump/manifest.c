@@ -0,0 +1,413 @@
+/*
+    Hash manifests and the manifest, diff_manifest and verify_manifest
+    commands for rpi-raw-nand
+
+    <dump>.mf holds a 64 bit hash of every page of <dump> and one of every
+    block (the hash of its 64 page hashes), so two dumps, or a dump and a
+    read back after write_full, are compared in a few KB instead of 570 MB:
+
+        header          magic, page count, bytes hashed per page, size and
+                        mtime of the dump it describes
+        page hashes     uint64_t per page
+        block hashes    uint64_t per block
+
+    The hash is XXH64, about memory speed per core. read_full hashes every
+    page on its writer thread as it goes out and writes the manifest next
+    to the dump; the manifest command does it for any dump or archive on
+    all cores. diff_manifest compares two manifests block hash by block
+    hash and only looks at the page hashes of blocks that differ.
+    verify_manifest takes two dumps, (re)builds their manifests if they are
+    missing or stale and reads back just the blocks whose hashes disagree
+    to tell which bytes and bits differ.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "nand_dump.h"
+
+#define MANIFEST_MAGIC "NDMAN01"
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v)); // little endian, like the Pi
+	return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in) {
+	return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t v) {
+	return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed) {
+	const unsigned char *p = (const unsigned char *)buf, *end = p + len;
+	uint64_t h, v1, v2, v3, v4;
+	uint32_t k;
+
+	if (len >= 32) {
+		v1 = seed + XXH_P1 + XXH_P2;
+		v2 = seed + XXH_P2;
+		v3 = seed;
+		v4 = seed - XXH_P1;
+		do {
+			v1 = xxh_round(v1, read64(p));
+			v2 = xxh_round(v2, read64(p + 8));
+			v3 = xxh_round(v3, read64(p + 16));
+			v4 = xxh_round(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else {
+		h = seed + XXH_P5;
+	}
+	h += len;
+	for (; p + 8 <= end; p += 8)
+		h = rotl64(h ^ xxh_round(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+	if (p + 4 <= end) {
+		memcpy(&k, p, sizeof(k));
+		h = rotl64(h ^ (uint64_t)k * XXH_P1, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	return h ^ (h >> 32);
+}
+
+int manifest_alloc(struct manifest *m, unsigned int pages, unsigned int page_bytes) {
+	memset(m, 0, sizeof(*m));
+	memcpy(m->hdr.magic, MANIFEST_MAGIC, sizeof(m->hdr.magic));
+	m->hdr.pages = pages;
+	m->hdr.blocks = (pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+	m->hdr.page_bytes = page_bytes;
+	m->page = (uint64_t *)calloc((size_t)pages + m->hdr.blocks + 1, sizeof(uint64_t));
+	if (m->page == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	m->block = m->page + pages;
+	return 0;
+}
+
+void manifest_free(struct manifest *m) {
+	free(m->page);
+	m->page = m->block = NULL;
+}
+
+void manifest_blocks(struct manifest *m) {
+	unsigned int b, n;
+
+	for (b = 0; b < m->hdr.blocks; b++) {
+		n = m->hdr.pages - b * PAGES_PER_BLOCK;
+		if (n > PAGES_PER_BLOCK)
+			n = PAGES_PER_BLOCK;
+		m->block[b] = hash64(m->page + (size_t)b * PAGES_PER_BLOCK, n * sizeof(uint64_t), b);
+	}
+}
+
+// to <dumpfile>.mf, stamped with the dump as it is now
+int manifest_write(struct manifest *m, const char *dumpfile) {
+	char file[512];
+	struct stat st;
+	size_t len;
+	FILE *fp;
+
+	if (stat(dumpfile, &st) < 0) {
+		perror(dumpfile);
+		return -1;
+	}
+	m->hdr.dump_size = st.st_size;
+	m->hdr.dump_mtime = st.st_mtim.tv_sec;
+	m->hdr.dump_mtime_ns = st.st_mtim.tv_nsec;
+	snprintf(file, sizeof(file), "%s.mf", dumpfile);
+	if ((fp = fopen(file, "wb")) == NULL) {
+		perror(file);
+		return -1;
+	}
+	len = (size_t)m->hdr.pages + m->hdr.blocks;
+	if (fwrite(&m->hdr, sizeof(m->hdr), 1, fp) != 1 || fwrite(m->page, sizeof(uint64_t), len, fp) != len) {
+		perror(file);
+		fclose(fp);
+		return -1;
+	}
+	if (fclose(fp) != 0) {
+		perror(file);
+		return -1;
+	}
+	return 0;
+}
+
+int manifest_read(struct manifest *m, const char *file) {
+	struct manifest_header hdr;
+	size_t len;
+	FILE *fp;
+
+	memset(m, 0, sizeof(*m));
+	if ((fp = fopen(file, "rb")) == NULL) {
+		perror(file);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) != 0) {
+		printf("%s is no manifest\n", file);
+		fclose(fp);
+		return -1;
+	}
+	// the hashes are read into what hdr.pages sizes, blocks must agree with it
+	if (hdr.pages > CHIP_BLOCKS * PAGES_PER_BLOCK || hdr.blocks != (hdr.pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK) {
+		printf("%s: %u pages in %u blocks, not a manifest of this chip\n", file, hdr.pages, hdr.blocks);
+		fclose(fp);
+		return -1;
+	}
+	if (manifest_alloc(m, hdr.pages, hdr.page_bytes) < 0) {
+		fclose(fp);
+		return -1;
+	}
+	m->hdr = hdr;
+	len = (size_t)hdr.pages + hdr.blocks;
+	if (fread(m->page, sizeof(uint64_t), len, fp) != len) {
+		printf("%s: cut short\n", file);
+		manifest_free(m);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+struct hash_job {
+	const struct dump_image *img;
+	struct manifest *m;
+};
+
+static void hash_block(void *ctx, unsigned long block, int worker) {
+	struct hash_job *job = (struct hash_job *)ctx;
+	unsigned int page = block * PAGES_PER_BLOCK, last = page + PAGES_PER_BLOCK;
+
+	(void)worker;
+	if (last > job->img->pages)
+		last = job->img->pages;
+	for (; page < last; page++)
+		job->m->page[page] = hash64(dump_page(job->img, page), PAGE_SIZE, 0);
+}
+
+static int build_manifest(const struct dump_image *img, const char *dumpfile, struct manifest *m) {
+	struct hash_job job = { img, m };
+	double start, seconds;
+
+	if (manifest_alloc(m, img->pages, PAGE_SIZE) < 0)
+		return -1;
+	printf("Hashing %u pages of %s\n", img->pages, dumpfile);
+	start = wall_clock();
+	run_parallel(m->hdr.blocks, 0, hash_block, &job);
+	manifest_blocks(m);
+	seconds = wall_clock() - start;
+	printf("Hashed in %.2f s (%.0f MB/s)\n", seconds, seconds > 0 ? img->pages * (double)PAGE_SIZE / (1 << 20) / seconds : 0.0);
+	if (manifest_write(m, dumpfile) < 0) {
+		manifest_free(m);
+		return -1;
+	}
+	return 0;
+}
+
+// <dumpfile>.mf if it still describes the dump, else a new one
+static int dump_manifest(const struct dump_image *img, const char *dumpfile, struct manifest *m) {
+	char file[512];
+	struct stat st;
+
+	snprintf(file, sizeof(file), "%s.mf", dumpfile);
+	if (access(file, R_OK) == 0 && stat(dumpfile, &st) == 0 && manifest_read(m, file) == 0) {
+		if (m->hdr.dump_size == (uint64_t)st.st_size && m->hdr.dump_mtime == st.st_mtim.tv_sec &&
+		    m->hdr.dump_mtime_ns == st.st_mtim.tv_nsec && m->hdr.pages == img->pages && m->hdr.page_bytes == PAGE_SIZE)
+			return 0;
+		printf("%s is stale\n", file);
+		manifest_free(m);
+	}
+	return build_manifest(img, dumpfile, m);
+}
+
+int make_manifest(char *dumpfile) {
+	struct dump_image img;
+	struct manifest m;
+	int ret;
+
+	if (dump_open(&img, dumpfile) < 0)
+		return -1;
+	ret = build_manifest(&img, dumpfile, &m);
+	if (ret == 0) {
+		printf("%u page and %u block hashes written to %s.mf\n", m.hdr.pages, m.hdr.blocks, dumpfile);
+		manifest_free(&m);
+	}
+	dump_close(&img);
+	return ret;
+}
+
+// calls fn for every run of pages whose hashes differ, returns the pages that differ
+static unsigned long differing_pages(const struct manifest *a, const struct manifest *b, unsigned int pages,
+    void (*fn)(void *ctx, unsigned int first, unsigned int last), void *ctx) {
+	unsigned int block, blocks = (pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK, page, last, run = 0, first = 0;
+	unsigned long found = 0;
+	int open = 0;
+
+	for (block = 0; block < blocks; block++) {
+		page = block * PAGES_PER_BLOCK;
+		last = page + PAGES_PER_BLOCK < pages ? page + PAGES_PER_BLOCK : pages;
+		// a partial last block hashes differently, its pages still compare
+		if (a->block[block] == b->block[block] && last - page == PAGES_PER_BLOCK) {
+			if (open)
+				fn(ctx, first, run);
+			open = 0;
+			continue;
+		}
+		for (; page < last; page++) {
+			if (a->page[page] != b->page[page]) {
+				if (!open)
+					first = page;
+				open = 1;
+				run = page;
+				found++;
+			} else if (open) {
+				fn(ctx, first, run);
+				open = 0;
+			}
+		}
+	}
+	if (open)
+		fn(ctx, first, run);
+	return found;
+}
+
+static void print_run(void *ctx, unsigned int first, unsigned int last) {
+	(void)ctx;
+	if (first == last)
+		printf("page %u (block %u) differs\n", first, first / PAGES_PER_BLOCK);
+	else
+		printf("pages %u .. %u (blocks %u .. %u) differ\n", first, last, first / PAGES_PER_BLOCK, last / PAGES_PER_BLOCK);
+}
+
+static unsigned int common_pages(const struct manifest *a, const struct manifest *b, const char *name_a, const char *name_b) {
+	if (a->hdr.pages != b->hdr.pages)
+		printf("%s has %u pages, %s %u: comparing the first %u\n", name_a, a->hdr.pages, name_b, b->hdr.pages,
+		    a->hdr.pages < b->hdr.pages ? a->hdr.pages : b->hdr.pages);
+	return a->hdr.pages < b->hdr.pages ? a->hdr.pages : b->hdr.pages;
+}
+
+int diff_manifest(char *file_a, char *file_b) {
+	struct manifest a, b;
+	unsigned long found;
+	unsigned int pages;
+	double start;
+
+	if (manifest_read(&a, file_a) < 0)
+		return -1;
+	if (manifest_read(&b, file_b) < 0) {
+		manifest_free(&a);
+		return -1;
+	}
+	if (a.hdr.page_bytes != b.hdr.page_bytes) {
+		printf("%s hashes %u bytes per page, %s %u: not comparable\n", file_a, a.hdr.page_bytes, file_b, b.hdr.page_bytes);
+		manifest_free(&a);
+		manifest_free(&b);
+		return -1;
+	}
+	pages = common_pages(&a, &b, file_a, file_b);
+	start = wall_clock();
+	found = differing_pages(&a, &b, pages, print_run, NULL);
+	printf("%lu of %u pages differ (compared in %.3f ms)\n", found, pages, (wall_clock() - start) * 1000);
+	manifest_free(&a);
+	manifest_free(&b);
+	return found || a.hdr.pages != b.hdr.pages ? 1 : 0;
+}
+
+struct verify_job {
+	const struct dump_image *a, *b;
+	unsigned long bytes, bits;
+};
+
+// read both back, only here, and say how they differ
+static void verify_run(void *ctx, unsigned int first, unsigned int last) {
+	struct verify_job *job = (struct verify_job *)ctx;
+	const unsigned char *pa, *pb;
+	unsigned int page, bytes, bits, sectors, i;
+
+	for (page = first; page <= last; page++) {
+		pa = dump_page(job->a, page);
+		pb = dump_page(job->b, page);
+		for (i = 0, bytes = 0, bits = 0, sectors = 0; i < PAGE_SIZE; i++) {
+			if (pa[i] == pb[i])
+				continue;
+			bytes++;
+			bits += __builtin_popcount(pa[i] ^ pb[i]);
+			sectors |= 1 << (i / SECTOR_SIZE);
+		}
+		printf("page %u: %u bytes, %u bits differ (sectors 0x%x)\n", page, bytes, bits, sectors);
+		job->bytes += bytes;
+		job->bits += bits;
+	}
+}
+
+int verify_manifest(char *file_a, char *file_b) {
+	struct dump_image a, b;
+	struct manifest ma, mb;
+	struct verify_job job = { &a, &b, 0, 0 };
+	unsigned long found;
+	unsigned int pages;
+	int ret = -1;
+
+	if (dump_open(&a, file_a) < 0)
+		return -1;
+	if (dump_open(&b, file_b) < 0) {
+		dump_close(&a);
+		return -1;
+	}
+	if (dump_manifest(&a, file_a, &ma) < 0)
+		goto out;
+	if (dump_manifest(&b, file_b, &mb) < 0) {
+		manifest_free(&ma);
+		goto out;
+	}
+	pages = common_pages(&ma, &mb, file_a, file_b);
+	found = differing_pages(&ma, &mb, pages, verify_run, &job);
+	if (found)
+		printf("%lu of %u pages differ: %lu bytes, %lu bits\n", found, pages, job.bytes, job.bits);
+	else
+		printf("All %u pages match\n", pages);
+	ret = found || a.pages != b.pages ? 1 : 0;
+	manifest_free(&ma);
+	manifest_free(&mb);
+out:
+	dump_close(&a);
+	dump_close(&b);
+	return ret;
+}
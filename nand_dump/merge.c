@@ -0,0 +1,310 @@
+/*
+    merge_pages command for rpi-raw-nand
+
+    The native version of mergePages() in descramble/dumpreader.js: put the
+    <page>.bin files dump_flash_tool/dumppages.py writes back together into
+    one dump. The target is preallocated, then MERGE_READERS threads each
+    take the next page, read its file and pwrite it into place. With that
+    many opens in flight the merge runs at the speed the file system hands
+    out metadata, not at one file latency per page.
+
+    Missing pages and files shorter than PAGE_SIZE are filled up with 0xFF
+    (as if erased) and flagged in a bitmap, one bit per page, bit n % 8 of
+    byte n / 8, written next to the target as <target>.missing.
+
+    merge_dumps does better than compare_pages.js, which only keeps pages
+    two dumps agree on: from N read_full dumps of the same chip it builds
+    the image every bit of which is what most of the dumps read. The dumps
+    are mapped, not loaded, and voted on 64 bits at a time with a bit sliced
+    counter, one block per work item. Where an even number of dumps ties,
+    the first dump wins. <target>.votes gets one byte per page: the number
+    of bits in it not all dumps agree on, 255 for 255 or more, and the same
+    goes into the confidence of the pages in <target>.idx.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "nand_dump.h"
+
+#define MERGE_READERS 32 // mostly waiting on open/read, more than there are cores
+
+struct merge_job {
+	const char *dir;
+	int fd;
+	unsigned char *missing;     // bitmap
+	unsigned long absent, shrt;
+	int failed;
+};
+
+static void merge_page(void *ctx, unsigned long page, int worker) {
+	struct merge_job *job = (struct merge_job *)ctx;
+	unsigned char buf[PAGE_SIZE];
+	char file[512];
+	ssize_t n, got = 0;
+	int fd;
+
+	(void)worker;
+	snprintf(file, sizeof(file), "%s/%lu.bin", job->dir, page);
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			perror(file);
+		__atomic_fetch_add(&job->absent, 1, __ATOMIC_RELAXED);
+	} else {
+		while (got < PAGE_SIZE && (n = read(fd, buf + got, PAGE_SIZE - got)) > 0)
+			got += n;
+		close(fd);
+		if (got < PAGE_SIZE)
+			__atomic_fetch_add(&job->shrt, 1, __ATOMIC_RELAXED);
+	}
+	if (got < PAGE_SIZE) {
+		memset(buf + got, 0xFF, PAGE_SIZE - got);
+		__atomic_fetch_or(&job->missing[page / 8], 1 << (page % 8), __ATOMIC_RELAXED);
+	}
+	if (pwrite(job->fd, buf, PAGE_SIZE, (off_t)page * PAGE_SIZE) != PAGE_SIZE) {
+		perror("pwrite");
+		job->failed = 1;
+	}
+}
+
+int merge_pages(char *dir, char *outfile, int number_of_pages) {
+	struct merge_job job;
+	char mapfile[512];
+	unsigned long page, run;
+	double start, seconds;
+	FILE *fp;
+	int shown = 0, err;
+
+	memset(&job, 0, sizeof(job));
+	job.dir = dir;
+	if ((job.missing = calloc((number_of_pages + 7) / 8, 1)) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	if ((job.fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open output file");
+		free(job.missing);
+		return -1;
+	}
+	// one extent up front instead of growing the file from 32 places at once
+	if ((err = posix_fallocate(job.fd, 0, (off_t)number_of_pages * PAGE_SIZE)) != 0 && err != EOPNOTSUPP)
+		printf("fallocate: %s, going on without\n", strerror(err));
+
+	printf("Merging %d pages from %s into %s\n", number_of_pages, dir, outfile);
+	start = wall_clock();
+	run_parallel(number_of_pages, MERGE_READERS, merge_page, &job);
+	seconds = wall_clock() - start;
+	if (close(job.fd) < 0) {
+		perror("close output file");
+		job.failed = 1;
+	}
+	printf("Merged in %.2f s (%.0f pages/s): %lu missing, %lu short, filled with 0xFF\n", seconds,
+	    seconds > 0 ? number_of_pages / seconds : 0.0, job.absent, job.shrt);
+
+	// list the holes as ranges
+	for (page = 0; page < (unsigned long)number_of_pages && shown < 16; page++) {
+		if (!(job.missing[page / 8] & (1 << (page % 8))))
+			continue;
+		for (run = page; run + 1 < (unsigned long)number_of_pages && (job.missing[(run + 1) / 8] & (1 << ((run + 1) % 8))); run++)
+			;
+		printf("missing: pages %lu .. %lu\n", page, run);
+		shown++;
+		page = run;
+	}
+	if (shown == 16)
+		printf("...\n");
+
+	snprintf(mapfile, sizeof(mapfile), "%s.missing", outfile);
+	if ((fp = fopen(mapfile, "wb")) == NULL || fwrite(job.missing, (number_of_pages + 7) / 8, 1, fp) != 1) {
+		perror(mapfile);
+		job.failed = 1;
+	}
+	if (fp != NULL)
+		fclose(fp);
+	free(job.missing);
+	return job.failed ? -1 : 0;
+}
+
+#define MAX_DUMPS   15  // the vote counter has 4 bit planes
+#define PAGE_WORDS  (PAGE_SIZE / 8)
+
+struct vote_job {
+	struct dump_image in[MAX_DUMPS];
+	struct dump_image out;
+	int dumps;
+	unsigned int pages;
+	unsigned char *votes;                   // per page
+	unsigned long outvoted[MAX_DUMPS];      // bits each dump lost the vote on
+	unsigned long disputed, ties;           // bits
+};
+
+static void vote_block(void *ctx, unsigned long block, int worker) {
+	struct vote_job *job = (struct vote_job *)ctx;
+	unsigned long outvoted[MAX_DUMPS], disputed = 0, ties = 0;
+	unsigned int page, last;
+	uint64_t x[MAX_DUMPS], plane[4], carry, gt, eq, differ, result, tie;
+	unsigned long page_bits;
+	size_t off;
+	int w, d, b, half = job->dumps / 2;
+
+	(void)worker;
+	memset(outvoted, 0, sizeof(outvoted));
+	last = (block + 1) * PAGES_PER_BLOCK;
+	if (last > job->pages)
+		last = job->pages;
+	for (page = block * PAGES_PER_BLOCK; page < last; page++) {
+		page_bits = 0;
+		for (w = 0; w < PAGE_WORDS; w++) {
+			off = (size_t)page * PAGE_SIZE + w * 8;
+			differ = 0;
+			for (d = 0; d < job->dumps; d++) {
+				memcpy(&x[d], job->in[d].data + off, 8);
+				differ |= x[d] ^ x[0];
+			}
+			if (differ == 0) { // the usual case
+				memcpy(job->out.data + off, &x[0], 8);
+				continue;
+			}
+			// count the ones per bit position, 4 bit planes
+			plane[0] = plane[1] = plane[2] = plane[3] = 0;
+			for (d = 0; d < job->dumps; d++) {
+				carry = x[d];
+				for (b = 0; b < 4 && carry; b++) {
+					plane[b] ^= carry;
+					carry &= ~plane[b];
+				}
+			}
+			// gt: count > half, eq: count == half, msb first
+			gt = 0;
+			eq = ~(uint64_t)0;
+			for (b = 3; b >= 0; b--) {
+				if (half & (1 << b)) {
+					eq &= plane[b];
+				} else {
+					gt |= eq & plane[b];
+					eq &= ~plane[b];
+				}
+			}
+			tie = job->dumps % 2 ? 0 : eq;
+			result = gt | (tie & x[0]);
+			memcpy(job->out.data + off, &result, 8);
+			for (d = 0; d < job->dumps; d++)
+				outvoted[d] += __builtin_popcountll(x[d] ^ result);
+			page_bits += __builtin_popcountll(differ);
+			ties += __builtin_popcountll(tie);
+		}
+		job->votes[page] = page_bits > 255 ? 255 : page_bits;
+		disputed += page_bits;
+	}
+	for (d = 0; d < job->dumps; d++)
+		if (outvoted[d])
+			__atomic_fetch_add(&job->outvoted[d], outvoted[d], __ATOMIC_RELAXED);
+	__atomic_fetch_add(&job->disputed, disputed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&job->ties, ties, __ATOMIC_RELAXED);
+}
+
+// every disputed bit costs a point of confidence in <output>.idx
+static void index_votes(const char *outfile, const unsigned char *votes, unsigned int pages) {
+	struct page_index idx;
+	unsigned int page;
+
+	if (index_open(&idx, outfile, pages) < 0)
+		return;
+	for (page = 0; page < pages; page++) {
+		idx.page[page].confidence = votes[page] ? (votes[page] < 254 ? 255 - votes[page] : 1) : 255;
+		if (votes[page])
+			idx.page[page].flags |= IDX_DISPUTED;
+	}
+	index_close(&idx);
+}
+
+int merge_dumps(char *outfile, char **infiles, int dumps) {
+	struct vote_job *job;
+	char mapfile[512];
+	unsigned int page, bad_pages = 0;
+	double start, seconds;
+	FILE *fp;
+	int d, ret = -1;
+
+	if (dumps < 2 || dumps > MAX_DUMPS) {
+		printf("merge_dumps needs 2 to %d dumps\n", MAX_DUMPS);
+		return -1;
+	}
+	if ((job = calloc(1, sizeof(*job))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	for (d = 0; d < dumps; d++) {
+		if (dump_open(&job->in[d], infiles[d]) < 0)
+			goto out;
+		job->dumps++;
+		if (d == 0 || job->in[d].pages < job->pages)
+			job->pages = job->in[d].pages;
+	}
+	for (d = 0; d < dumps; d++)
+		if (job->in[d].pages != job->pages)
+			printf("%s: %u pages, only the first %u are merged\n", infiles[d], job->in[d].pages, job->pages);
+	if (dumps == 2)
+		printf("Two dumps can not outvote each other, the first one wins every difference\n");
+	if ((job->votes = calloc(job->pages, 1)) == NULL) {
+		perror("calloc");
+		goto out;
+	}
+	if (dump_create(&job->out, outfile, (size_t)job->pages * PAGE_SIZE) < 0)
+		goto out;
+	// every output page is written exactly once, front to back
+	madvise(job->out.data, job->out.size, MADV_SEQUENTIAL);
+
+	printf("Voting over %d dumps of %u pages into %s\n", dumps, job->pages, outfile);
+	start = wall_clock();
+	run_parallel((job->pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK, 0, vote_block, job);
+	seconds = wall_clock() - start;
+	printf("Voted in %.2f s (%.0f MB/s read)\n", seconds,
+	    seconds > 0 ? (double)dumps * job->pages * PAGE_SIZE / (1 << 20) / seconds : 0.0);
+
+	for (page = 0; page < job->pages; page++)
+		if (job->votes[page])
+			bad_pages++;
+	printf("%u pages with %lu disputed bits", bad_pages, job->disputed);
+	if (job->ties)
+		printf(", %lu of them tied", job->ties);
+	printf("\n");
+	for (d = 0; d < dumps; d++)
+		printf("  %s: outvoted on %lu bits\n", infiles[d], job->outvoted[d]);
+
+	snprintf(mapfile, sizeof(mapfile), "%s.votes", outfile);
+	if ((fp = fopen(mapfile, "wb")) == NULL || fwrite(job->votes, job->pages, 1, fp) != 1) {
+		perror(mapfile);
+		if (fp != NULL)
+			fclose(fp);
+		goto out;
+	}
+	fclose(fp);
+	ret = 0;
+
+out:
+	if (job->out.data != NULL && job->out.data != MAP_FAILED) {
+		dump_close(&job->out);
+		if (ret == 0)
+			index_votes(outfile, job->votes, job->pages);
+	}
+	for (d = 0; d < job->dumps; d++)
+		dump_close(&job->in[d]);
+	free(job->votes);
+	free(job);
+	return ret;
+}
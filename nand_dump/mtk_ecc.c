@@ -0,0 +1,465 @@
+/*
+    BCH sector ECC of the MT8516 NFI and the ecc_check command, see mtk_ecc.h
+
+    A sector is checked by running its protected bytes through the encoder
+    (a 448 bit LFSR, table driven 32 bits at a time like lib/bch.c in Linux)
+    and comparing with the stored parity. That is the whole cost for a clean
+    sector. Only when they differ are the syndromes computed from the
+    difference, the error locator found with Berlekamp-Massey and its roots
+    with a Chien search over the (shortened) codeword.
+
+    ecc_check runs the sectors of a descrambled dump through this on all
+    cores and writes an index with one byte per sector: the number of bits
+    corrected, ECC_INDEX_ERASED or ECC_INDEX_BAD. The worst sector of each
+    page also goes into the dump's page index, see page_index.c.
+
+    The layout follows the Linux mtk_nand driver for 1 KB sectors with 64
+    bytes of spare; the primitive polynomial is the lib/bch.c default for
+    m = 14. If the controller turns out to use another one, every written
+    sector shows up as uncorrectable - change ECC_PRIM_POLY in mtk_ecc.h.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+
+#define GF_N        ((1 << ECC_M) - 1)
+#define ECC_BITS    (ECC_M * ECC_T)
+#define ECC_WORDS   (ECC_BITS / 32)
+#define CW_BITS     (ECC_DATA_BYTES * 8 + ECC_BITS)
+
+#if ECC_BITS % 32
+#error "the LFSR below wants ECC_M * ECC_T to be a multiple of 32"
+#endif
+
+static uint16_t gf_exp[2 * GF_N];       // doubled, so gf_exp[a + b] needs no % GF_N
+static uint16_t gf_log[GF_N + 1];
+static uint32_t gen_low[ECC_WORDS];     // generator polynomial without x^ECC_BITS, x^(ECC_BITS - 1) in bit 31 of word 0
+static uint32_t rem_tab[4][256][ECC_WORDS]; // rem_tab[k][v] = v(x) * x^(ECC_BITS + 8k) mod g(x)
+static int ecc_ready;
+
+static inline unsigned int gf_mul(unsigned int a, unsigned int b) {
+	return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static inline unsigned int gf_div(unsigned int a, unsigned int b) {
+	return a ? gf_exp[gf_log[a] + GF_N - gf_log[b]] : 0;
+}
+
+// one message bit into the encoder LFSR
+static void lfsr_bit(uint32_t r[ECC_WORDS], int bit) {
+	int fb = bit ^ (r[0] >> 31);
+	int i;
+
+	for (i = 0; i < ECC_WORDS - 1; i++)
+		r[i] = (r[i] << 1) | (r[i + 1] >> 31);
+	r[ECC_WORDS - 1] <<= 1;
+	if (fb)
+		for (i = 0; i < ECC_WORDS; i++)
+			r[i] ^= gen_low[i];
+}
+
+int ecc_init(void) {
+	static uint16_t gen[ECC_BITS + 1];
+	static unsigned char done[GF_N];
+	unsigned int x, root;
+	int i, j, k, v, deg = 0;
+
+	if (ecc_ready)
+		return 0;
+
+	for (i = 0, x = 1; i < GF_N; i++) {
+		gf_exp[i] = gf_exp[i + GF_N] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & (1 << ECC_M))
+			x ^= ECC_PRIM_POLY;
+	}
+	if (x != 1) {
+		printf("ECC: 0x%x is not primitive\n", ECC_PRIM_POLY);
+		return -1;
+	}
+
+	// g(x) = product of the minimal polynomials of a^1, a^3 .. a^(2t - 1)
+	memset(done, 0, sizeof(done));
+	gen[0] = 1;
+	for (i = 1; i < 2 * ECC_T; i += 2) {
+		for (root = i; !done[root]; root = (root * 2) % GF_N) {
+			done[root] = 1;
+			if (deg == ECC_BITS) {
+				printf("ECC: generator polynomial longer than %d bits\n", ECC_BITS);
+				return -1;
+			}
+			// gen *= (x + a^root)
+			gen[++deg] = 0;
+			for (j = deg; j > 0; j--)
+				gen[j] = gen[j - 1] ^ gf_mul(gen[j], gf_exp[root]);
+			gen[0] = gf_mul(gen[0], gf_exp[root]);
+		}
+	}
+	if (deg != ECC_BITS) {
+		printf("ECC: generator polynomial has %d bits, expected %d\n", deg, ECC_BITS);
+		return -1;
+	}
+	memset(gen_low, 0, sizeof(gen_low));
+	for (j = 0; j < ECC_BITS; j++) {
+		if (gen[j] > 1) {
+			printf("ECC: generator polynomial is not binary\n");
+			return -1;
+		}
+		if (gen[j])
+			gen_low[(ECC_BITS - 1 - j) / 32] |= 1u << (31 - (ECC_BITS - 1 - j) % 32);
+	}
+
+	for (k = 0; k < 4; k++) {
+		for (v = 0; v < 256; v++) {
+			memset(rem_tab[k][v], 0, sizeof(rem_tab[k][v]));
+			for (j = 7; j >= 0; j--)
+				lfsr_bit(rem_tab[k][v], (v >> j) & 1);
+			for (j = 0; j < 8 * k; j++)
+				lfsr_bit(rem_tab[k][v], 0);
+		}
+	}
+	ecc_ready = 1;
+	return 0;
+}
+
+// remainder of the protected bytes * x^ECC_BITS by g(x)
+static void ecc_remainder(const unsigned char *data, uint32_t r[ECC_WORDS]) {
+	const uint32_t *t0, *t1, *t2, *t3;
+	uint32_t w;
+	int len = ECC_DATA_BYTES;
+	int i;
+
+	memset(r, 0, ECC_WORDS * sizeof(*r));
+	for (; len >= 4; len -= 4, data += 4) {
+		w = r[0] ^ ((uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]);
+		t0 = rem_tab[3][w >> 24];
+		t1 = rem_tab[2][(w >> 16) & 0xff];
+		t2 = rem_tab[1][(w >> 8) & 0xff];
+		t3 = rem_tab[0][w & 0xff];
+		for (i = 0; i < ECC_WORDS - 1; i++)
+			r[i] = r[i + 1] ^ t0[i] ^ t1[i] ^ t2[i] ^ t3[i];
+		r[ECC_WORDS - 1] = t0[i] ^ t1[i] ^ t2[i] ^ t3[i];
+	}
+	for (; len > 0; len--, data++) {
+		t0 = rem_tab[0][(r[0] >> 24) ^ *data];
+		for (i = 0; i < ECC_WORDS - 1; i++)
+			r[i] = ((r[i] << 8) | (r[i + 1] >> 24)) ^ t0[i];
+		r[ECC_WORDS - 1] = (r[ECC_WORDS - 1] << 8) ^ t0[i];
+	}
+}
+
+void ecc_encode(const unsigned char *sector, unsigned char parity[ECC_PARITY_BYTES]) {
+	uint32_t r[ECC_WORDS];
+	int i;
+
+	ecc_remainder(sector, r);
+	for (i = 0; i < ECC_WORDS; i++) {
+		parity[4 * i] = r[i] >> 24;
+		parity[4 * i + 1] = r[i] >> 16;
+		parity[4 * i + 2] = r[i] >> 8;
+		parity[4 * i + 3] = r[i];
+	}
+}
+
+static int count_zero_bits(const unsigned char *buf, int len) {
+	int i, zeros = 0;
+
+	for (i = 0; i < len; i++)
+		zeros += 8 - __builtin_popcount(buf[i]);
+	return zeros;
+}
+
+int ecc_check_sector(unsigned char *sector, int correct, int *bitflips) {
+	uint32_t r[ECC_WORDS];
+	const unsigned char *parity = sector + ECC_PARITY_OFFSET;
+	unsigned int syn[2 * ECC_T];
+	unsigned int C[2 * ECC_T + 1], B[2 * ECC_T + 1], T[2 * ECC_T + 1];
+	unsigned int d, b, coef, sum;
+	int pos[ECC_T];
+	int term[ECC_T + 1];
+	uint32_t diff = 0;
+	int i, j, n, k, L, m, deg, found, idx, byte;
+
+	*bitflips = 0;
+	ecc_remainder(sector, r);
+	for (i = 0; i < ECC_WORDS; i++) {
+		r[i] ^= (uint32_t)parity[4 * i] << 24 | parity[4 * i + 1] << 16 | parity[4 * i + 2] << 8 | parity[4 * i + 3];
+		diff |= r[i];
+	}
+	if (!diff)
+		return ECC_CLEAN;
+
+	// an erased sector has no valid parity, the controller goes by the number of 0 bits
+	n = count_zero_bits(sector, SECTOR_SIZE);
+	if (n <= ECC_T) {
+		*bitflips = n;
+		if (correct)
+			memset(sector, 0xFF, SECTOR_SIZE);
+		return ECC_ERASED;
+	}
+
+	// syndromes S(j) = r(a^j); the remainder has the same ones as the codeword
+	memset(syn, 0, sizeof(syn));
+	for (i = 0; i < ECC_BITS; i++) {
+		if (!(r[i / 32] & (1u << (31 - i % 32))))
+			continue;
+		deg = ECC_BITS - 1 - i;
+		for (j = 1; j < 2 * ECC_T; j += 2)
+			syn[j - 1] ^= gf_exp[(j * deg) % GF_N];
+	}
+	for (j = 2; j <= 2 * ECC_T; j += 2)
+		syn[j - 1] = gf_mul(syn[j / 2 - 1], syn[j / 2 - 1]);
+
+	// Berlekamp-Massey: error locator C(x) of degree L
+	memset(C, 0, sizeof(C));
+	memset(B, 0, sizeof(B));
+	C[0] = B[0] = 1;
+	L = 0;
+	m = 1;
+	b = 1;
+	for (n = 0; n < 2 * ECC_T; n++) {
+		d = syn[n];
+		for (i = 1; i <= L; i++)
+			d ^= gf_mul(C[i], syn[n - i]);
+		if (!d) {
+			m++;
+			continue;
+		}
+		coef = gf_div(d, b);
+		memcpy(T, C, sizeof(C));
+		for (i = 0; i + m <= 2 * ECC_T; i++)
+			C[i + m] ^= gf_mul(coef, B[i]);
+		if (2 * L <= n) {
+			L = n + 1 - L;
+			memcpy(B, T, sizeof(B));
+			b = d;
+			m = 1;
+		} else {
+			m++;
+		}
+	}
+	if (L > ECC_T)
+		return ECC_UNCORRECTABLE;
+
+	// Chien search: an error in x^k makes C(a^-k) zero, only k < CW_BITS exist
+	for (i = 0; i <= L; i++)
+		term[i] = C[i] ? gf_log[C[i]] : -1;
+	found = 0;
+	for (k = 0; k < CW_BITS && found < L; k++) {
+		sum = 0;
+		for (i = 0; i <= L; i++) {
+			if (term[i] < 0)
+				continue;
+			sum ^= gf_exp[term[i]];
+			// next k: times a^-i
+			term[i] += GF_N - i;
+			if (term[i] >= GF_N)
+				term[i] -= GF_N;
+		}
+		if (!sum)
+			pos[found++] = k;
+	}
+	if (found != L)
+		return ECC_UNCORRECTABLE;
+
+	if (correct) {
+		for (i = 0; i < found; i++) {
+			idx = CW_BITS - 1 - pos[i];
+			byte = idx / 8;
+			if (byte >= ECC_DATA_BYTES)
+				byte += ECC_PARITY_OFFSET - ECC_DATA_BYTES;
+			sector[byte] ^= 0x80 >> (idx % 8);
+		}
+	}
+	*bitflips = found;
+	return ECC_CORRECTED;
+}
+
+struct ecc_stats {
+	unsigned long clean, corrected, bitflips, erased, bad;
+	int max_bitflips;
+} __attribute__((aligned(64)));
+
+struct ecc_job {
+	const struct dump_image *img;
+	struct dump_image *out;
+	unsigned char *index;
+	struct ecc_stats stats[MAX_WORKERS];
+};
+
+static void check_block(void *ctx, unsigned long block, int worker) {
+	struct ecc_job *job = (struct ecc_job *)ctx;
+	struct ecc_stats *st = &job->stats[worker];
+	unsigned int page = block * PAGES_PER_BLOCK;
+	unsigned int last = page + PAGES_PER_BLOCK;
+	unsigned char *sector;
+	int s, res, flips;
+
+	if (last > job->img->pages)
+		last = job->img->pages;
+	for (; page < last; page++) {
+		if (job->out) {
+			memcpy(dump_page(job->out, page), dump_page(job->img, page), PAGE_SIZE);
+			sector = dump_page(job->out, page);
+		} else {
+			// not corrected, so not written to
+			sector = (unsigned char *)dump_page(job->img, page);
+		}
+		for (s = 0; s < SECTORS_PER_PAGE; s++, sector += SECTOR_SIZE) {
+			res = ecc_check_sector(sector, job->out != NULL, &flips);
+			switch (res) {
+			case ECC_CLEAN:
+				st->clean++;
+				break;
+			case ECC_CORRECTED:
+				st->corrected++;
+				st->bitflips += flips;
+				if (flips > st->max_bitflips)
+					st->max_bitflips = flips;
+				break;
+			case ECC_ERASED:
+				st->erased++;
+				break;
+			default:
+				st->bad++;
+				break;
+			}
+			job->index[(size_t)page * SECTORS_PER_PAGE + s] =
+			    res == ECC_ERASED ? ECC_INDEX_ERASED : res == ECC_UNCORRECTABLE ? ECC_INDEX_BAD : flips;
+		}
+	}
+}
+
+// the worst sector goes into <dump>.idx, an erased sector is the best kind
+static void index_ecc(const char *dumpfile, const struct dump_image *img, const unsigned char *index) {
+	static const int rank[] = { [ECC_ERASED] = 0, [ECC_CLEAN] = 1, [ECC_CORRECTED] = 2, [ECC_UNCORRECTABLE] = 3 };
+	struct page_index idx;
+	struct page_record *rec;
+	unsigned int page, flips;
+	int s, res;
+
+	if (index_open(&idx, dumpfile, img->pages) < 0)
+		return;
+	for (page = 0; page < img->pages; page++) {
+		rec = &idx.page[page];
+		rec->ecc_status = ECC_ERASED;
+		for (s = 0, flips = 0; s < SECTORS_PER_PAGE; s++) {
+			switch (index[(size_t)page * SECTORS_PER_PAGE + s]) {
+			case ECC_INDEX_ERASED:
+				res = ECC_ERASED;
+				break;
+			case ECC_INDEX_BAD:
+				res = ECC_UNCORRECTABLE;
+				break;
+			case 0:
+				res = ECC_CLEAN;
+				break;
+			default:
+				res = ECC_CORRECTED;
+				flips += index[(size_t)page * SECTORS_PER_PAGE + s];
+				break;
+			}
+			if (rank[res] > rank[rec->ecc_status])
+				rec->ecc_status = res;
+		}
+		rec->bitflips = flips > 255 ? 255 : flips;
+		rec->flags |= IDX_ECC_CHECKED;
+	}
+	index_close(&idx);
+}
+
+int ecc_check_dump(char *infile, char *indexfile, char *outfile) {
+	struct dump_image img, out;
+	struct ecc_job *job;
+	struct ecc_stats total;
+	unsigned long sectors, shown = 0, i;
+	unsigned int blocks;
+	double start, seconds;
+	FILE *fp;
+	int w, ret = 0;
+
+	if (ecc_init() < 0)
+		return -1;
+	if (dump_open(&img, infile) < 0)
+		return -1;
+	sectors = (unsigned long)img.pages * SECTORS_PER_PAGE;
+	if ((job = (struct ecc_job *)calloc(1, sizeof(*job))) == NULL || (job->index = malloc(sectors)) == NULL) {
+		perror("malloc ecc index");
+		free(job);
+		dump_close(&img);
+		return -1;
+	}
+	job->img = &img;
+	if (outfile != NULL) {
+		if (dump_create(&out, outfile, (size_t)img.pages * PAGE_SIZE) < 0) {
+			ret = -1;
+			goto out;
+		}
+		job->out = &out;
+	}
+
+	blocks = (img.pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+	printf("Checking %lu sectors (BCH-%d over GF(2^%d), %d + %d bytes) on %d threads\n",
+	    sectors, ECC_T, ECC_M, ECC_DATA_BYTES, ECC_PARITY_BYTES, worker_count());
+	start = wall_clock();
+	run_parallel(blocks, 0, check_block, job);
+	seconds = wall_clock() - start;
+
+	memset(&total, 0, sizeof(total));
+	for (w = 0; w < MAX_WORKERS; w++) {
+		total.clean += job->stats[w].clean;
+		total.corrected += job->stats[w].corrected;
+		total.bitflips += job->stats[w].bitflips;
+		total.erased += job->stats[w].erased;
+		total.bad += job->stats[w].bad;
+		if (job->stats[w].max_bitflips > total.max_bitflips)
+			total.max_bitflips = job->stats[w].max_bitflips;
+	}
+
+	for (i = 0; i < sectors && shown < 16; i++) {
+		if (job->index[i] == ECC_INDEX_BAD) {
+			printf("uncorrectable: page %lu sector %lu\n", i / SECTORS_PER_PAGE, i % SECTORS_PER_PAGE);
+			shown++;
+		}
+	}
+	if (total.bad > shown)
+		printf("... and %lu more uncorrectable sectors\n", total.bad - shown);
+
+	printf("Checked in %.2f s (%.0f MB/s): %lu clean, %lu corrected (%lu bits, max %d in one sector), "
+	    "%lu erased, %lu uncorrectable\n", seconds,
+	    seconds > 0 ? img.pages * (double)PAGE_SIZE / (1 << 20) / seconds : 0.0,
+	    total.clean, total.corrected, total.bitflips, total.max_bitflips, total.erased, total.bad);
+
+	if ((fp = fopen(indexfile, "wb")) == NULL) {
+		perror("fopen index");
+		ret = -1;
+		goto out;
+	}
+	if (fwrite(job->index, 1, sectors, fp) != sectors) {
+		perror("fwrite index");
+		ret = -1;
+	}
+	fclose(fp);
+	if (outfile != NULL)
+		printf("Corrected dump written to %s\n", outfile);
+	index_ecc(infile, &img, job->index);
+
+out:
+	if (job->out)
+		dump_close(job->out);
+	free(job->index);
+	free(job);
+	dump_close(&img);
+	return ret;
+}
@@ -0,0 +1,45 @@
+/*
+    BCH sector ECC of the MT8516 NAND controller (NFI) for rpi-raw-nand
+
+    The NFI splits a page into 1024 byte sectors, each followed by 64 bytes
+    of spare:
+
+        0    .. 1023   data
+        1024 .. 1031   FDM, free bytes for the file system / bad block mark;
+                       the first ECC_FDM_ECC of them are protected too
+        1032 .. 1087   BCH parity, ECC_T bits over GF(2^ECC_M), 56 bytes
+
+    The ECC is computed before the randomizer XOR, so sectors must be
+    descrambled before they are checked.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef MTK_ECC_H
+#define MTK_ECC_H
+
+#define ECC_M           14      // 1 KB sectors need GF(2^14)
+#define ECC_T           32      // correctable bits per sector
+#define ECC_PRIM_POLY   0x402b  // x^14 + x^5 + x^3 + x + 1
+#define ECC_FDM_SIZE    8
+#define ECC_FDM_ECC     1
+#define ECC_DATA_BYTES  (1024 + ECC_FDM_ECC)
+#define ECC_PARITY_BYTES (ECC_M * ECC_T / 8)
+#define ECC_PARITY_OFFSET (1024 + ECC_FDM_SIZE)
+
+// ecc_check_sector() results
+enum {
+	ECC_CLEAN,
+	ECC_CORRECTED,
+	ECC_ERASED,             // all 0xFF but for at most ECC_T bits, not covered by ECC
+	ECC_UNCORRECTABLE
+};
+
+int ecc_init(void);     // once, before any thread uses the functions below
+void ecc_encode(const unsigned char *sector, unsigned char parity[ECC_PARITY_BYTES]);
+int ecc_check_sector(unsigned char *sector, int correct, int *bitflips);
+
+#endif
@@ -0,0 +1,43 @@
+/*
+    Bus backends for rpi-raw-nand
+
+    Everything the flash command layer needs to drive the NAND pins. The GPIO
+    backend (Raspberry Pi, /dev/mem) lives in rpi-raw-nand-v3.c, the FT2232H
+    backend in ft2232h_bus.c.
+
+    A backend may queue command, address, write_data and wait_ready and only
+    put them on the wire when read_data or ready needs an answer, so a whole
+    page read (00h, address, 30h, wait for R/B#, data out) can go out as one
+    transfer.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef NAND_BUS_H
+#define NAND_BUS_H
+
+struct nand_bus {
+	const char *name;
+	int max_chips;                  // number of CE#/R/B# pairs the backend can drive
+
+	int  (*open)(void);             // claim the hardware, -1 on error
+	void (*close)(void);            // safe to call when not open
+	void (*init)(int chips);        // control lines to idle level for N chips
+	void (*select_chip)(int chip);  // -1 deselects all chips
+	void (*command)(unsigned char cmd);
+	void (*address)(const unsigned char *cycles, int count);
+	void (*write_data)(const unsigned char *buf, unsigned int len);
+	void (*read_data)(unsigned char *buf, unsigned int len);
+	int  (*ready)(int chip);        // sample R/B#, 1 = ready
+	int  (*wait_ready)(int chip);   // until R/B# is high, -1 on timeout
+};
+
+extern struct nand_bus gpio_bus;
+extern struct nand_bus ft2232h_bus;
+
+extern struct nand_bus *bus;        // backend in use, gpio_bus by default
+
+#endif
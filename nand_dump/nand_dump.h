@@ -0,0 +1,327 @@
+/*
+    Dump file layout and offline commands for rpi-raw-nand
+
+    A raw dump is a plain sequence of PAGE_SIZE pages as read_full writes
+    them. Each page is four 1088 byte sectors, 1024 bytes of data followed by
+    64 bytes of spare; on the Echo Dot the first three carry the scrambled
+    data and the fourth is left (nearly) erased, so it holds the XOR key.
+
+    The offline commands work on such a file, memory mapped, and spread the
+    pages over all cores. They need no chip and no root.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef NAND_DUMP_H
+#define NAND_DUMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define PAGE_SIZE        4352 // 4096 + 256 bytes, 256 bytes ECC/page
+#define BLOCK_SIZE       278528 // 64 pages of4352 bytes
+#define PAGES_PER_BLOCK  64
+#define SECTOR_SIZE      1088 // 1024 data + 64 spare
+#define SECTOR_DATA      1024
+#define SECTORS_PER_PAGE 4
+#define PAGE_DATA        (3 * SECTOR_DATA) // data bytes of a page, sector 3 holds none
+#define UBI_PEB_SIZE     (PAGES_PER_BLOCK * 4096) // a block in the ubiData() layout
+
+#define XOR_DIR          "./exported/xor_chunks" // same place dumpreader.js uses
+
+// a dump file mapped into memory
+struct dump_image {
+	unsigned char *data;
+	size_t size;
+	unsigned int pages;     // whole pages in the file
+	int fd;                 // -1 for an archive, data is inflated from it
+};
+
+#define dump_page(img, n)  ((img)->data + (size_t)(n) * PAGE_SIZE)
+
+int dump_open(struct dump_image *img, const char *file);                // read only, a dump or an archive
+int dump_create(struct dump_image *img, const char *file, size_t size); // read/write, truncated to size
+void dump_close(struct dump_image *img);
+
+// calls fn(ctx, item, worker) for every item in 0 .. items - 1, the items are
+// handed out one at a time to <workers> threads (0: worker_count()); worker is 0 .. workers - 1
+#define MAX_WORKERS 64
+int worker_count(void);
+void run_parallel(unsigned long items, int workers, void (*fn)(void *ctx, unsigned long item, int worker), void *ctx);
+
+int write_all(int fd, const void *buf, size_t len, off_t offset); // pwrite() until done, -1 after perror()
+int all_ff(const unsigned char *p, size_t len); // erased: every byte 0xFF
+int erased_sector(const unsigned char *sector); // as the NFI sees it: at most ECC_T bits 0
+
+int make_dirs(const char *path); // mkdir -p
+
+double wall_clock(void); // seconds, for throughput figures (clock() adds up all threads)
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len); // zlib/GPT CRC-32, start with 0
+
+// pwritev() of many small pieces, IOV_BATCH at a time
+#define IOV_BATCH 1024 // IOV_MAX on Linux
+struct iov_writer {
+	int fd;
+	off_t offset;
+	int count;
+	struct iovec iov[IOV_BATCH];
+};
+int iov_add(struct iov_writer *w, const void *buf, size_t len); // buf must stay valid until flushed
+int iov_flush(struct iov_writer *w);
+
+// descramble.c
+enum { XOR_KEY_NONE, XOR_KEY_PAGE, XOR_KEY_FILE, XOR_KEY_MODEL }; // where load_xor_key() found the key
+// img can be NULL, then only <xordir> is looked at; model from rand_load() once per command, NULL if none
+struct rand_model;
+int load_xor_key(const struct dump_image *img, int mod, const char *xordir, const struct rand_model *model,
+    unsigned char key[SECTOR_SIZE]);
+int descramble_dump(char *infile, char *outfile, char *xordir);
+
+// xorkeys.c
+int derive_xor_keys(char *infile, char *xordir, int first_page_number, int number_of_pages);
+
+// randomizer.c, the NFI randomizer as an LFSR, seeds in <xordir>/seeds.txt
+struct rand_model {
+	int width;              // LFSR bits, up to 16
+	uint16_t taps;          // feedback from these state bits
+	int lsb_first;          // stream bit 0 is bit 0 of the byte, else bit 7
+	int seeds;
+	uint16_t seed[PAGES_PER_BLOCK];
+	unsigned char have_seed[PAGES_PER_BLOCK];
+	uint64_t out_lo[256], out_hi[256];      // 64 steps, by low and high byte of the state
+	uint16_t next_lo[256], next_hi[256];
+};
+void rand_init(struct rand_model *m, int width, uint16_t taps, int lsb_first);
+void rand_stream(const struct rand_model *m, uint16_t seed, unsigned char *out, size_t len);
+int rand_load(struct rand_model *m, const char *xordir); // <xordir>/seeds.txt, -1 if there is none
+int rand_fit(char *xordir);
+
+// mtk_ecc.c, the index has one byte per sector: bits corrected or one of these
+#define ECC_INDEX_ERASED 0xFE
+#define ECC_INDEX_BAD    0xFF
+int ecc_check_dump(char *infile, char *indexfile, char *outfile);
+
+// gpt.c
+#define MAX_PARTITIONS 64
+struct partition {
+	char name[40];
+	unsigned int first_page;
+	unsigned int pages;
+};
+int read_partitions(const struct dump_image *img, struct partition *parts, int max); // GPT, else the built-in table
+int read_gpt(const struct dump_image *img, struct partition *parts, int max, unsigned int pages); // 0: no GPT; entries must end before <pages>
+int is_ubi(const struct partition *part); // persist, userdata
+int export_partitions(char *infile, char *outdir, char *mode);
+
+// sparse.c
+int export_sparse(const struct dump_image *img, int fd, const struct partition *part); // the data export, sparse
+
+// split.c
+int split_dump(char *infile, char *datafile, char *oobfile);
+
+// merge.c
+int merge_pages(char *dir, char *outfile, int number_of_pages);
+int merge_dumps(char *outfile, char **infiles, int dumps); // per bit majority vote
+
+// page_index.c, <dump>.idx
+#define INDEX_HEADER_SIZE 4096
+#define IDX_NONE          0xFF
+#define IDX_INDEXED       0x01 // erased flag, data_crc, xor_key and partition are set
+#define IDX_ERASED        0x02
+#define IDX_ECC_CHECKED   0x04 // ecc_status and bitflips are set
+#define IDX_DISPUTED      0x08 // merge_dumps: not all dumps agreed on this page
+struct index_header {
+	char magic[8];
+	uint64_t dump_size;     // the dump the records describe
+	int64_t dump_mtime;
+	int64_t dump_mtime_ns;
+	uint32_t pages;
+	uint32_t indexed;       // the index command ran
+	uint32_t partitions;
+	struct partition part[MAX_PARTITIONS];
+};
+struct page_record {
+	uint32_t data_crc;      // CRC-32 of sectors 0 .. 2
+	uint8_t flags;          // IDX_*
+	uint8_t ecc_status;     // worst ECC_* (mtk_ecc.h) of the sectors, erased the least
+	uint8_t bitflips;       // corrected in the page, 255 for 255 or more
+	uint8_t xor_key;        // page % 64 key that descrambles it, IDX_NONE: erased, no key or descrambled
+	uint8_t partition;      // in the header's table, IDX_NONE: outside all
+	uint8_t confidence;     // 0: unknown, else the higher the better, 255: read clean at once
+	uint8_t reserved[2];
+};
+struct page_index {
+	struct index_header *hdr;
+	struct page_record *page;
+	size_t size;
+	int fd;
+	char file[512];
+	char dumpfile[512];
+};
+// cleared if missing, stale or not <pages> long (0: as many as the dump has now)
+int index_open(struct page_index *idx, const char *dumpfile, unsigned int pages);
+void index_close(struct page_index *idx); // stamps the dump's size and mtime
+int query_index(char *dumpfile, char *partition, char *what);
+
+// ubi.c
+int ubi_scan(char *infile, char *outdir, char *partname);
+
+// build_image.c, basefile and xordir can be NULL
+int build_image(char *imagefile, char *partname, char *outfile, char *basefile, char *xordir);
+
+// scan.c
+int scan_dump(char *infile, char *jsonfile);
+
+// archive.c, a dump in deflated blocks; dump_open() reads these too
+#define ARCHIVE_SUFFIX      ".nda"
+#define ARCHIVE_HEADER_SIZE 4096
+#define ARCHIVE_STORED      0x01 // frame flag: the pages as they are, deflate did not help
+struct archive_header {
+	char magic[8];
+	uint32_t page_size, pages_per_block, sector_size, sectors_per_page;
+	uint32_t pages;
+	uint32_t first_page;      // chip page of archive page 0
+	unsigned char id[8];      // read_id() bytes, zero when packed from a file
+	uint64_t table;           // offset of the block table, 0 until finished
+	uint32_t blocks;
+};
+// in front of every block's data, and the block table is an array of them
+struct archive_frame {
+	uint32_t block;
+	uint32_t size;            // bytes after this header, 0: every page erased
+	uint32_t flags;
+	uint32_t pages;           // in the block, PAGES_PER_BLOCK but for the last
+	uint64_t erased;          // bit n: page n is all 0xFF, not stored
+	uint64_t offset;          // of this header in the file
+};
+struct dump_archive {
+	int fd;
+	struct archive_header hdr;
+	struct archive_frame *table;
+};
+struct archive_writer {
+	int fd;
+	uint64_t offset;          // where the next frame goes
+	struct archive_header hdr;
+	struct archive_frame *table;
+	unsigned int alloc;
+	unsigned char *block;     // pages of the block being filled
+	unsigned int fill;
+	unsigned char *zbuf;
+};
+int is_archive(const char *file);    // by its magic
+int archive_open(struct dump_archive *ar, const char *file);
+int archive_read_pages(const struct dump_archive *ar, unsigned int page, unsigned int count, unsigned char *buf);
+void archive_close(struct dump_archive *ar);
+int archive_load(struct dump_image *img, const char *file); // dump_open() of an archive
+int archive_create(struct archive_writer *w, const char *file, const unsigned char id[8], unsigned int first_page);
+int archive_write_page(struct archive_writer *w, const unsigned char *page); // in page order
+int archive_finish(struct archive_writer *w); // last block, table, header
+int pack_dump(char *infile, char *outfile);
+int unpack_dump(char *infile, char *outfile);
+
+// manifest.c, <dump>.mf: a hash per page and per block
+struct manifest_header {
+	char magic[8];
+	uint64_t dump_size;       // the dump the hashes describe
+	int64_t dump_mtime;
+	int64_t dump_mtime_ns;
+	uint32_t pages, blocks;
+	uint32_t page_bytes;      // hashed per page, PAGE_SIZE but for read_data
+	uint32_t reserved;
+};
+struct manifest {
+	struct manifest_header hdr;
+	uint64_t *page, *block;
+};
+uint64_t hash64(const void *buf, size_t len, uint64_t seed); // XXH64
+int manifest_alloc(struct manifest *m, unsigned int pages, unsigned int page_bytes);
+void manifest_free(struct manifest *m);
+void manifest_blocks(struct manifest *m); // block hashes from the page hashes
+int manifest_write(struct manifest *m, const char *dumpfile);
+int manifest_read(struct manifest *m, const char *file);
+int make_manifest(char *dumpfile);
+int diff_manifest(char *file_a, char *file_b);    // 1 if they differ
+int verify_manifest(char *file_a, char *file_b);  // 1 if they differ
+
+// bbt.c, bad blocks from the on-flash table and the factory markers, BBT_FILE
+#define CHIP_BLOCKS     2048 // MX30LF4G28AD, 4 Gbit
+#define BBT_SCAN_BLOCKS 4    // the table is in one of the last blocks
+#define BBT_FILE        "./exported/bad_blocks.bbt"
+enum { BLOCK_GOOD, BLOCK_WORN, BLOCK_RESERVED, BLOCK_FACTORY_BAD }; // as nand_bbt.c, reserved: the table's own
+struct bad_blocks {
+	char magic[8];
+	uint32_t blocks;          // CHIP_BLOCKS
+	uint32_t bad;             // set in bitmap
+	int32_t version;          // of the on-flash table used, -1: none found
+	int32_t table_block, mirror_block; // -1: not found
+	uint32_t reserved;
+	unsigned char state[CHIP_BLOCKS];     // BLOCK_*
+	uint64_t bitmap[CHIP_BLOCKS / 64];    // bit set: bad, leave the block alone
+};
+#define block_is_bad(bb, block) ((unsigned int)(block) < CHIP_BLOCKS && ((bb)->bitmap[(block) / 64] >> ((block) % 64) & 1))
+// where the pages come from, a dump or the chip
+struct bbt_reader {
+	int (*read)(void *ctx, unsigned int page, unsigned int sectors, unsigned char *buf); // bit n: sector n to buf + n * SECTOR_SIZE
+	void *ctx;
+	unsigned int blocks;      // that can be read
+};
+int bbt_build(struct bad_blocks *bb, const struct bbt_reader *rd, const struct dump_image *img, const char *xordir); // img can be NULL
+void bbt_print(const struct bad_blocks *bb);
+int bbt_save(const struct bad_blocks *bb);
+int bbt_load(struct bad_blocks *bb); // -1 and all good without BBT_FILE
+int bbt_dump(char *infile, char *xordir);
+
+// live.c, chip to partition images in one pass
+struct live_source {
+	int (*read)(void *ctx, unsigned int page, unsigned char *buf); // PAGE_SIZE bytes
+	void *ctx;
+};
+int live_dump(const struct partition *parts, int n, unsigned int blocks, const struct live_source *src,
+    const struct bad_blocks *bb, const char *outdir, const char *dumpfile); // dumpfile can be NULL
+
+// stream.c, read_full - : the dump as framed blocks on stdout, receive writes it to a file
+#define STREAM_STDOUT "-"
+struct stream_header {
+	char magic[8];
+	uint32_t page_bytes;      // PAGE_SIZE, less for read_data
+	uint32_t pages_per_block;
+	uint32_t first_page;      // chip page of stream page 0
+	uint32_t pages;           // asked for, the end frame says how many came
+	unsigned char id[8];      // read_id() bytes
+};
+struct stream_frame {
+	char magic[4];
+	uint32_t block;           // from 0; the end frame: blocks sent
+	uint32_t pages;           // in the block; the end frame: pages sent
+	uint32_t size;            // header, pages and padding
+	uint64_t hash;            // hash64() of the pages, seed block; the end frame: of the block hashes
+};
+struct stream_writer {
+	int fd;
+	int pipe;                 // fd is a pipe, FIONREAD tells what the reader has not taken
+	int splice;               // frames go in with vmsplice(), else write()
+	size_t align, frame_size, pipe_size;
+	unsigned char *pool;      // buffers frames, page aligned
+	uint64_t *end;            // per buffer: sent once its frame was in the pipe
+	unsigned int buffers, next;
+	unsigned int page_bytes, fill, block;
+	unsigned long pages;
+	uint64_t sent, chain;
+	double start, waited;
+};
+int stream_redirect(void); // a new fd for the stream, stdout goes to stderr from then on
+int stream_open(struct stream_writer *s, int fd, const unsigned char id[8], unsigned int first_page,
+    unsigned int pages, unsigned int page_bytes);
+int stream_write_page(struct stream_writer *s, const unsigned char *page); // in page order
+int stream_finish(struct stream_writer *s); // last block, end frame, closes fd
+void stream_free(struct stream_writer *s);
+int stream_receive(char *outfile);
+
+#endif
@@ -0,0 +1,26 @@
+/*
+    NAND wiring of rpi-raw-nand, shared with la_decode so logic analyzer
+    probes named after GPIOs decode the same way the dumper drives them
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef NAND_PINS_H
+#define NAND_PINS_H
+
+// GPIO pins have been chosen to be compitable w/ Waveshare NandFlash Board and lost RPi SMI NAND driver
+#define WRITE_PROTECT           2
+#define READY_BUSY              3
+#define ADDRESS_LATCH_ENABLE    4
+#define COMMAND_LATCH_ENABLE    17
+#define READ_ENABLE             18
+#define WRITE_ENABLE            27
+#define CHIP_ENABLE             22 // CE# of chip 0
+
+// mapping of the I/O pins, 23 = I/O 0 .. 11 = I/O 7
+#define DATA_TO_GPIO_MAP        { 23, 24, 25, 8, 7, 10, 9, 11 }
+
+#endif
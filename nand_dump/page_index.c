@@ -0,0 +1,321 @@
+/*
+    Per page index of a dump and the index command for rpi-raw-nand
+
+    <dump>.idx holds what the offline commands and the dumper found out
+    about every page of <dump>, so the next question about it is a lookup
+    instead of another pass over 570 MB:
+
+        header          INDEX_HEADER_SIZE bytes: magic, page count, size
+                        and mtime of the dump it describes, partition table
+        page records    one struct page_record per page, see nand_dump.h
+
+    The file is memory mapped and filled in bit by bit: the index command
+    does the erased flag, CRC, XOR key and partition, ecc_check the ECC
+    fields, read_full and merge_dumps the confidence. Each of them stamps
+    the dump's size and mtime into the header when done. An index whose
+    stamp does not match its dump any more is cleared on the next open.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+
+#define INDEX_MAGIC "NDIDX01"
+
+_Static_assert(sizeof(struct index_header) <= INDEX_HEADER_SIZE, "index header too big");
+
+static void index_stamp(struct index_header *hdr, const struct stat *st) {
+	hdr->dump_size = st->st_size;
+	hdr->dump_mtime = st->st_mtim.tv_sec;
+	hdr->dump_mtime_ns = st->st_mtim.tv_nsec;
+}
+
+int index_open(struct page_index *idx, const char *dumpfile, unsigned int pages) {
+	struct index_header *hdr;
+	struct stat st, ist;
+	int fresh;
+
+	memset(idx, 0, sizeof(*idx));
+	if (stat(dumpfile, &st) < 0) {
+		perror(dumpfile);
+		return -1;
+	}
+	if (pages == 0)
+		pages = st.st_size / PAGE_SIZE;
+	snprintf(idx->dumpfile, sizeof(idx->dumpfile), "%s", dumpfile);
+	snprintf(idx->file, sizeof(idx->file), "%s.idx", dumpfile);
+	if ((idx->fd = open(idx->file, O_RDWR | O_CREAT, 0644)) < 0 || fstat(idx->fd, &ist) < 0) {
+		perror(idx->file);
+		return -1;
+	}
+	idx->size = INDEX_HEADER_SIZE + (size_t)pages * sizeof(struct page_record);
+	fresh = (size_t)ist.st_size == idx->size;
+	if (!fresh && (ftruncate(idx->fd, 0) < 0 || ftruncate(idx->fd, idx->size) < 0)) {
+		perror("ftruncate index");
+		close(idx->fd);
+		return -1;
+	}
+	idx->hdr = (struct index_header *)mmap(NULL, idx->size, PROT_READ | PROT_WRITE, MAP_SHARED, idx->fd, 0);
+	if (idx->hdr == MAP_FAILED) {
+		perror("mmap index");
+		idx->hdr = NULL;
+		close(idx->fd);
+		return -1;
+	}
+	hdr = idx->hdr;
+	idx->page = (struct page_record *)((unsigned char *)hdr + INDEX_HEADER_SIZE);
+
+	fresh = fresh && memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) == 0 && hdr->pages == pages &&
+	    hdr->dump_size == (uint64_t)st.st_size && hdr->dump_mtime == st.st_mtim.tv_sec &&
+	    hdr->dump_mtime_ns == st.st_mtim.tv_nsec;
+	if (!fresh) {
+		memset(hdr, 0, idx->size);
+		memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+		hdr->pages = pages;
+		index_stamp(hdr, &st);
+	}
+	return 0;
+}
+
+void index_close(struct page_index *idx) {
+	struct stat st;
+
+	if (idx->hdr == NULL)
+		return;
+	// whoever had it open brought the records up to date with the dump as it is now
+	if (stat(idx->dumpfile, &st) == 0)
+		index_stamp(idx->hdr, &st);
+	munmap(idx->hdr, idx->size);
+	close(idx->fd);
+	idx->hdr = NULL;
+}
+
+struct index_job {
+	const struct dump_image *img;
+	struct page_index *idx;
+	unsigned char keys[PAGES_PER_BLOCK][SECTOR_SIZE];
+	int have_key[PAGES_PER_BLOCK];
+};
+
+static int is_erased(const unsigned char *page) {
+	int s;
+
+	for (s = 0; s < SECTORS_PER_PAGE - 1; s++)
+		if (!erased_sector(page + s * SECTOR_SIZE))
+			return 0;
+	return 1;
+}
+
+static int page_partition(const struct index_header *hdr, unsigned int page) {
+	unsigned int p;
+
+	for (p = 0; p < hdr->partitions; p++)
+		if (page >= hdr->part[p].first_page && page - hdr->part[p].first_page < hdr->part[p].pages)
+			return p;
+	return IDX_NONE;
+}
+
+static void index_block(void *ctx, unsigned long block, int worker) {
+	struct index_job *job = (struct index_job *)ctx;
+	unsigned int page = block * PAGES_PER_BLOCK;
+	unsigned int last = page + PAGES_PER_BLOCK;
+	const unsigned char *data, *spare;
+	struct page_record *rec;
+	int mod, i;
+
+	(void)worker;
+	if (last > job->img->pages)
+		last = job->img->pages;
+	for (; page < last; page++) {
+		data = dump_page(job->img, page);
+		rec = &job->idx->page[page];
+		mod = page % PAGES_PER_BLOCK;
+
+		rec->flags &= ~IDX_ERASED;
+		if (is_erased(data))
+			rec->flags |= IDX_ERASED;
+		rec->data_crc = crc32_update(0, data, (SECTORS_PER_PAGE - 1) * SECTOR_SIZE);
+		rec->partition = page_partition(job->idx->hdr, page);
+
+		// a raw page carries its key in sector 3, descramble leaves that erased
+		spare = data + (SECTORS_PER_PAGE - 1) * SECTOR_SIZE;
+		for (i = 0; i < SECTOR_SIZE && spare[i] == 0xFF; i++)
+			;
+		rec->xor_key = !(rec->flags & IDX_ERASED) && i < SECTOR_SIZE && job->have_key[mod] ? mod : IDX_NONE;
+		rec->flags |= IDX_INDEXED;
+	}
+}
+
+static int build_index(const struct dump_image *img, struct page_index *idx) {
+	struct index_job *job;
+	struct rand_model model;
+	double start, seconds;
+	int mod, n, have_model;
+
+	if ((job = (struct index_job *)calloc(1, sizeof(*job))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	job->img = img;
+	job->idx = idx;
+	have_model = rand_load(&model, XOR_DIR) == 0;
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++)
+		job->have_key[mod] = load_xor_key(img, mod, XOR_DIR, have_model ? &model : NULL, job->keys[mod]) != XOR_KEY_NONE;
+	n = read_partitions(img, idx->hdr->part, MAX_PARTITIONS);
+	idx->hdr->partitions = n > 0 ? n : 0;
+
+	printf("Indexing %u pages into %s\n", img->pages, idx->file);
+	start = wall_clock();
+	run_parallel((img->pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK, 0, index_block, job);
+	seconds = wall_clock() - start;
+	printf("Indexed in %.2f s (%.0f MB/s)\n", seconds,
+	    seconds > 0 ? img->pages * (double)PAGE_SIZE / (1 << 20) / seconds : 0.0);
+	idx->hdr->indexed = 1;
+	free(job);
+	return 0;
+}
+
+static int q_erased(const struct page_record *rec) {
+	return rec->flags & IDX_ERASED;
+}
+
+static int q_unchecked(const struct page_record *rec) {
+	return !(rec->flags & IDX_ECC_CHECKED);
+}
+
+static int q_corrected(const struct page_record *rec) {
+	return (rec->flags & IDX_ECC_CHECKED) && rec->ecc_status == ECC_CORRECTED;
+}
+
+static int q_uncorrectable(const struct page_record *rec) {
+	return (rec->flags & IDX_ECC_CHECKED) && rec->ecc_status == ECC_UNCORRECTABLE;
+}
+
+static int q_doubtful(const struct page_record *rec) {
+	return rec->confidence != 0 && rec->confidence < 255;
+}
+
+// the questions the index command answers, per page
+static const struct {
+	const char *name;
+	int (*match)(const struct page_record *rec);
+} queries[] = {
+	{ "erased", q_erased },
+	{ "unchecked", q_unchecked },
+	{ "corrected", q_corrected },
+	{ "uncorrectable", q_uncorrectable },
+	{ "doubtful", q_doubtful },
+};
+
+#define QUERIES (int)(sizeof(queries) / sizeof(queries[0]))
+
+static void show_summary(const struct page_index *idx) {
+	const struct index_header *hdr = idx->hdr;
+	unsigned long count[MAX_PARTITIONS + 1][QUERIES];
+	unsigned int page, pages, p;
+	int q, part;
+
+	memset(count, 0, sizeof(count));
+	for (page = 0; page < hdr->pages; page++) {
+		part = idx->page[page].partition;
+		part = part == IDX_NONE ? (int)hdr->partitions : part;
+		for (q = 0; q < QUERIES; q++)
+			if (queries[q].match(&idx->page[page]))
+				count[part][q]++;
+	}
+	printf("%-16s %8s %8s", "partition", "pages", "first");
+	for (q = 0; q < QUERIES; q++)
+		printf(" %13s", queries[q].name);
+	printf("\n");
+	for (p = 0; p <= hdr->partitions; p++) {
+		if (p == hdr->partitions) {
+			for (page = 0, pages = 0; page < hdr->pages; page++)
+				pages += idx->page[page].partition == IDX_NONE;
+			if (pages == 0)
+				break;
+			printf("%-16s %8u %8s", "(none)", pages, "");
+		} else {
+			printf("%-16s %8u %8u", hdr->part[p].name, hdr->part[p].pages, hdr->part[p].first_page);
+		}
+		for (q = 0; q < QUERIES; q++)
+			printf(" %13lu", count[p][q]);
+		printf("\n");
+	}
+}
+
+int query_index(char *dumpfile, char *partition, char *what) {
+	struct dump_image img;
+	struct page_index idx;
+	unsigned int page, first = 0, last, run, p;
+	unsigned long found = 0;
+	int q, ret = 0;
+
+	if (dump_open(&img, dumpfile) < 0)
+		return -1;
+	if (index_open(&idx, dumpfile, img.pages) < 0) {
+		dump_close(&img);
+		return -1;
+	}
+	if (!idx.hdr->indexed && build_index(&img, &idx) < 0) {
+		ret = -1;
+		goto out;
+	}
+	if (partition == NULL) {
+		show_summary(&idx);
+		goto out;
+	}
+
+	last = idx.hdr->pages;
+	if (strcmp(partition, "all") != 0) {
+		for (p = 0; p < idx.hdr->partitions && strcmp(idx.hdr->part[p].name, partition) != 0; p++)
+			;
+		if (p == idx.hdr->partitions) {
+			printf("no partition %s\n", partition);
+			ret = -1;
+			goto out;
+		}
+		first = idx.hdr->part[p].first_page;
+		last = first + idx.hdr->part[p].pages;
+		if (last > idx.hdr->pages)
+			last = idx.hdr->pages;
+	}
+	for (q = 0; q < QUERIES && strcmp(queries[q].name, what) != 0; q++)
+		;
+	if (q == QUERIES) {
+		printf("unknown query %s, one of:", what);
+		for (q = 0; q < QUERIES; q++)
+			printf(" %s", queries[q].name);
+		printf("\n");
+		ret = -1;
+		goto out;
+	}
+
+	for (page = first; page < last; page++) {
+		if (!queries[q].match(&idx.page[page]))
+			continue;
+		for (run = page; run + 1 < last && queries[q].match(&idx.page[run + 1]); run++)
+			;
+		printf("pages %u .. %u (%u .. %u in %s)\n", page, run, page - first, run - first, partition);
+		found += run - page + 1;
+		page = run;
+	}
+	printf("%lu %s pages\n", found, what);
+
+out:
+	index_close(&idx);
+	dump_close(&img);
+	return ret;
+}
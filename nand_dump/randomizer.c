@@ -0,0 +1,278 @@
+/*
+    Model of the NFI randomizer and the rand_fit command for rpi-raw-nand
+
+    The NFI XORs every sector with the output of an LFSR, restarted from a
+    seed that depends on the page (page % 64 on this chip, see xor_map in
+    descramble.c). With the LFSR and the 64 seeds known, any page can be
+    descrambled without key files and without erased pages to learn them
+    from.
+
+    The LFSR is a Fibonacci one of up to 16 bits: the output is state bit
+    0, the new top bit the parity of state & taps. It is run 64 steps at a
+    time: after 64 steps both the output bits and the new state are linear
+    in the old state, so they are the XOR of two table entries, one for the
+    low and one for the high byte of the state. The tables already hold the
+    output in byte order, bits msb or lsb first.
+
+    Which LFSR MediaTek uses is not documented. rand_fit tries the usual
+    PRBS polynomials, both bit orders and every seed against the keys
+    xor_keys recovered (<xordir>/<mod>_xor.bin, only the bytes its
+    <mod>_conf.bin trusts), and writes what fits to <xordir>/seeds.txt:
+
+        lfsr <width> <taps> <msb|lsb>
+        <mod> <seed>                    one line per page % 64 found
+
+    load_xor_key() generates the key from there when the dump has none.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "nand_dump.h"
+
+#define FIT_PREFIX      128  // key bytes looked at per seed before the full compare
+#define FIT_TRUST       192  // conf.bin value a key byte needs to be compared
+#define FIT_MATCH       90   // % of the trusted bytes that must match
+#define FIT_PREFIX_MATCH 70  // the same in the prefix, a wrong seed hits 1 in 256
+
+// maximal length polynomials, taps in the convention above
+static const struct { int width; uint16_t taps; const char *poly; } fit_lfsrs[] = {
+	{ 15, 0x4001, "x^15 + x^14 + 1" },
+	{ 15, 0x0003, "x^15 + x + 1" },
+	{ 16, 0x6801, "x^16 + x^14 + x^13 + x^11 + 1" },
+	{ 16, 0x002D, "x^16 + x^5 + x^3 + x^2 + 1" },
+};
+
+#define FIT_LFSRS (int)(sizeof(fit_lfsrs) / sizeof(fit_lfsrs[0]))
+
+static uint16_t lfsr_step(const struct rand_model *m, uint16_t s, int *bit) {
+	*bit = s & 1;
+	return (s >> 1) | (uint16_t)(__builtin_parity(s & m->taps) << (m->width - 1));
+}
+
+void rand_init(struct rand_model *m, int width, uint16_t taps, int lsb_first) {
+	uint64_t out[16];
+	uint16_t next[16], s;
+	int b, i, bit;
+	unsigned int x;
+
+	memset(m, 0, sizeof(*m));
+	m->width = width;
+	m->taps = taps;
+	m->lsb_first = lsb_first;
+	// 64 steps from every single state bit
+	for (b = 0; b < width; b++) {
+		s = 1 << b;
+		out[b] = 0;
+		for (i = 0; i < 64; i++) {
+			s = lfsr_step(m, s, &bit);
+			if (bit)
+				out[b] |= (uint64_t)1 << (lsb_first ? i : (i & ~7) + 7 - (i & 7));
+		}
+		next[b] = s;
+	}
+	for (x = 0; x < 256; x++) {
+		for (b = 0; b < 8; b++) {
+			if (!(x & (1 << b)))
+				continue;
+			m->out_lo[x] ^= out[b];
+			m->next_lo[x] ^= next[b];
+			if (b + 8 < width) {
+				m->out_hi[x] ^= out[b + 8];
+				m->next_hi[x] ^= next[b + 8];
+			}
+		}
+	}
+}
+
+void rand_stream(const struct rand_model *m, uint16_t seed, unsigned char *out, size_t len) {
+	uint64_t word;
+	uint16_t s = seed;
+	size_t i;
+
+	for (i = 0; i < len; i += 8) {
+		word = m->out_lo[s & 0xFF] ^ m->out_hi[s >> 8];
+		s = m->next_lo[s & 0xFF] ^ m->next_hi[s >> 8];
+		// byte j of the word is stream byte j, little endian like the Pi
+		memcpy(out + i, &word, len - i < 8 ? len - i : 8);
+	}
+}
+
+int rand_load(struct rand_model *m, const char *xordir) {
+	char file[256], order[8];
+	unsigned int width, taps, mod, seed;
+	FILE *fp;
+
+	snprintf(file, sizeof(file), "%s/seeds.txt", xordir);
+	if ((fp = fopen(file, "r")) == NULL)
+		return -1;
+	if (fscanf(fp, " lfsr %u %x %7s", &width, &taps, order) != 3 || width < 2 || width > 16) {
+		printf("%s: no lfsr line, ignored\n", file);
+		fclose(fp);
+		return -1;
+	}
+	rand_init(m, width, taps, strcmp(order, "lsb") == 0);
+	while (fscanf(fp, " %u %x", &mod, &seed) == 2) {
+		if (mod < PAGES_PER_BLOCK && seed != 0 && seed < (1u << width)) {
+			m->seed[mod] = seed;
+			m->have_seed[mod] = 1;
+			m->seeds++;
+		}
+	}
+	fclose(fp);
+	return m->seeds > 0 ? 0 : -1;
+}
+
+struct fit_job {
+	const char *xordir;
+	unsigned char key[PAGES_PER_BLOCK][SECTOR_SIZE];
+	unsigned char trust[PAGES_PER_BLOCK][SECTOR_SIZE];
+	int trusted[PAGES_PER_BLOCK];           // bytes
+	struct rand_model model[FIT_LFSRS][2];
+	// best per mod
+	int lfsr[PAGES_PER_BLOCK], lsb[PAGES_PER_BLOCK];
+	uint16_t seed[PAGES_PER_BLOCK];
+	int match[PAGES_PER_BLOCK];             // trusted bytes that match
+};
+
+static int count_matches(const struct fit_job *job, int mod, const unsigned char *stream, int len) {
+	int i, n = 0;
+
+	for (i = 0; i < len; i++)
+		n += job->trust[mod][i] && stream[i] == job->key[mod][i];
+	return n;
+}
+
+static void fit_mod(void *ctx, unsigned long mod, int worker) {
+	struct fit_job *job = (struct fit_job *)ctx;
+	unsigned char stream[SECTOR_SIZE];
+	int l, lsb, n, prefix_trusted, i;
+	unsigned int seed;
+
+	(void)worker;
+	for (i = 0, prefix_trusted = 0; i < FIT_PREFIX; i++)
+		prefix_trusted += job->trust[mod][i];
+	for (l = 0; l < FIT_LFSRS; l++) {
+		for (lsb = 0; lsb < 2; lsb++) {
+			for (seed = 1; seed < (1u << fit_lfsrs[l].width); seed++) {
+				// the prefix weeds out nearly every seed for 16 generated words
+				rand_stream(&job->model[l][lsb], seed, stream, FIT_PREFIX);
+				if (count_matches(job, mod, stream, FIT_PREFIX) * 100 < prefix_trusted * FIT_PREFIX_MATCH)
+					continue;
+				rand_stream(&job->model[l][lsb], seed, stream, SECTOR_SIZE);
+				n = count_matches(job, mod, stream, SECTOR_SIZE);
+				if (n * 100 >= job->trusted[mod] * FIT_MATCH && n > job->match[mod]) {
+					job->match[mod] = n;
+					job->lfsr[mod] = l;
+					job->lsb[mod] = lsb;
+					job->seed[mod] = seed;
+				}
+			}
+		}
+	}
+}
+
+static int load_key_file(const char *xordir, int mod, const char *suffix, unsigned char *buf) {
+	char file[256];
+	FILE *fp;
+	size_t n;
+
+	snprintf(file, sizeof(file), "%s/%d_%s.bin", xordir, mod, suffix);
+	if ((fp = fopen(file, "rb")) == NULL)
+		return -1;
+	n = fread(buf, 1, SECTOR_SIZE, fp);
+	fclose(fp);
+	return n == SECTOR_SIZE ? 0 : -1;
+}
+
+int rand_fit(char *xordir) {
+	struct fit_job *job;
+	unsigned char conf[SECTOR_SIZE];
+	int mod, i, l, lsb, keys = 0, votes[FIT_LFSRS][2], best_l = -1, best_lsb = 0, fitted = 0;
+	double start, seconds;
+	char file[256];
+	FILE *fp;
+
+	if ((job = (struct fit_job *)calloc(1, sizeof(*job))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	job->xordir = xordir;
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++) {
+		if (load_key_file(xordir, mod, "xor", job->key[mod]) < 0)
+			continue;
+		// without the confidence file trust every byte xor_keys could set
+		if (load_key_file(xordir, mod, "conf", conf) < 0)
+			for (i = 0; i < SECTOR_SIZE; i++)
+				conf[i] = job->key[mod][i] ? 255 : 0;
+		for (i = 0; i < SECTOR_SIZE; i++) {
+			job->trust[mod][i] = conf[i] >= FIT_TRUST;
+			job->trusted[mod] += job->trust[mod][i];
+		}
+		keys += job->trusted[mod] > 0;
+	}
+	if (keys == 0) {
+		printf("no keys in %s, run xor_keys on a dump first\n", xordir);
+		free(job);
+		return -1;
+	}
+	for (l = 0; l < FIT_LFSRS; l++)
+		for (lsb = 0; lsb < 2; lsb++)
+			rand_init(&job->model[l][lsb], fit_lfsrs[l].width, fit_lfsrs[l].taps, lsb);
+
+	printf("Fitting %d LFSRs, both bit orders, all seeds to %d keys\n", FIT_LFSRS, keys);
+	start = wall_clock();
+	run_parallel(PAGES_PER_BLOCK, 0, fit_mod, job);
+	seconds = wall_clock() - start;
+	printf("Fitted in %.2f s\n", seconds);
+
+	// one LFSR for the whole chip: the one most keys agree on
+	memset(votes, 0, sizeof(votes));
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++)
+		if (job->match[mod])
+			votes[job->lfsr[mod]][job->lsb[mod]]++;
+	for (l = 0; l < FIT_LFSRS; l++)
+		for (lsb = 0; lsb < 2; lsb++)
+			if (votes[l][lsb] && (best_l < 0 || votes[l][lsb] > votes[best_l][best_lsb])) {
+				best_l = l;
+				best_lsb = lsb;
+			}
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++) {
+		if (!job->trusted[mod])
+			continue;
+		if (job->match[mod] && job->lfsr[mod] == best_l && job->lsb[mod] == best_lsb) {
+			printf("key %2d: seed 0x%04x, %d of %d trusted bytes match\n", mod, job->seed[mod],
+			    job->match[mod], job->trusted[mod]);
+			fitted++;
+		} else {
+			printf("key %2d: no seed fits\n", mod);
+		}
+	}
+	if (best_l < 0) {
+		printf("No LFSR fits the keys: the randomizer is none of these, or the keys are too poor\n");
+		free(job);
+		return -1;
+	}
+
+	snprintf(file, sizeof(file), "%s/seeds.txt", xordir);
+	if ((fp = fopen(file, "w")) == NULL) {
+		perror(file);
+		free(job);
+		return -1;
+	}
+	fprintf(fp, "lfsr %d %04x %s\n", fit_lfsrs[best_l].width, fit_lfsrs[best_l].taps, best_lsb ? "lsb" : "msb");
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++)
+		if (job->match[mod] && job->lfsr[mod] == best_l && job->lsb[mod] == best_lsb)
+			fprintf(fp, "%d %04x\n", mod, job->seed[mod]);
+	fclose(fp);
+	printf("%s, %s first: %d seeds written to %s\n", fit_lfsrs[best_l].poly, best_lsb ? "lsb" : "msb", fitted, file);
+	free(job);
+	return 0;
+}
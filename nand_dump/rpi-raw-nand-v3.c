@@ -20,6 +20,18 @@
 
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Build:
+      gcc -O2 -march=native -o rpi-raw-nand rpi-raw-nand-v3.c ft2232h_bus.c \
+          dump_image.c descramble.c xorkeys.c mtk_ecc.c \
+          gpt.c split.c merge.c page_index.c ubi.c randomizer.c \
+          build_image.c scan.c archive.c sparse.c manifest.c bbt.c live.c \
+          stream.c -lftdi1 -lz -pthread
+    Without libftdi (FT2232H backend talks to ftdi_mock.c, see there), replace
+    -lftdi1 by:
+      -DFTDI_MOCK ftdi_mock.c
+    With the -t bus trace, add to either:
+      -DBUS_TRACE bus_trace.c
 */
 
 #include <sys/types.h>
@@ -31,11 +43,16 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+
+#include "nand_bus.h"
+#include "nand_pins.h"
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+#include "bus_trace.h"
 
 //#define DEBUG  // Debugging
 
-#define PAGE_SIZE 4352 // 4096 + 256 bytes, 256 bytes ECC/page
-#define BLOCK_SIZE 278528 // 64 pages of4352 bytes
 #define MAX_WAIT_READ_BUSY	1000000
 
 /* For Raspberry 2B and 3B :*/
@@ -45,25 +62,31 @@
 // IMPORTANT: BE VERY CAREFUL TO CONNECT VCC TO P1-01 (3.3V) AND *NOT* P1-02 (5V) !!
 // IMPORTANT: MAY BE YOU NEED EXTERNAL 1.8V for modern NANDs
 
-// GPIO pins have been chosen to be compitable w/ Waveshare NandFlash Board and lost RPi SMI NAND driver
-#define WRITE_PROTECT           2
-#define READY_BUSY              3
-#define ADDRESS_LATCH_ENABLE    4
-#define COMMAND_LATCH_ENABLE    17
-#define READ_ENABLE             18
-#define WRITE_ENABLE            27
-#define CHIP_ENABLE             22 // needed?
+// control pins are in nand_pins.h
 
 // mapping of the I/O pins
-int data_to_gpio_map[8] = { 23, 24, 25, 8, 7, 10, 9, 11 }; // 23 = I/O 0 .. 11 = I/O 7
+int data_to_gpio_map[8] = DATA_TO_GPIO_MAP; // 23 = I/O 0 .. 11 = I/O 7
+
+// multiple chips can share the data/control bus, each one needs its own CE# and R/B#
+// chip 0 uses the pins above, the others use free GPIOs (not on the Waveshare board)
+#define MAX_CHIPS 4
+int chip_enable_map[MAX_CHIPS] = { CHIP_ENABLE, 5, 12, 16 };
+int ready_busy_map[MAX_CHIPS] = { READY_BUSY, 6, 13, 19 };
+int chip_count = 1; // number of chips wired up, set by read_chips
+struct bad_blocks bbt; // of chip 0, from BBT_FILE; the bad blocks are not read, written or erased
+int stream_fd = -1;   // the real stdout when the dump goes there, see stream.c
 
 
 volatile unsigned int *gpio;
 
 int read_id(unsigned char id[5]);
-int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare);
+int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare, int descramble);
+int read_partition(char *name, char *outfile, int descramble);
 int write_pages(int first_page_number, int number_of_pages, char *infile);
 int erase_blocks(int first_block_number, int number_of_blocks);
+int read_chips(int chips, int first_page_number, int number_of_pages, char *outprefix);
+int read_bbt(void);
+int read_live(char *outdir, char *dumpfile);
 
 //---------------------------
 
@@ -94,6 +117,7 @@ inline void GPIO_SET_HIGH(int g) {
 	printf("Setting GPIO#%d to 1\n", g);
 #endif
 	*(gpio +  7)  = 1 << g;
+	TRACE_GPIO(g, 1);
 	SHORTPAUSE();
 }
 
@@ -102,11 +126,13 @@ inline void GPIO_SET_LOW(int g) {
 	printf("Setting GPIO#%d to 0\n", g);
 #endif
 	*(gpio + 10)  = 1 << g;
+	TRACE_GPIO(g, 0);
 	SHORTPAUSE();
 }
 
 inline int GPIO_READ(int g) {
 	int x = (*(gpio + 13) & (1 << g)) >> g;
+	TRACE_GPIO(g, x);
 #ifdef DEBUG
 	printf("GPIO#%d reads as %d\n", g, x);
 #endif
@@ -186,6 +212,137 @@ void shortpause() {
 	}
 }
 
+// ------------------------------ GPIO BUS BACKEND ------------------------------
+
+static int mem_fd = -1;
+
+static int gpio_open(void) {
+	if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC)) < 0) {
+		perror("Open /dev/mem, are you root?");
+		return -1;
+	}
+
+	if ((gpio = (volatile unsigned int *) mmap((caddr_t) 0x13370000, 4096, PROT_READ|PROT_WRITE,
+						MAP_SHARED|MAP_FIXED, mem_fd, GPIO_BASE)) == MAP_FAILED) {
+		perror("mmap GPIO_BASE");
+		close(mem_fd);
+		mem_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void gpio_close(void) {
+	if (mem_fd < 0)
+		return;
+	munmap((void *)gpio, 4096);
+	close(mem_fd);
+	mem_fd = -1;
+}
+
+static void gpio_init(int chips) {
+	int chip;
+
+	for (chip = 0; chip < chips; chip++) {
+		SET_GPIO_INPUT(ready_busy_map[chip]);
+		SET_GPIO_OUTPUT(chip_enable_map[chip]);
+	}
+
+	SET_GPIO_OUTPUT(WRITE_PROTECT);
+	GPIO_SET_HIGH(WRITE_PROTECT);
+
+	SET_GPIO_OUTPUT(READ_ENABLE);
+	GPIO_SET_HIGH(READ_ENABLE);
+
+	SET_GPIO_OUTPUT(WRITE_ENABLE);
+	GPIO_SET_HIGH(WRITE_ENABLE);
+
+	SET_GPIO_OUTPUT(COMMAND_LATCH_ENABLE);
+	CLE_LOW();
+
+	SET_GPIO_OUTPUT(ADDRESS_LATCH_ENABLE);
+	ALE_LOW();
+}
+
+static void gpio_select_chip(int chip) {
+	int i;
+
+	for (i = 0; i < chip_count; i++) {
+		if (i != chip)
+			GPIO_SET_HIGH(chip_enable_map[i]);
+	}
+	if (chip >= 0)
+		GPIO_SET_LOW(chip_enable_map[chip]);
+}
+
+static void gpio_write_data(const unsigned char *buf, unsigned int len) {
+	unsigned int i;
+
+	SET_DATA_DIRECTION_OUTPUT();
+	for (i = 0; i < len; i++) {
+		GPIO_SET_LOW(WRITE_ENABLE);
+		GPIO_WRITE_BYTE(buf[i]);
+		GPIO_SET_HIGH(WRITE_ENABLE);
+	}
+}
+
+static void gpio_read_data(unsigned char *buf, unsigned int len) {
+	unsigned int i;
+
+	// the data direction is only switched once instead of per byte
+	SET_DATA_DIRECTION_INPUT();
+	for (i = 0; i < len; i++) {
+		GPIO_SET_LOW(READ_ENABLE);
+		buf[i] = GPIO_READ_BYTE();
+		GPIO_SET_HIGH(READ_ENABLE);
+	}
+}
+
+static void gpio_command(unsigned char cmd) {
+	CLE_HIGH();
+	gpio_write_data(&cmd, 1);
+	CLE_LOW();
+}
+
+static void gpio_address(const unsigned char *cycles, int count) {
+	ALE_HIGH();
+	gpio_write_data(cycles, count);
+	SET_DATA_DIRECTION_INPUT();
+	ALE_LOW();
+}
+
+static int gpio_ready(int chip) {
+	return GPIO_READ(ready_busy_map[chip]);
+}
+
+static int gpio_wait_ready(int chip) {
+	int i;
+
+	for (i = 0; i < MAX_WAIT_READ_BUSY; i++) {
+		if (GPIO_READ(ready_busy_map[chip]))
+			return 0;
+		shortpause();
+	}
+	return -1;
+}
+
+struct nand_bus gpio_bus = {
+	"gpio", MAX_CHIPS,
+	gpio_open, gpio_close, gpio_init, gpio_select_chip,
+	gpio_command, gpio_address, gpio_write_data, gpio_read_data,
+	gpio_ready, gpio_wait_ready
+};
+
+struct nand_bus *bus = &gpio_bus;
+
+static struct nand_bus *find_bus(const char *name) {
+	if (strcmp(name, gpio_bus.name) == 0)
+		return &gpio_bus;
+	if (strcmp(name, ft2232h_bus.name) == 0)
+		return &ft2232h_bus;
+	return NULL;
+}
+
 // ------------------------------ START OF RESTRUCTURED ------------------------------ 
 
 /* Basic Data Type Definition */
@@ -249,6 +406,7 @@ typedef enum{
 #define tRCBSY                25
 #define tDBSY                 1
 #define tCBSY                 700
+#define tBERS_TIMEOUT_VALUE   10000
 #define BP_PROT_MODE
 #endif
 
@@ -302,6 +460,39 @@ struct fps{
 
 typedef struct fps FlashParameter;
 
+/* Asynchronous Operation */
+typedef enum{
+    Op_ReadPage,
+    Op_ReadSectors,     // page to the page register, then only the sectors in Sectors out
+    Op_ProgramPage,
+    Op_CacheProgram,
+    Op_EraseBlock
+}OpType;
+
+typedef enum{
+    OpState_Idle,       // not submitted yet, or re-armed by its callback
+    OpState_Busy,       // command sent, chip runs tR/tPROG/tBERS
+    OpState_Ready,      // R/B# went high, data/status not collected yet
+    OpState_Done
+}OpState;
+
+typedef struct flashop FlashOp;
+
+struct flashop{
+    OpType    Type;
+    int       Chip;
+    uint32    Page;         // row address, first page of the block for erase
+    uBusWidth *DataBuf;
+    uint32    Length;
+    uint32    Sectors;      // Op_ReadSectors: bit n -> sector n to DataBuf + n * SECTOR_SIZE
+    BOOL      LastPage;     // Op_CacheProgram: end the cache program sequence
+    OpState   State;
+    ReturnMsg Result;
+    struct timespec Deadline;
+    void      (*Callback)( FlashOp *op );
+    void      *Context;
+};
+
 /*
  * Utility Function
  */
@@ -340,6 +531,40 @@ void WaitTime( uint32 TimeValue ) {
     Wait_Timer( &flash_info );
 }
 
+/*
+ * Function:     SelectChip
+ * Arguments:    Chip -> chip to pull CE# low for, -1 deselects all chips
+ * Return Value: None.
+ * Description:  Give one chip ownership of the shared data/control bus.
+ *               A deselected chip keeps running its array operation
+ *               (tR, tPROG, tBERS), only bus cycles need CE# low.
+ */
+void SelectChip(int Chip) {
+    bus->select_chip(Chip);
+}
+
+/*
+ * Function:     ChipReady
+ * Arguments:    Chip -> chip to check
+ * Return Value: READY, BUSY
+ * Description:  Sample the R/B# line of a chip, does not need the bus
+ */
+BOOL ChipReady(int Chip) {
+    return bus->ready(Chip) ? READY : BUSY;
+}
+
+/*
+ * Function:     WaitFlashReady
+ * Arguments:    Chip -> chip to wait for
+ * Return Value: READY, TIMEOUT
+ * Description:  Wait until R/B# of a chip goes high. A backend that
+ *               queues transfers only queues the wait, the answer
+ *               comes with the next read.
+ */
+BOOL WaitFlashReady(int Chip) {
+    return bus->wait_ready(Chip) == 0 ? READY : TIMEOUT;
+}
+
 /*
  * Function:     InitFlash
  * Arguments:    None.
@@ -347,26 +572,11 @@ void WaitTime( uint32 TimeValue ) {
  * Description:  Initial MX30 flash device
  */
 void InitFlash(void) {
-    // Setup GPIOs
-    SET_GPIO_INPUT(READY_BUSY);
-
-    SET_GPIO_OUTPUT(WRITE_PROTECT);
-    GPIO_SET_HIGH(WRITE_PROTECT);
-
-    SET_GPIO_OUTPUT(READ_ENABLE);
-    GPIO_SET_HIGH(READ_ENABLE);
-
-    SET_GPIO_OUTPUT(WRITE_ENABLE);
-    GPIO_SET_HIGH(WRITE_ENABLE);
-
-    SET_GPIO_OUTPUT(COMMAND_LATCH_ENABLE);
-    CLE_LOW();
-
-    SET_GPIO_OUTPUT(ADDRESS_LATCH_ENABLE);
-    ALE_LOW();
+    // Setup control lines
+    bus->init(chip_count);
 
-    //OUT_GPIO(N_CHIP_ENABLE);
-    //GPIO_SET_LOW(N_CHIP_ENABLE);
+    // single chip commands expect chip 0 to own the bus
+    SelectChip(0);
 }
 
 /*
@@ -377,10 +587,7 @@ void InitFlash(void) {
  */
 
 void WriteToFlash(uBusWidth Value) {
-    SET_DATA_DIRECTION_OUTPUT(); 
-    GPIO_SET_LOW(WRITE_ENABLE);
-    GPIO_WRITE_BYTE(Value); // Write ID byte 1
-    GPIO_SET_HIGH(WRITE_ENABLE);
+    bus->write_data(&Value, 1);
 }
 
 /*
@@ -407,11 +614,7 @@ uBusWidth ReadFromFlash(void) {
     return buffer;
     */
 
-    GPIO_SET_LOW(READ_ENABLE);
-    // GPIO_SET_LOW(WRITE_ENABLE);??
-    SET_DATA_DIRECTION_INPUT();
-    buffer = GPIO_READ_BYTE(); //
-    GPIO_SET_HIGH(READ_ENABLE);
+    bus->read_data(&buffer, 1);
     return buffer;
 }
 
@@ -422,11 +625,12 @@ uBusWidth ReadFromFlash(void) {
  * Description:  Send flash command
  */
 void SendCommand(uBusWidth CMD_code) {
+#ifdef DEBUG
     printf("Sending command 0x%02X\n", CMD_code);
+#endif
 
-    CLE_HIGH();             /* Enable command latch signal */
-    WriteToFlash(CMD_code); /* Send commmand data */
-    CLE_LOW();              /* Disable command latch signal */
+    /* Command latch cycle */
+    bus->command(CMD_code);
 }
 
 /*
@@ -437,14 +641,18 @@ void SendCommand(uBusWidth CMD_code) {
  */
 ReturnMsg ReadStatusOP( uBusWidth *StatusReg ) {
 
+#ifdef DEBUG
     printf("Status before check 0x%02X\n", *StatusReg);
+#endif
     /* Send status read command */
     SendCommand(0x70);
 
     /* Read status value */    
-    *StatusReg = GPIO_READ(READY_BUSY);
+    *StatusReg = bus->ready(0);
     
+#ifdef DEBUG
     printf("Status after check 0x%02X\n", *StatusReg);
+#endif
 
     return Flash_Success;
 }
@@ -456,16 +664,8 @@ ReturnMsg ReadStatusOP( uBusWidth *StatusReg ) {
  * Description:  Send one byte address
  */
 void SendByteAddress( uint8 Byte_addr ) {
-    /* Enable address latch signal */
-    ALE_HIGH();
-
-    /* Send address data */
-    WriteToFlash( Byte_addr );
-
-    SET_DATA_DIRECTION_INPUT(); //??
-
-    /* Disable address latch signal */
-    ALE_LOW();
+    /* Address latch cycle */
+    bus->address( &Byte_addr, 1 );
 }
 
 /*
@@ -489,21 +689,18 @@ The A[11:8] must be 0 when the A12 value is 1.
  * Description:  Send 4(5) byte address
  */
 void SendLongAddress(uint32 Address) {
+#ifdef DEBUG
     printf("Sending long address %lu\n", Address);
-    /* Enable address latch signal */
-    ALE_HIGH();  
-        
-    /* Send 5 byte address data */
-    WriteToFlash((Address >> BYTE0_OFFSET) & BYTE_MASK );
-    WriteToFlash((Address >> BYTE1_OFFSET) & BYTE1_MASK );
-    WriteToFlash((Address >> BYTE2_OFFSET) & BYTE_MASK );
-    WriteToFlash((Address >> BYTE3_OFFSET) & BYTE_MASK );
-    WriteToFlash((Address >> BYTE4_OFFSET) & BYTE_MASK );
-
-    SET_DATA_DIRECTION_INPUT(); //??
+#endif
+    uint8 cycles[5];
 
-    /* Disable address latch signal */
-    ALE_LOW();
+    /* Send 5 byte address data */
+    cycles[0] = (Address >> BYTE0_OFFSET) & BYTE_MASK;
+    cycles[1] = (Address >> BYTE1_OFFSET) & BYTE1_MASK;
+    cycles[2] = (Address >> BYTE2_OFFSET) & BYTE_MASK;
+    cycles[3] = (Address >> BYTE3_OFFSET) & BYTE_MASK;
+    cycles[4] = (uint8)((unsigned long long)Address >> BYTE4_OFFSET) & BYTE_MASK;
+    bus->address(cycles, 5);
 }
 
 /*
@@ -517,7 +714,9 @@ BOOL CheckStatus( uint8 CheckFlag ) {
 
     ReadStatusOP(&status);
     
+#ifdef DEBUG
     printf("CheckStatus 0x%02X\n", status);
+#endif
     // two options - see page 22 in doc, use R/B 1=ready, 0=busy
     if(status == 1 ) {       
         return TRUE;
@@ -613,6 +812,306 @@ ReturnMsg ReadRandomPageOP( uAddr Address, uBusWidth * DataBuf, uint32 Length )
 }
 
 
+/*
+ * Function:     SendPageAddress
+ * Arguments:    Page   -> row address (page number)
+ *               Column -> byte offset inside the page
+ * Return Value: None.
+ * Description:  Send the 2 column and 3 row address cycles, see the
+ *               address allocation table above
+ */
+void SendPageAddress(uint32 Page, uint32 Column) {
+    uint8 cycles[5];
+
+    cycles[0] = Column & BYTE_MASK;
+    cycles[1] = (Column >> 8) & BYTE_MASK;
+    cycles[2] = Page & BYTE_MASK;
+    cycles[3] = (Page >> 8) & BYTE_MASK;
+    cycles[4] = (Page >> 16) & BYTE_MASK;
+    bus->address(cycles, 5);
+}
+
+/*
+ * Function:     SendColumnAddress
+ * Arguments:    Column -> byte offset inside the page
+ * Return Value: None.
+ * Description:  Send the 2 column address cycles only, used by random
+ *               data out (05h/E0h)
+ */
+void SendColumnAddress(uint32 Column) {
+    uint8 cycles[2];
+
+    cycles[0] = Column & BYTE_MASK;
+    cycles[1] = (Column >> 8) & BYTE_MASK;
+    bus->address(cycles, 2);
+}
+
+/*
+ * Function:     SendRowAddress
+ * Arguments:    Page -> row address (page number)
+ * Return Value: None.
+ * Description:  Send the 3 row address cycles only, used by block erase
+ */
+void SendRowAddress(uint32 Page) {
+    uint8 cycles[3];
+
+    cycles[0] = Page & BYTE_MASK;
+    cycles[1] = (Page >> 8) & BYTE_MASK;
+    cycles[2] = (Page >> 16) & BYTE_MASK;
+    bus->address(cycles, 3);
+}
+
+/*
+ * Function:     ReadFlashBuffer
+ * Arguments:    DataBuf -> data buffer to store data
+ *               Length  -> the number of bytes to read
+ * Return Value: None.
+ * Description:  Clock out Length bytes from the page register in one
+ *               bus transfer
+ */
+void ReadFlashBuffer(uBusWidth *DataBuf, uint32 Length) {
+    bus->read_data(DataBuf, Length);
+}
+
+
+/*
+ * Function:     WriteFlashBuffer
+ * Arguments:    DataBuf -> data to write
+ *               Length  -> the number of bytes to write
+ * Return Value: None.
+ * Description:  Clock Length bytes into the page register
+ */
+void WriteFlashBuffer(uBusWidth *DataBuf, uint32 Length) {
+    bus->write_data(DataBuf, Length);
+}
+
+/*
+ * Asynchronous operations
+ *
+ * Every operation is split at the point where the blocking version spins in
+ * WaitTime/WaitFlashReady:
+ *   SubmitOP   -> send command, address (and data), chip goes busy
+ *   PollOP     -> sample R/B#, never touches the bus
+ *   CompleteOP -> collect data or status, run the callback
+ * RunFlashOps drives any number of operations on different chips from a
+ * single loop, so the bus is never idle while another chip could use it.
+ */
+
+static void SetDeadline( FlashOp *op, uint32 TimeValue ) {
+    clock_gettime(CLOCK_MONOTONIC, &op->Deadline);
+    op->Deadline.tv_sec += TimeValue / 1000000;
+    op->Deadline.tv_nsec += (TimeValue % 1000000) * 1000;
+    if (op->Deadline.tv_nsec >= 1000000000) {
+        op->Deadline.tv_sec++;
+        op->Deadline.tv_nsec -= 1000000000;
+    }
+}
+
+static BOOL DeadlinePassed( FlashOp *op ) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != op->Deadline.tv_sec)
+        return now.tv_sec > op->Deadline.tv_sec;
+    return now.tv_nsec > op->Deadline.tv_nsec;
+}
+
+static void FinishOP( FlashOp *op, ReturnMsg Result ) {
+    op->Result = Result;
+    op->State = OpState_Done;
+    if (op->Callback != NULL)
+        op->Callback(op);
+}
+
+/*
+ * Function:     SubmitOP
+ * Arguments:    op -> operation to start
+ * Return Value: Flash_Busy, Flash_CmdInvalid, Flash_Success
+ * Description:  Send the command sequence and release the bus, the
+ *               chip is left running the array operation. R/B# is not
+ *               sampled first, the previous operation on the chip has
+ *               completed already (and sampling costs a round trip on
+ *               a USB backend). Only an operation re-armed after a
+ *               timeout waits for the chip, for one more timeout.
+ */
+ReturnMsg SubmitOP( FlashOp *op ) {
+    uint32 timeout = FLASH_TIMEOUT_VALUE;
+
+    if (op->Result == Flash_OperationTimeOut || op->Result == Flash_Busy) {
+        if (ChipReady(op->Chip) != READY) {
+            if (op->Result == Flash_OperationTimeOut) {
+                SetDeadline(op, FLASH_TIMEOUT_VALUE);
+                op->Result = Flash_Busy;
+            }
+            return Flash_Busy;
+        }
+        op->Result = Flash_Success;
+    }
+
+    SelectChip(op->Chip);
+    switch (op->Type) {
+    case Op_ReadPage:
+    case Op_ReadSectors:
+        SendCommand(0x00);
+        SendPageAddress(op->Page, 0);
+        SendCommand(0x30);
+        break;
+    case Op_ProgramPage:
+    case Op_CacheProgram:
+        SendCommand(0x80);
+        SendPageAddress(op->Page, 0);
+        WriteFlashBuffer(op->DataBuf, op->Length);
+        if (op->Type == Op_ProgramPage || op->LastPage)
+            SendCommand(0x10);  // program last page
+        else
+            SendCommand(0x15);  // continue cache program
+        break;
+    case Op_EraseBlock:
+        SendCommand(0x60);
+        SendRowAddress(op->Page);
+        SendCommand(0xD0);
+        timeout = tBERS_TIMEOUT_VALUE;
+        break;
+    default:
+        SelectChip(-1);
+        return Flash_CmdInvalid;
+    }
+    SelectChip(-1);
+
+    SetDeadline(op, timeout);
+    op->State = OpState_Busy;
+    return Flash_Success;
+}
+
+/*
+ * Function:     PollOP
+ * Arguments:    op -> submitted operation
+ * Return Value: State of the operation
+ * Description:  Check R/B# of the chip, a timed out operation is
+ *               finished with Flash_OperationTimeOut
+ */
+OpState PollOP( FlashOp *op ) {
+    if (op->State == OpState_Busy) {
+        if (ChipReady(op->Chip) == READY)
+            op->State = OpState_Ready;
+        else if (DeadlinePassed(op))
+            FinishOP(op, Flash_OperationTimeOut);
+    }
+    return op->State;
+}
+
+/*
+ * Function:     CompleteOP
+ * Arguments:    op -> operation in OpState_Ready
+ * Return Value: Flash_Busy, Flash_Success, Flash_ProgramFailed,
+ *               Flash_EraseFailed
+ * Description:  Clock out the page data (or the selected sectors of
+ *               it) or read the status register, then call the
+ *               completion callback
+ */
+ReturnMsg CompleteOP( FlashOp *op ) {
+    uBusWidth status;
+    ReturnMsg result = Flash_Success;
+    int i;
+
+    if (op->State != OpState_Ready) return Flash_Busy;
+
+    SelectChip(op->Chip);
+    if (op->Type == Op_ReadPage) {
+        ReadFlashBuffer(op->DataBuf, op->Length);
+    } else if (op->Type == Op_ReadSectors) {
+        for (i = 0; i < SECTORS_PER_PAGE; i++) {
+            if (!(op->Sectors & (1 << i)))
+                continue;
+            SendCommand(0x05);  // random data out
+            SendColumnAddress(i * SECTOR_SIZE);
+            SendCommand(0xE0);
+            ReadFlashBuffer(op->DataBuf + i * SECTOR_SIZE, SECTOR_SIZE);
+        }
+    } else {
+        SendCommand(0x70);
+        status = ReadFromFlash();
+        if (status & 0x01)
+            result = (op->Type == Op_EraseBlock) ? Flash_EraseFailed : Flash_ProgramFailed;
+    }
+    SelectChip(-1);
+
+    FinishOP(op, result);
+    return result;
+}
+
+/*
+ * Function:     WaitOP
+ * Arguments:    op -> operation to run
+ * Return Value: Result of the operation
+ * Description:  Blocking use of the asynchronous API. The wait for
+ *               R/B# goes to the bus backend, so command, wait and data
+ *               out of a page read end up in a single transfer.
+ */
+ReturnMsg WaitOP( FlashOp *op ) {
+    ReturnMsg rtMsg = SubmitOP(op);
+    if (rtMsg != Flash_Success) return rtMsg;
+
+    if (WaitFlashReady(op->Chip) != READY) {
+        FinishOP(op, Flash_OperationTimeOut);
+        return op->Result;
+    }
+    op->State = OpState_Ready;
+    CompleteOP(op);
+    return op->Result;
+}
+
+/*
+ * Function:     RunFlashOps
+ * Arguments:    Ops     -> operations, at most one per chip
+ *               Count   -> number of operations
+ *               Idle    -> other work to do while all chips are busy, can be NULL
+ *               Context -> passed to Idle
+ * Return Value: None.
+ * Description:  Event loop, returns when every operation is done. A
+ *               callback can put its operation back to OpState_Idle
+ *               with a new page to chain the next operation.
+ */
+void RunFlashOps( FlashOp **Ops, int Count, void (*Idle)( void *Context ), void *Context ) {
+    int i, pending, progress;
+    ReturnMsg result;
+
+    do {
+        pending = progress = 0;
+        for (i = 0; i < Count; i++) {
+            FlashOp *op = Ops[i];
+            switch (op->State) {
+            case OpState_Idle:
+                result = SubmitOP(op);
+                if (result == Flash_Success)
+                    progress = 1;
+                else if (result != Flash_Busy)
+                    FinishOP(op, result);
+                else if (DeadlinePassed(op))
+                    FinishOP(op, Flash_OperationTimeOut);  // still stuck, the callback decides
+                if (op->State != OpState_Done)
+                    pending++;
+                break;
+            case OpState_Busy:
+                if (PollOP(op) != OpState_Ready) {
+                    if (op->State != OpState_Done)
+                        pending++;
+                    break;
+                }
+                /* fall through */
+            case OpState_Ready:
+                CompleteOP(op);
+                progress = 1;
+                if (op->State != OpState_Done)
+                    pending++;
+                break;
+            default:
+                break;
+            }
+        }
+        if (!progress && pending && Idle != NULL)
+            Idle(Context);
+    } while (pending);
+}
 
 // ------------------------------ END OF RESTRUCTURED ------------------------------ 
 
@@ -626,101 +1125,327 @@ ReturnMsg ReadRandomPageOP( uAddr Address, uBusWidth * DataBuf, uint32 Length )
 
 int main(int argc, char **argv) { 
 	
-	int mem_fd;
-	printf("Raspberry GPIO raw NAND flasher by pharos, littlebalup, skypiece, jvandewiel\n\n");
-
-	if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC)) < 0) {
-		perror("Open /dev/mem, are you root?");
-		return -1;
+	char *progname = argv[0];
+
+	// options go before <delay>
+	while (argc > 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-b") == 0) {
+			if ((bus = find_bus(argv[2])) == NULL) {
+				printf("unknown bus backend '%s'\n", argv[2]);
+				bus = &gpio_bus;
+				goto usage;
+			}
+		} else if (strcmp(argv[1], "-t") == 0) {
+#ifdef BUS_TRACE
+			if (trace_open(argv[2]) < 0)
+				return -1;
+#else
+			printf("-t needs a build with -DBUS_TRACE\n");
+			goto usage;
+#endif
+		} else {
+			break;
+		}
+		argc -= 2;
+		argv += 2;
 	}
 
-	if ((gpio = (volatile unsigned int *) mmap((caddr_t) 0x13370000, 4096, PROT_READ|PROT_WRITE,
-						MAP_SHARED|MAP_FIXED, mem_fd, GPIO_BASE)) == MAP_FAILED) {
-		perror("mmap GPIO_BASE");
-		close(mem_fd);
+	// read_full ... -: stdout carries the dump and nothing else, see stream.c
+	if (argc == 6 && (strcmp(argv[2], "read_full") == 0 || strcmp(argv[2], "read_data") == 0) &&
+	    strcmp(argv[5], STREAM_STDOUT) == 0 && (stream_fd = stream_redirect()) < 0)
 		return -1;
-	}
-
-	InitFlash();
-    //GPIO_SET_HIGH(N_CHIP_ENABLE);
+	printf("Raspberry GPIO raw NAND flasher by pharos, littlebalup, skypiece, jvandewiel\n\n");
 
 	if (argc < 3) {
 usage:
 		
-		printf("usage: sudo %s <delay> <command> ...\n\n" \
+		printf("usage: sudo %s [-b gpio|ft2232h] [-t trace.vcd] <delay> <command> ...\n\n" \
+		    " -b      bus backend: gpio (default, Raspberry Pi header) or ft2232h (MPSSE host bus on USB)\n" \
+		    " -t      write every bus pin transition to a VCD file (needs a -DBUS_TRACE build)\n" \
 		    " <delay> used to slow down operations (50 should work, increase if bad reads)\n\n" \
 		    "Commands:\n" \
 		    " read_id (no arguments)                        : read and decrypt chip ID\n" \
 		    " read_full <page #> <# of pages> <output file> : read N pages including spare\n" \
 		    " read_data <page #> <# of pages> <output file> : read N pages, discard spare\n" \
+		    "                                                 (output file - : framed blocks to stdout,\n" \
+		    "                                                 for ssh or nc into receive, messages to stderr)\n" \
 		    " write_full <page #> <# of pages> <input file> : write N pages, including spare\n" \
 		    " write_data <page #> <# of pages> <input file> : write N pages, discard spare\n" \
-		    " erase_blocks <block number> <# of blocks>     : erase N blocks\n\n" \
+		    " erase_blocks <block number> <# of blocks>     : erase N blocks\n" \
+		    " read_partition <name> <output file> [raw|descrambled]\n" \
+		    "                                               : read the GPT from the chip, then only the\n" \
+		    "                                                 pages of partition <name>, as read_full or\n" \
+		    "                                                 descrambled and ECC corrected\n" \
+		    " read_chips <# of chips> <page #> <# of pages> <output prefix>\n" \
+		    "                                               : read N pages from each chip, interleaved,\n" \
+		    "                                                 into <output prefix>_ce<chip>.bin\n" \
+		    " read_live <output dir> [raw dump]             : read the GPT, then every partition straight into\n" \
+		    "                                                 <dir>/<name>.bin (descrambled, ECC corrected, as\n" \
+		    "                                                 partitions exports them) in one pass, the raw\n" \
+		    "                                                 pages of the whole chip to <raw dump> too\n" \
+		    " read_bbt (no arguments)                       : decode the on-flash bad block table, scan the\n" \
+		    "                                                 factory markers, save both to " BBT_FILE ";\n" \
+		    "                                                 the commands above skip the blocks listed there\n\n" \
+		    "Offline commands (work on a read_full dump, no chip needed):\n" \
+		    " descramble <raw dump> <output file> [xor dir] : XOR every page with its page %% 64 key,\n" \
+		    "                                                 keys from the dump or <xor dir>/<mod>_xor.bin\n" \
+		    "                                                 (default " XOR_DIR ")\n" \
+		    " xor_keys <raw dump> [xor dir] [page #] [# of pages]\n" \
+		    "                                               : derive the 64 keys from the most common\n" \
+		    "                                                 value per offset, write <mod>_xor.bin and\n" \
+		    "                                                 <mod>_conf.bin (default: whole dump)\n" \
+		    " rand_fit [xor dir]                            : fit an LFSR and 64 seeds to the keys in <xor dir>,\n" \
+		    "                                                 write <xor dir>/seeds.txt; keys are then\n" \
+		    "                                                 generated from it, no key files needed\n" \
+		    " ecc_check <descrambled dump> <index file> [corrected dump]\n" \
+		    "                                               : check/correct every sector's BCH ECC, write\n" \
+		    "                                                 bits corrected per sector to <index file>\n" \
+		    " partitions <descrambled dump> <output dir> [data|raw|sparse|list]\n" \
+		    "                                               : export every GPT partition to <dir>/<name>.bin\n" \
+		    "                                                 (data, UBI layout for persist/userdata),\n" \
+		    "                                                 <name>_raw.bin (whole pages) or <name>.simg\n" \
+		    "                                                 (data as an Android sparse image, fastboot)\n" \
+		    " split <dump> <data file> <oob file>           : 3 * 1024 data bytes per page to <data file>,\n" \
+		    "                                                 the rest (spare, sector 3) to <oob file>\n" \
+		    " merge_pages <page dir> <output file> <# of pages>\n" \
+		    "                                               : merge <page dir>/<page #>.bin (dumppages.py)\n" \
+		    "                                                 into one dump, missing pages 0xFF and flagged\n" \
+		    "                                                 in <output file>.missing\n" \
+		    " merge_dumps <output file> <dump> <dump> [<dump> ...]\n" \
+		    "                                               : per bit majority vote over up to 15 dumps of\n" \
+		    "                                                 the same chip, disputed bits per page to\n" \
+		    "                                                 <output file>.votes\n" \
+		    " index <dump> [<partition>|all <query>]        : index the pages into <dump>.idx (once) and\n" \
+		    "                                                 count them per partition, or list the pages\n" \
+		    "                                                 that are erased, unchecked, corrected,\n" \
+		    "                                                 uncorrectable or doubtful (re-read, disputed)\n" \
+		    " ubi <descrambled dump> <output dir> [partition]\n" \
+		    "                                               : scan the UBI headers of <partition> (default\n" \
+		    "                                                 userdata), write each volume to <dir>/<name>.img\n" \
+		    " build_image <partition image> <partition> <output file> [raw dump|-] [xor dir]\n" \
+		    "                                               : ECC encode and scramble the image into raw pages\n" \
+		    "                                                 for write_full: <raw dump> with the partition\n" \
+		    "                                                 replaced, or the partition alone\n" \
+		    " scan <descrambled dump> <json file>           : find SquashFS, UBI, Android boot, preloader\n" \
+		    "                                                 and GPT signatures, offset, page and\n" \
+		    "                                                 partition of each to <json file>\n" \
+		    " pack <dump> <archive>                         : deflate the dump block by block, erased pages\n" \
+		    "                                                 left out; every offline command reads the\n" \
+		    "                                                 archive as a dump, read_full writes one for\n" \
+		    "                                                 an output file ending in " ARCHIVE_SUFFIX "\n" \
+		    " unpack <archive> <dump>                       : the dump back from the archive\n" \
+		    " manifest <dump>                               : hash every page and block into <dump>.mf\n" \
+		    "                                                 (read_full writes one as it reads)\n" \
+		    " diff_manifest <manifest> <manifest>           : list the pages whose hashes differ\n" \
+		    " verify_manifest <dump> <dump>                 : compare by manifest (made if missing or\n" \
+		    "                                                 stale), read back only the blocks that\n" \
+		    "                                                 differ and count the bytes and bits\n" \
+		    " bbt <raw dump> [xor dir]                      : read_bbt from a dump\n" \
+		    " receive <output file>                         : write the dump read_full - sends on stdin,\n" \
+		    "                                                 checking every block's hash and the end\n\n" \
 		    "Notes:\n" \
 		    " This program assumes PAGE_SIZE == %d\n" \
-		    " Run as root (sudo) required (for /dev/mem access)\n\n",
-			argv[0], PAGE_SIZE);
-		close(mem_fd);
+		    " Run as root (sudo) required (for /dev/mem access), except for the offline commands\n" \
+		    " The ft2232h backend drives a single chip\n\n",
+			progname, PAGE_SIZE);
+		bus->close();
 		return -1;
 	}
 
-	//delay = atoi(argv[1]);
+	// offline commands, these do not touch the bus
+	if (strcmp(argv[2], "descramble") == 0) {
+		if (argc != 5 && argc != 6) goto usage;
+		return descramble_dump(argv[3], argv[4], argc == 6 ? argv[5] : XOR_DIR);
+	}
 
-	// parse params
-	if (strcmp(argv[2], "read_id") == 0) {
-		return read_id(NULL);
+	if (strcmp(argv[2], "xor_keys") == 0) {
+		if (argc < 4 || argc > 7) goto usage;
+		return derive_xor_keys(argv[3], argc > 4 ? argv[4] : XOR_DIR,
+		    argc > 5 ? atoi(argv[5]) : 0, argc > 6 ? atoi(argv[6]) : 0);
 	}
 
-	if (strcmp(argv[2], "read_full") == 0) {
-		if (argc != 6) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of pages must be > 0\n");
-			return -1;
-		}
-		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 1);
+	if (strcmp(argv[2], "rand_fit") == 0) {
+		if (argc != 3 && argc != 4) goto usage;
+		return rand_fit(argc == 4 ? argv[3] : XOR_DIR);
 	}
-    
-	if (strcmp(argv[2], "read_data") == 0) {
+
+	if (strcmp(argv[2], "ecc_check") == 0) {
+		if (argc != 5 && argc != 6) goto usage;
+		return ecc_check_dump(argv[3], argv[4], argc == 6 ? argv[5] : NULL);
+	}
+
+	if (strcmp(argv[2], "partitions") == 0) {
+		if (argc != 5 && argc != 6) goto usage;
+		return export_partitions(argv[3], argv[4], argc == 6 ? argv[5] : NULL);
+	}
+
+	if (strcmp(argv[2], "split") == 0) {
 		if (argc != 6) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of pages must be > 0\n");
-			return -1;
-		}
-		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 0);
+		return split_dump(argv[3], argv[4], argv[5]);
 	}
 
-	if (strcmp(argv[2], "write_full") == 0) {
+	if (strcmp(argv[2], "merge_pages") == 0) {
 		if (argc != 6) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of pages must be > 0\n");
+		// <page>.bin files count from 0, the chip has no more pages than this
+		if (atoi(argv[5]) <= 0 || atoi(argv[5]) > CHIP_BLOCKS * PAGES_PER_BLOCK) {
+			printf("# of pages must be 1 .. %d\n", CHIP_BLOCKS * PAGES_PER_BLOCK);
 			return -1;
 		}
-		return write_pages(atoi(argv[3]), atoi(argv[4]), argv[5]);
+		return merge_pages(argv[3], argv[4], atoi(argv[5]));
 	}
 
-	if (strcmp(argv[2], "erase_blocks") == 0) {
-		if (argc != 5) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of blocks must be > 0\n");
-			return -1;
-		}
-		return erase_blocks(atoi(argv[3]), atoi(argv[4]));
+	if (strcmp(argv[2], "merge_dumps") == 0) {
+		if (argc < 6) goto usage;
+		return merge_dumps(argv[3], &argv[4], argc - 4);
 	}
 
-	printf("unknown command '%s'\n", argv[2]);
-	goto usage;
-	return 0;
-}
+	if (strcmp(argv[2], "index") == 0) {
+		if (argc != 4 && argc != 6) goto usage;
+		return query_index(argv[3], argc == 6 ? argv[4] : NULL, argc == 6 ? argv[5] : NULL);
+	}
 
-void error_msg(char *msg)
-{
-	printf("%s\nBe sure to check wiring, and check that pressure is applied on clip (if used)\n", msg);
-}
+	if (strcmp(argv[2], "ubi") == 0) {
+		if (argc != 5 && argc != 6) goto usage;
+		return ubi_scan(argv[3], argv[4], argc == 6 ? argv[5] : "userdata");
+	}
 
-void print_id(unsigned char id[6])
-{
-	unsigned int i, bit, page_size, ras_size, orga, plane_number;
-	unsigned long block_size, plane_size, nand_size, nandras_size;
+	if (strcmp(argv[2], "build_image") == 0) {
+		if (argc < 6 || argc > 8) goto usage;
+		return build_image(argv[3], argv[4], argv[5], argc > 6 && strcmp(argv[6], "-") != 0 ? argv[6] : NULL, argc > 7 ? argv[7] : XOR_DIR);
+	}
+
+	if (strcmp(argv[2], "scan") == 0) {
+		if (argc != 5) goto usage;
+		return scan_dump(argv[3], argv[4]);
+	}
+
+	if (strcmp(argv[2], "pack") == 0) {
+		if (argc != 5) goto usage;
+		return pack_dump(argv[3], argv[4]);
+	}
+
+	if (strcmp(argv[2], "unpack") == 0) {
+		if (argc != 5) goto usage;
+		return unpack_dump(argv[3], argv[4]);
+	}
+
+	if (strcmp(argv[2], "manifest") == 0) {
+		if (argc != 4) goto usage;
+		return make_manifest(argv[3]);
+	}
+
+	if (strcmp(argv[2], "diff_manifest") == 0) {
+		if (argc != 5) goto usage;
+		return diff_manifest(argv[3], argv[4]);
+	}
+
+	if (strcmp(argv[2], "verify_manifest") == 0) {
+		if (argc != 5) goto usage;
+		return verify_manifest(argv[3], argv[4]);
+	}
+
+	if (strcmp(argv[2], "bbt") == 0) {
+		if (argc != 4 && argc != 5) goto usage;
+		return bbt_dump(argv[3], argc == 5 ? argv[4] : XOR_DIR);
+	}
+
+	if (strcmp(argv[2], "receive") == 0) {
+		if (argc != 4) goto usage;
+		return stream_receive(argv[3]);
+	}
+
+	if (bus->open() < 0)
+		return -1;
+
+	InitFlash();
+    //GPIO_SET_HIGH(N_CHIP_ENABLE);
+
+	//delay = atoi(argv[1]);
+
+	// read_bbt makes the table, everything else goes around the bad blocks in it
+	if (strcmp(argv[2], "read_bbt") != 0 && bbt_load(&bbt) == 0 && bbt.bad > 0)
+		printf("%u bad blocks in " BBT_FILE ", these are skipped\n", bbt.bad);
+
+	// parse params
+	if (strcmp(argv[2], "read_id") == 0) {
+		return read_id(NULL);
+	}
+
+	if (strcmp(argv[2], "read_full") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 1, 0);
+	}
+    
+	if (strcmp(argv[2], "read_data") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 0, 0);
+	}
+
+	if (strcmp(argv[2], "read_partition") == 0) {
+		if (argc != 5 && argc != 6) goto usage;
+		if (argc == 6 && strcmp(argv[5], "raw") != 0 && strcmp(argv[5], "descrambled") != 0) goto usage;
+		return read_partition(argv[3], argv[4], argc == 6 && strcmp(argv[5], "descrambled") == 0);
+	}
+
+	if (strcmp(argv[2], "write_full") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return write_pages(atoi(argv[3]), atoi(argv[4]), argv[5]);
+	}
+
+	if (strcmp(argv[2], "erase_blocks") == 0) {
+		if (argc != 5) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of blocks must be > 0\n");
+			return -1;
+		}
+		return erase_blocks(atoi(argv[3]), atoi(argv[4]));
+	}
+
+	if (strcmp(argv[2], "read_live") == 0) {
+		if (argc != 4 && argc != 5) goto usage;
+		return read_live(argv[3], argc == 5 ? argv[4] : NULL);
+	}
+
+	if (strcmp(argv[2], "read_bbt") == 0) {
+		if (argc != 3) goto usage;
+		return read_bbt();
+	}
+
+	if (strcmp(argv[2], "read_chips") == 0) {
+		if (argc != 7) goto usage;
+		if (atoi(argv[5]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return read_chips(atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), argv[6]);
+	}
+
+	printf("unknown command '%s'\n", argv[2]);
+	goto usage;
+	return 0;
+}
+
+void error_msg(char *msg)
+{
+	printf("%s\nBe sure to check wiring, and check that pressure is applied on clip (if used)\n", msg);
+}
+
+void print_id(unsigned char id[6])
+{
+	unsigned int i, bit, page_size, ras_size, orga, plane_number;
+	unsigned long block_size, plane_size, nand_size, nandras_size;
 	char maker[16], device[16], serial_access[20];
 	unsigned *thirdbits = (unsigned*)malloc(sizeof(unsigned) * 8);
 	unsigned *fourthbits = (unsigned*)malloc(sizeof(unsigned) * 8);
@@ -898,133 +1623,32 @@ int read_id(unsigned char id[6]) {
     return 0;
 }
 
-//
-inline int page_to_address(int page, int address_byte_index)
-{
-	switch(address_byte_index) {
-	case 2:
-		return page & 0xff;
-	case 3:
-		return (page >>  8) & 0xff;
-	case 4:
-		return (page >> 16) & 0xff;
-	default:
-		return 0;
-	}
-}
-
 int send_read_command(int page) {
-	int i;
 
     /* Send page read command */    
     SendCommand(0x00);
-
-    
-    ALE_HIGH();
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_LOW(WRITE_ENABLE);
-		if (i < 2) {
-		 	printf("Col Add%d = %d\n", i + 1, page_to_address(page, i));
-		} else {
-		 	printf("Row Add%d = %d\n", i - 1, page_to_address(page, i));
-		}
-
-		GPIO_WRITE_BYTE(page_to_address(page, i));
-		GPIO_SET_HIGH(WRITE_ENABLE);
-	}
-	
-	ALE_LOW();
-    
+    SendPageAddress(page, 0);
     SendCommand(0x30);
-    /*
-	CLE_HIGH();	
-	GPIO_SET_LOW(WRITE_ENABLE);
-	GPIO_WRITE_BYTE(0x30);
-	GPIO_SET_HIGH(WRITE_ENABLE);
-	CLE_LOW();
-    */
 	return 0;
 }
 
 
 
 int send_write_command(int page, unsigned char data[PAGE_SIZE]) {
-	
-	int i;
-
-	SET_DATA_DIRECTION_OUTPUT();
-
-	CLE_HIGH();
-	GPIO_SET_LOW(WRITE_ENABLE);
-
-	GPIO_WRITE_BYTE(0x80);
-	GPIO_SET_HIGH(WRITE_ENABLE);
-	CLE_LOW();
-
-	ALE_HIGH();
 
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_LOW(WRITE_ENABLE);
+	SendCommand(0x80);
+	SendPageAddress(page, 0);
+	WriteFlashBuffer(data, PAGE_SIZE);
+	SendCommand(0x10);
 
-		// if (i < 2) {
-		// 	printf("Col Add%d = %d\n", i + 1, page_to_address(page, i));
-		// }
-		// else {
-		// 	printf("Row Add%d = %d\n", i - 1, page_to_address(page, i));
-		// }
-
-		GPIO_WRITE_BYTE(page_to_address(page, i));
-		GPIO_SET_HIGH(WRITE_ENABLE);
-	}
-	ALE_LOW();
-
-	for (i = 0; i < PAGE_SIZE; i++) {
-		GPIO_SET_LOW(WRITE_ENABLE);
-		GPIO_WRITE_BYTE(data[i]); //
-		GPIO_SET_HIGH(WRITE_ENABLE);
-	}
-
-	CLE_HIGH();
-	GPIO_SET_LOW(WRITE_ENABLE);
-	GPIO_WRITE_BYTE(0x10);
-	GPIO_SET_HIGH(WRITE_ENABLE);
-	CLE_LOW();
-	
-	
 	return 0;
 }
 
 int send_eraseblock_command(int block) {
-	
-	int i;
-
-	SET_DATA_DIRECTION_OUTPUT();
-
-	CLE_HIGH();
-    
-	GPIO_SET_LOW(WRITE_ENABLE);
-	GPIO_WRITE_BYTE(0x60);
-	GPIO_SET_HIGH(WRITE_ENABLE);
-    
-	CLE_LOW();
-
-	ALE_HIGH();
-	for (i = 2; i < 5; i++) {
-		GPIO_SET_LOW(WRITE_ENABLE);
-
-		// printf("Row Add%d = %d\n", i - 1, page_to_address(block, i));
 
-		GPIO_WRITE_BYTE(page_to_address(block, i));
-		GPIO_SET_HIGH(WRITE_ENABLE);
-
-	}
-	ALE_LOW();
-	CLE_HIGH();
-	GPIO_SET_LOW(WRITE_ENABLE);
-
-	GPIO_WRITE_BYTE(0xD0);
-	GPIO_SET_HIGH(WRITE_ENABLE);
-	CLE_LOW();
+	SendCommand(0x60);
+	SendRowAddress(block);
+	SendCommand(0xD0);
 
 	return 0;
 }
@@ -1032,21 +1656,9 @@ int send_eraseblock_command(int block) {
 int read_status()
 {
 	int data;
-	//unsigned char buf[5];
-
-	SET_DATA_DIRECTION_OUTPUT();
-	CLE_HIGH();
-	
-	GPIO_SET_LOW(WRITE_ENABLE);
-	GPIO_WRITE_BYTE(0x70);
-	GPIO_SET_HIGH(WRITE_ENABLE);
-	
-	CLE_LOW();
 
-	SET_DATA_DIRECTION_INPUT();
-	GPIO_SET_LOW(READ_ENABLE);
-	data = GPIO_READ_BYTE(); //
-	GPIO_SET_HIGH(READ_ENABLE);
+	SendCommand(0x70);
+	data = ReadFromFlash();
 
 	printf("Status data = %d\n", data);
 	return data & 1; // I/O0=0 success , I/O0=1 error
@@ -1190,70 +1802,599 @@ int read_pages(int first_page_number, int number_of_pages, char *outfile, int wr
 }
 */
 
-// simplified for new procedures 
-int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare) {
+// read_full / read_data with on the fly ECC check
+//
+// The bus loop reads pages into a ring of slots, a worker thread descrambles
+// and checks the data sectors of every page and writes the pages out in
+// order. Sectors that fail, or need more than REREAD_BITFLIPS bits
+// corrected, go back to the bus loop, which reads just those sectors again
+// with random data out (05h/E0h), MAX_REREADS times at most. A clean page
+// is read once. What the last read corrects stands; bad.log lists those
+// sectors apart from the ones that never passed.
+//
+// The keys come from XOR_DIR (run xor_keys on an earlier dump), pages without
+// a key are written unchecked. If not a single sector passes among the first
+// ECC_PROBE_SECTORS the keys or the ECC layout do not fit this chip and the
+// check is turned off. With the check on, read_full records in <output>.idx
+// how many reads each page took and how its sectors came out in the end
+// (see page_index.c).
+//
+// An output file ending in ARCHIVE_SUFFIX is written as an archive, block by
+// block as the pages come in (see archive.c). The writer thread hashes every
+// page it writes into <output>.mf (see manifest.c).
+//
+// With descramble set the pages are written as descramble and ecc_check
+// would leave them: sectors 0 .. 2 XORed with the key and corrected, sector
+// 3 0xFF. Erased sectors and pages without a key are written as read.
+//
+// Blocks that are bad in BBT_FILE are not read, their pages are written
+// as 0xFF so the rest keeps its place in the file.
+//
+// An output file of STREAM_STDOUT sends the pages to stdout in hashed
+// block frames for receive on the other end of a pipe (see stream.c);
+// there is no page index or manifest then, the frame hashes take its place.
+
+#define READ_SLOTS        32
+#define ECC_SECTORS       (SECTORS_PER_PAGE - 1) // sector 3 holds no data, see descramble.c
+#define REREAD_BITFLIPS   (ECC_T * 3 / 4)
+#define MAX_REREADS       3
+#define ECC_PROBE_SECTORS 192
+
+enum { SLOT_FREE, SLOT_READ, SLOT_REREAD, SLOT_DONE };
+
+struct read_slot {
+	int page;
+	int state;
+	int rereads;
+	unsigned int bad;   // sectors to read again
+	unsigned int done;  // sectors that passed, descrambled and corrected in buf with descramble
+	unsigned int weak;  // of those, corrected with more than REREAD_BITFLIPS on the last read
+	int status;         // worst ECC_* of the sectors that passed, erased the least
+	int flips;          // corrected in them
+	int skip;           // in a bad block, not read, buf is 0xFF
+	unsigned char buf[PAGE_SIZE];
+};
 
-	int page, block_no, page_nbr,  i;    
-	unsigned char buf[PAGE_SIZE], id[5];
+struct page_reader {
+	struct read_slot slots[READ_SLOTS];
+	int head;           // oldest slot, written next
+	int used;
+	int written;
+	int total;
+	int failed;
+	int check;
+	int descramble;
+	FILE *out;
+	struct archive_writer ar;   // instead of out, for ARCHIVE_SUFFIX
+	int archive;
+	struct stream_writer sw;    // instead of out, for STREAM_STDOUT
+	int stream;
+	FILE *badlog;
+	struct page_index idx;  // confidence per page, only with spare
+	struct manifest mf;
+	int first;
+	size_t write_size;
+	unsigned char keys[PAGES_PER_BLOCK][SECTOR_SIZE];
+	int have_key[PAGES_PER_BLOCK];
+	unsigned long clean, corrected, erased, uncorrectable, unchecked, reread, still_bad, weak, skipped;
+	pthread_mutex_t lock;
+	pthread_cond_t worker_cond;
+	pthread_cond_t bus_cond;
+};
 
-    // read first complete page
-    uBusWidth read_dat[PAGE_SIZE] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}; // check values
-    FlashParameter fpar = {0};
-    ReturnMsg rtMsg = Flash_Success;
+static void check_slot(struct page_reader *r, struct read_slot *slot) {
+	unsigned char sector[SECTOR_SIZE];
+	unsigned char *raw;
+	const unsigned char *key = r->keys[slot->page % PAGES_PER_BLOCK];
+	int s, i, res, flips;
+
+	slot->bad = 0;
+	if (slot->skip)
+		return;
+	if (!r->check || !r->have_key[slot->page % PAGES_PER_BLOCK]) {
+		r->unchecked += ECC_SECTORS;
+		return;
+	}
+	for (s = 0; s < ECC_SECTORS; s++) {
+		// passed before this re-read, buf holds it descrambled if it is to be
+		if (slot->done & 1 << s)
+			continue;
+		raw = slot->buf + s * SECTOR_SIZE;
+		if (erased_sector(raw)) {
+			// erased, never scrambled
+			if (slot->rereads == 0)
+				r->erased++;
+			continue;
+		}
+		for (i = 0; i < SECTOR_SIZE; i++)
+			sector[i] = raw[i] ^ key[i];
+		res = ecc_check_sector(sector, r->descramble, &flips);
+		// many flips are worth another read while there is one left,
+		// after the last the correction stands
+		if (res == ECC_UNCORRECTABLE ||
+		    (res == ECC_CORRECTED && flips > REREAD_BITFLIPS && slot->rereads < MAX_REREADS)) {
+			slot->bad |= 1 << s;
+		} else {
+			if (r->descramble)
+				memcpy(raw, sector, SECTOR_SIZE);
+			slot->done |= 1 << s;
+			slot->flips += flips;
+			if (res == ECC_CORRECTED && flips > REREAD_BITFLIPS)
+				slot->weak |= 1 << s;
+			if (res == ECC_CORRECTED || slot->status == ECC_ERASED)
+				slot->status = res;
+		}
+		if (slot->rereads > 0)
+			continue;
+		if (res == ECC_UNCORRECTABLE)
+			r->uncorrectable++;
+		else if (res == ECC_CORRECTED)
+			r->corrected++;
+		else
+			r->clean++;
+	}
 
-	FILE *f = fopen(outfile, "w+");
-	if (f == NULL) {
+	if (r->clean + r->corrected == 0 && r->uncorrectable >= ECC_PROBE_SECTORS) {
+		printf("\nNo sector passed the ECC check, wrong keys in " XOR_DIR "? Reading on without the check\n");
+		r->check = 0;
+		slot->bad = 0;
+	}
+}
+
+// the sectors check_slot() left, XORed only; called once the slot is final
+static void descramble_slot(struct page_reader *r, struct read_slot *slot) {
+	unsigned char *raw;
+	const unsigned char *key = r->keys[slot->page % PAGES_PER_BLOCK];
+	int s, i;
+
+	if (slot->skip || !r->have_key[slot->page % PAGES_PER_BLOCK])
+		return;
+	for (s = 0; s < ECC_SECTORS; s++) {
+		raw = slot->buf + s * SECTOR_SIZE;
+		if (slot->done & 1 << s || erased_sector(raw))
+			continue;
+		for (i = 0; i < SECTOR_SIZE; i++)
+			raw[i] ^= key[i];
+	}
+	memset(slot->buf + ECC_SECTORS * SECTOR_SIZE, 0xFF, SECTOR_SIZE);
+}
+
+static void *page_writer(void *arg) {
+	struct page_reader *r = (struct page_reader *)arg;
+	struct read_slot *slot;
+	struct page_record *rec;
+	int i, n;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->written < r->total && !r->failed) {
+		// any page waiting for a check, oldest first
+		for (slot = NULL, n = 0; n < r->used; n++) {
+			i = (r->head + n) % READ_SLOTS;
+			if (r->slots[i].state == SLOT_READ) {
+				slot = &r->slots[i];
+				break;
+			}
+		}
+		if (slot == NULL) {
+			pthread_cond_wait(&r->worker_cond, &r->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&r->lock);
+		check_slot(r, slot);
+		pthread_mutex_lock(&r->lock);
+		if (slot->bad && slot->rereads < MAX_REREADS) {
+			slot->state = SLOT_REREAD;
+			pthread_cond_signal(&r->bus_cond);
+			continue;
+		}
+		if (slot->bad) {
+			r->still_bad++;
+			fprintf(r->badlog, "page %d: sectors 0x%x fail ECC after %d re-reads\n", slot->page, slot->bad, slot->rereads);
+		}
+		if (slot->weak) {
+			r->weak++;
+			fprintf(r->badlog, "page %d: sectors 0x%x corrected after %d re-reads, %d flips in the page\n",
+			    slot->page, slot->weak, slot->rereads, slot->flips);
+		}
+		// every re-read it took costs confidence, a page that never passed gets the least
+		if (r->idx.hdr != NULL && r->check && r->have_key[slot->page % PAGES_PER_BLOCK] && !slot->skip) {
+			rec = &r->idx.page[slot->page - r->first];
+			rec->confidence = slot->bad ? 1 : 255 - 64 * slot->rereads;
+			rec->ecc_status = slot->bad ? ECC_UNCORRECTABLE : slot->status;
+			rec->bitflips = slot->flips > 255 ? 255 : slot->flips;
+			rec->flags |= IDX_ECC_CHECKED;
+		}
+		if (r->descramble)
+			descramble_slot(r, slot);
+		slot->state = SLOT_DONE;
+
+		// write what is done, in page order
+		while (r->used > 0 && r->slots[r->head].state == SLOT_DONE) {
+			slot = &r->slots[r->head];
+			pthread_mutex_unlock(&r->lock);
+			if (r->mf.page != NULL)
+				r->mf.page[slot->page - r->first] = hash64(slot->buf, r->write_size, 0);
+			if (r->archive)
+				n = archive_write_page(&r->ar, slot->buf) == 0;
+			else if (r->stream)
+				n = stream_write_page(&r->sw, slot->buf) == 0;
+			else
+				n = fwrite(slot->buf, r->write_size, 1, r->out);
+			pthread_mutex_lock(&r->lock);
+			if (n != 1) {
+				if (!r->archive && !r->stream)
+					perror("fwrite");
+				r->failed = 1;
+				break;
+			}
+			slot->state = SLOT_FREE;
+			r->head = (r->head + 1) % READ_SLOTS;
+			r->used--;
+			r->written++;
+			pthread_cond_signal(&r->bus_cond);
+		}
+	}
+	pthread_cond_signal(&r->bus_cond);
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static int close_output(struct page_reader *r) {
+	if (r->archive)
+		return archive_finish(&r->ar);
+	if (r->stream && r->failed) {
+		// no end frame, receive knows the stream was cut short
+		stream_free(&r->sw);
+		return -1;
+	}
+	if (r->stream)
+		return stream_finish(&r->sw);
+	return fclose(r->out) == 0 ? 0 : -1;
+}
+
+int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare, int descramble) {
+
+	static struct page_reader reader;
+	struct page_reader *r = &reader;
+	struct read_slot *slot;
+	pthread_t writer;
+	struct rand_model model;
+	int page, page_nbr, percent, mod, keys, have_model, i, n;
+	size_t len;
+	unsigned char id[8];
+	FlashOp op;
+	ReturnMsg rtMsg;
+
+	memset(r, 0, sizeof(*r));
+	r->total = number_of_pages;
+	r->write_size = write_spare ? PAGE_SIZE : 512 * (PAGE_SIZE / 512);
+	len = strlen(outfile);
+	r->archive = len >= strlen(ARCHIVE_SUFFIX) && strcmp(outfile + len - strlen(ARCHIVE_SUFFIX), ARCHIVE_SUFFIX) == 0;
+	r->stream = strcmp(outfile, STREAM_STDOUT) == 0;
+	if (r->stream) {
+		if (stream_fd < 0) {
+			printf("Only read_full and read_data stream to stdout\n");
+			return -1;
+		}
+		memset(id, 0, sizeof(id));
+		if (read_id(id) < 0 || stream_open(&r->sw, stream_fd, id, first_page_number, number_of_pages, r->write_size) < 0)
+			return -1;
+		stream_fd = -1;
+	} else if (r->archive) {
+		if (!write_spare) {
+			printf("An archive holds whole pages, use read_full\n");
+			return -1;
+		}
+		// the archive header keeps which chip this came from
+		memset(id, 0, sizeof(id));
+		if (read_id(id) < 0 || archive_create(&r->ar, outfile, id, first_page_number) < 0)
+			return -1;
+	} else if ((r->out = fopen(outfile, "w+")) == NULL) {
 		perror("fopen output file");
 		return -1;
 	}
-	
+	if ((r->badlog = fopen("bad.log", "w+")) == NULL) {
+		perror("fopen bad.log");
+		r->failed = 1;
+		close_output(r);
+		return -1;
+	}
+
+	have_model = rand_load(&model, XOR_DIR) == 0;
+	for (mod = 0, keys = 0; mod < PAGES_PER_BLOCK; mod++) {
+		r->have_key[mod] = load_xor_key(NULL, mod, XOR_DIR, have_model ? &model : NULL, r->keys[mod]) != XOR_KEY_NONE;
+		keys += r->have_key[mod];
+	}
+	if (descramble && keys == 0) {
+		printf("No keys in " XOR_DIR " to descramble with (run xor_keys on a dump first)\n");
+		fclose(r->badlog);
+		r->failed = 1;
+		close_output(r);
+		return -1;
+	}
+	r->check = keys > 0 && ecc_init() == 0;
+	r->descramble = descramble;
+	if (r->check)
+		printf("ECC check on, %d of %d keys in " XOR_DIR "%s\n", keys, PAGES_PER_BLOCK,
+		    descramble ? ", writing the pages descrambled" : "");
+	else
+		printf("No keys in " XOR_DIR ", reading without ECC check (run xor_keys on a dump first)\n");
+	r->first = first_page_number;
+	if (!r->stream && manifest_alloc(&r->mf, number_of_pages, r->write_size) < 0)
+		printf("No manifest for %s, reading on without\n", outfile);
+	if (r->check && write_spare && !r->stream && index_open(&r->idx, outfile, number_of_pages) < 0)
+		printf("No page index for %s, reading on without\n", outfile);
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->worker_cond, NULL);
+	pthread_cond_init(&r->bus_cond, NULL);
+	if (pthread_create(&writer, NULL, page_writer, r) != 0) {
+		perror("pthread_create");
+		fclose(r->badlog);
+		r->failed = 1;
+		close_output(r);
+		index_close(&r->idx);
+		manifest_free(&r->mf);
+		return -1;
+	}
+
 	printf("\nStart reading...\n\n");
 	clock_t start = clock();
 
-    for (page = 0; page < number_of_pages; page ++) {
-        /* Read data */
-        fpar.Array = read_dat;
-        fpar.Address = page * PAGE_SIZE; //??
-        fpar.Length = PAGE_SIZE;
+	page = first_page_number;
+	pthread_mutex_lock(&r->lock);
+	while (r->written < r->total && !r->failed) {
+		// re-reads first, the writer is held up by them
+		for (slot = NULL, n = 0; n < r->used; n++) {
+			i = (r->head + n) % READ_SLOTS;
+			if (r->slots[i].state == SLOT_REREAD) {
+				slot = &r->slots[i];
+				break;
+			}
+		}
 
-        /* before */
-        
-        printf("Prefilled data (6 bytes): ");
-        for (i = 0; i < 6; i++)
-            printf("0x%02X ", fpar.Array[i]);
-        printf("\n");
-        
-        // can only read 1 page at a time like this, rest as ReadRandomPage
-        if (page == 0) {
-            rtMsg = ReadPageOP( fpar.Address, fpar.Array, fpar.Length );
-        } else {
-            rtMsg = ReadRandomPageOP( fpar.Address, fpar.Array, fpar.Length );
-        }
-        printf("Result %d\n\n", rtMsg);
+		memset(&op, 0, sizeof(op));
+		op.Chip = 0;
+		if (slot != NULL) {
+			op.Type = Op_ReadSectors;
+			op.Page = slot->page;
+			op.DataBuf = slot->buf;
+			op.Sectors = slot->bad;
+			r->reread += __builtin_popcount(slot->bad);
+		} else if (page < first_page_number + number_of_pages && r->used < READ_SLOTS) {
+			slot = &r->slots[(r->head + r->used) % READ_SLOTS];
+			slot->page = page++;
+			slot->rereads = 0;
+			slot->done = slot->weak = 0;
+			slot->status = ECC_ERASED;
+			slot->flips = 0;
+			r->used++;
+			if ((slot->skip = block_is_bad(&bbt, slot->page / PAGES_PER_BLOCK))) {
+				if (slot->page % PAGES_PER_BLOCK == 0 || slot->page == first_page_number)
+					fprintf(r->badlog, "block %d: bad in " BBT_FILE ", not read\n", slot->page / PAGES_PER_BLOCK);
+				memset(slot->buf, 0xFF, PAGE_SIZE);
+				slot->state = SLOT_READ;
+				r->skipped++;
+				pthread_cond_signal(&r->worker_cond);
+				continue;
+			}
+			op.Type = Op_ReadPage;
+			op.Page = slot->page;
+			op.DataBuf = slot->buf;
+			op.Length = PAGE_SIZE;
+		} else {
+			pthread_cond_wait(&r->bus_cond, &r->lock);
+			continue;
+		}
 
-        // ok?
-        if (rtMsg != (ReturnMsg)Flash_Success )  return 1;
-        
-        printf("Returned data (6 bytes):  ");
-        for (i = 0; i < 6; i++)
-            printf("0x%02X ", fpar.Array[i]);
+		// the writer leaves slots in SLOT_FREE and SLOT_REREAD alone
+		pthread_mutex_unlock(&r->lock);
+		rtMsg = WaitOP(&op);
+		pthread_mutex_lock(&r->lock);
+		if (rtMsg != Flash_Success) {
+			printf("\nReading page %lu failed (%d)\n", op.Page, rtMsg);
+			r->failed = 1;
+			break;
+		}
+		if (op.Type == Op_ReadSectors)
+			slot->rereads++;
+		slot->state = SLOT_READ;
+		pthread_cond_signal(&r->worker_cond);
+
+		if (op.Type == Op_ReadPage) {
+			page_nbr = page - first_page_number;
+			if (page_nbr % 64 == 0 || page_nbr == number_of_pages) {
+				percent = (100 * page_nbr) / number_of_pages;
+				printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\r", page - 1, (page - 1) / 64, page_nbr, number_of_pages, percent);
+				fflush(stdout);
+			}
+		}
+	}
+	pthread_cond_signal(&r->worker_cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(writer, NULL);
 
-        printf("\n");
-        
+	clock_t end = clock();
+	printf("\n\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	if (keys > 0)
+		printf("ECC: %lu clean, %lu corrected, %lu erased, %lu failed on first read, %lu unchecked sectors;\n"
+		    "     %lu sectors re-read, %lu pages still failing, %lu corrected with more than %d flips (see bad.log)\n",
+		    r->clean, r->corrected, r->erased, r->uncorrectable, r->unchecked, r->reread, r->still_bad,
+		    r->weak, REREAD_BITFLIPS);
+	if (r->skipped)
+		printf("%lu pages in bad blocks not read, 0xFF in %s\n", r->skipped, r->stream ? "the stream" : outfile);
+
+	fclose(r->badlog);
+	if (close_output(r) < 0)
+		r->failed = 1;
+	// hashes of what is in the file, stamped after it is closed
+	if (r->mf.page != NULL && !r->failed) {
+		manifest_blocks(&r->mf);
+		if (manifest_write(&r->mf, outfile) == 0)
+			printf("Page and block hashes in %s.mf\n", outfile);
+	}
+	manifest_free(&r->mf);
+	index_close(&r->idx);
+	fflush(NULL);
+	return r->failed ? -1 : 0;
+}
 
-        // write data
-        if (fwrite(fpar.Array, sizeof(read_dat), 1, f) != 1) {
-            perror("fwrite");
-            return -1;
-        }
-    }
+// read_partition: one partition, found by the GPT on the chip
+//
+// brhgptpl_0 (pages 0 .. 63) starts with the preloader header, BOOTLOADER!,
+// and holds the GPT from page 3 on. Its first GPT_PAGES pages are read,
+// descrambled with the keys in XOR_DIR and ECC corrected, enough for the
+// header and 128 entries. If that copy does not read clean the ones in
+// brhgptpl_1 .. 3 are tried, then the built-in table. Only the partition's
+// pages are then read, by read_pages().
+
+#define GPT_PAGES  16
+#define CHIP_PAGES (FLASH_SIZE / 4096)
+
+static const unsigned int gpt_copies[] = { 0x0, 0x400, 0x800, 0xC00 }; // brhgptpl_0 .. 3
+
+// GPT_PAGES pages from <first> into buf, descrambled and corrected; sectors that fail ECC
+static int read_gpt_pages(unsigned int first, unsigned char *buf, unsigned char keys[][SECTOR_SIZE], int ecc) {
+	unsigned char *sector;
+	unsigned int page;
+	int s, i, flips, bad = 0;
+	FlashOp op;
+	ReturnMsg rtMsg;
+
+	for (page = 0; page < GPT_PAGES; page++) {
+		memset(&op, 0, sizeof(op));
+		op.Chip = 0;
+		op.Type = Op_ReadPage;
+		op.Page = first + page;
+		op.DataBuf = buf + page * PAGE_SIZE;
+		op.Length = PAGE_SIZE;
+		if ((rtMsg = WaitOP(&op)) != Flash_Success) {
+			printf("Reading page %lu failed (%d)\n", op.Page, rtMsg);
+			return -1;
+		}
+		for (s = 0; s < ECC_SECTORS; s++) {
+			sector = op.DataBuf + s * SECTOR_SIZE;
+			if (erased_sector(sector))
+				continue;
+			for (i = 0; i < SECTOR_SIZE; i++)
+				sector[i] ^= keys[(first + page) % PAGES_PER_BLOCK][i];
+			if (ecc && ecc_check_sector(sector, 1, &flips) == ECC_UNCORRECTABLE)
+				bad++;
+		}
+		memset(op.DataBuf + ECC_SECTORS * SECTOR_SIZE, 0xFF, SECTOR_SIZE);
+	}
+	return bad;
+}
 
-	clock_t end = clock();
-	printf("\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
-	
+// the partitions from the GPT on the chip, else the built-in table; -1 if out of memory or a read fails
+static int chip_partitions(struct partition *parts) {
+	struct dump_image gpt;
+	unsigned char keys[PAGES_PER_BLOCK][SECTOR_SIZE];
+	struct rand_model model;
+	unsigned int c;
+	int mod, ecc, bad, have_model, n = 0;
+
+	have_model = rand_load(&model, XOR_DIR) == 0;
+	for (mod = 0; mod < GPT_PAGES; mod++)
+		if (load_xor_key(NULL, mod, XOR_DIR, have_model ? &model : NULL, keys[mod]) == XOR_KEY_NONE)
+			break;
+	memset(&gpt, 0, sizeof(gpt));
+	gpt.fd = -1;
+	if (mod < GPT_PAGES) {
+		printf("No key for page %d in " XOR_DIR ", can not read the GPT (run xor_keys on a dump first)\n", mod);
+	} else if ((gpt.data = (unsigned char *)malloc(GPT_PAGES * PAGE_SIZE)) == NULL) {
+		perror("malloc");
+		return -1;
+	} else {
+		gpt.pages = GPT_PAGES;
+		gpt.size = GPT_PAGES * PAGE_SIZE;
+		if (!(ecc = ecc_init() == 0))
+			printf("No ECC, the GPT pages are only descrambled\n");
+		for (c = 0; c < sizeof(gpt_copies) / sizeof(gpt_copies[0]) && n == 0; c++) {
+			if (block_is_bad(&bbt, gpt_copies[c] / PAGES_PER_BLOCK))
+				continue;
+			printf("Reading the GPT in pages %u .. %u\n", gpt_copies[c], gpt_copies[c] + GPT_PAGES - 1);
+			if ((bad = read_gpt_pages(gpt_copies[c], gpt.data, keys, ecc)) < 0) {
+				free(gpt.data);
+				return -1;
+			}
+			if (memcmp(gpt.data, "BOOTLOADER!", 11) != 0)
+				printf("No preloader header in page %u, wrong keys?\n", gpt_copies[c]);
+			if (bad > 0)
+				printf("%d sectors fail ECC\n", bad);
+			else
+				n = read_gpt(&gpt, parts, MAX_PARTITIONS, CHIP_PAGES);
+		}
+		free(gpt.data);
+		gpt.pages = 0;
+	}
+	if (n == 0) {
+		// read_partitions() of nothing is the built-in table
+		printf("Using the built-in partition table\n");
+		n = read_partitions(&gpt, parts, MAX_PARTITIONS);
+	}
+	return n;
+}
 
-	fflush(NULL);
-	exit(0);
+int read_partition(char *name, char *outfile, int descramble) {
+	struct partition parts[MAX_PARTITIONS];
+	int p, n;
+
+	if ((n = chip_partitions(parts)) < 0)
+		return -1;
+	for (p = 0; p < n && strcmp(parts[p].name, name) != 0; p++)
+		;
+	if (p == n) {
+		printf("No partition '%s', there are:", name);
+		for (p = 0; p < n; p++)
+			printf(" %s", parts[p].name);
+		printf("\n");
+		return -1;
+	}
+	printf("%s: pages %u .. %u, %u blocks\n", name, parts[p].first_page, parts[p].first_page + parts[p].pages - 1,
+	    (parts[p].pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK);
+	return read_pages(parts[p].first_page, parts[p].pages, outfile, 1, descramble);
+}
+
+// read_live: every partition to <dir>/<name>.bin in one pass, see live.c
+static int live_chip_read(void *ctx, unsigned int page, unsigned char *buf) {
+	FlashOp op;
+	ReturnMsg rtMsg;
+
+	(void)ctx;
+	memset(&op, 0, sizeof(op));
+	op.Chip = 0;
+	op.Type = Op_ReadPage;
+	op.Page = page;
+	op.DataBuf = buf;
+	op.Length = PAGE_SIZE;
+	if ((rtMsg = WaitOP(&op)) != Flash_Success) {
+		printf("\nReading page %lu failed (%d)\n", op.Page, rtMsg);
+		return -1;
+	}
+	return 0;
+}
+
+int read_live(char *outdir, char *dumpfile) {
+	struct partition parts[MAX_PARTITIONS];
+	struct live_source src;
+	unsigned int blocks = 0, end;
+	int p, n;
+
+	if ((n = chip_partitions(parts)) < 0)
+		return -1;
+	// a dump is of the whole chip, without one the blocks after the last partition are not read
+	for (p = 0; p < n; p++) {
+		end = (parts[p].first_page + parts[p].pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+		if (end > blocks)
+			blocks = end;
+	}
+	if (dumpfile != NULL || blocks > CHIP_BLOCKS)
+		blocks = CHIP_BLOCKS;
+	src.read = live_chip_read;
+	src.ctx = NULL;
+	return live_dump(parts, n, blocks, &src, &bbt, outdir, dumpfile);
 }
 
 
@@ -1277,6 +2418,13 @@ int write_pages(int first_page_number, int number_of_pages, char *infile) {
 		perror("fopen input file");
 		return -1;
 	}
+	// page n of the file goes to chip page n, a short file would program stale buffers
+	if (fseek(f, 0, SEEK_END) != 0 || ftell(f) < (long)(first_page_number + number_of_pages) * PAGE_SIZE) {
+		printf("%s ends before page %d, nothing written (page n of the file is chip page n)\n",
+		    infile, first_page_number + number_of_pages);
+		fclose(f);
+		return -1;
+	}
 
 	// printf("first_page_number = %d\n", first_page_number);
 	// printf("number of pages = %d\n", number_of_pages);
@@ -1284,6 +2432,12 @@ int write_pages(int first_page_number, int number_of_pages, char *infile) {
 
 	for (retry_count = 0, page = first_page_number; page < first_page_number + number_of_pages; page++) {
 
+		if (block_is_bad(&bbt, page / PAGES_PER_BLOCK)) {
+			printf("\nBlock %d is bad, not written\n", page / PAGES_PER_BLOCK);
+			page |= PAGES_PER_BLOCK - 1;
+			continue;
+		}
+
 	  retry_all:
 
 		if (retry_count == 0) {
@@ -1295,8 +2449,11 @@ int write_pages(int first_page_number, int number_of_pages, char *infile) {
 			fflush(stdout);
 		}
 
-		fseek(f, page * PAGE_SIZE, SEEK_SET);
-		fread(buf, PAGE_SIZE, 1, f);
+		if (fseek(f, (long)page * PAGE_SIZE, SEEK_SET) != 0 || fread(buf, PAGE_SIZE, 1, f) != 1) {
+			printf("\nReading page %d of %s failed, stopped\n", page, infile);
+			fclose(f);
+			return -1;
+		}
 
 		// printf("\nwriting page n°%d\n", page);
 
@@ -1308,10 +2465,7 @@ int write_pages(int first_page_number, int number_of_pages, char *infile) {
 		}
 
 		send_write_command(page, buf);
-		while (GPIO_READ(READY_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
-		}
+		WaitFlashReady(0);
 		// read_status();
 		if (read_status()) {
 			if (retry_count == 0) printf("\n");
@@ -1348,6 +2502,12 @@ int erase_blocks(int first_block_number, int number_of_blocks) {
 
 	for (retry_count = 0, block = first_block_number; block < (first_block_number + number_of_blocks); block++) {
 
+		// an erase would wipe the factory marker too
+		if (block_is_bad(&bbt, block)) {
+			printf("\nBlock %d is bad, not erased\n", block);
+			continue;
+		}
+
 	  retry_all:
 			
 		block_nbr = block - first_block_number + 1;
@@ -1367,10 +2527,7 @@ int erase_blocks(int first_block_number, int number_of_blocks) {
 		}
 
 		send_eraseblock_command(block * 64); // 64 = pages per block
-		while (GPIO_READ(READY_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
-		}
+		WaitFlashReady(0);
 
 		if (read_status()) {
 			if (retry_count == 0) printf("\n");
@@ -1390,3 +2547,178 @@ int erase_blocks(int first_block_number, int number_of_blocks) {
 	return 0;
 }
 
+/*
+ * Interleaved read of the same page range from several chips sharing the bus.
+ * Every chip gets its own asynchronous read operation and output file
+ * <outprefix>_ce<chip>.bin. RunFlashOps starts a read on every idle chip and,
+ * while chips sit in tR, clocks data out of whichever chip became ready first.
+ */
+struct chip_reader {
+	FlashOp op;
+	FILE *out;
+	int end_page;
+	int retries;
+	unsigned char buf[PAGE_SIZE];
+};
+
+static int chip_pages_read, chip_pages_total, chip_write_failed;
+
+// BBT_FILE is about chip 0: the pages of its bad blocks go out as 0xFF, unread
+static int skip_bad_pages(struct chip_reader *r) {
+	while (r->op.Chip == 0 && (int)r->op.Page < r->end_page && block_is_bad(&bbt, r->op.Page / PAGES_PER_BLOCK)) {
+		memset(r->buf, 0xFF, PAGE_SIZE);
+		if (fwrite(r->buf, PAGE_SIZE, 1, r->out) != 1) {
+			perror("fwrite");
+			chip_write_failed = 1;
+			return -1;
+		}
+		chip_pages_read++;
+		r->op.Page++;
+	}
+	return 0;
+}
+
+static void chip_read_done(FlashOp *op) {
+	struct chip_reader *r = (struct chip_reader *)op->Context;
+
+	if (op->Result == Flash_OperationTimeOut) {
+		if (r->retries++ < 5) {
+			printf("\nChip %d stuck busy on page %lu, retrying\n", op->Chip, op->Page);
+			op->State = OpState_Idle;
+			return;
+		}
+		printf("\nChip %d: too many retries on page %lu, writing 0xFF\n", op->Chip, op->Page);
+		memset(r->buf, 0xFF, PAGE_SIZE);
+	}
+
+	if (fwrite(r->buf, PAGE_SIZE, 1, r->out) != 1) {
+		perror("fwrite");
+		chip_write_failed = 1;
+		return;
+	}
+	r->retries = 0;
+	chip_pages_read++;
+	if (chip_pages_read % 64 == 0 || chip_pages_read == chip_pages_total) {
+		printf("Read %d of %d pages, %d%%\r", chip_pages_read, chip_pages_total,
+			(100 * chip_pages_read) / chip_pages_total);
+		fflush(stdout);
+	}
+
+	// chain the next page on this chip
+	op->Page++;
+	if (skip_bad_pages(r) == 0 && (int)op->Page < r->end_page)
+		op->State = OpState_Idle;
+}
+
+int read_chips(int chips, int first_page_number, int number_of_pages, char *outprefix) {
+
+	static struct chip_reader reader[MAX_CHIPS];
+	FlashOp *ops[MAX_CHIPS];
+	unsigned char id[6];
+	char filename[256];
+	clock_t start, end;
+	int chip, i, opened = 0, ret = -1;
+
+	if (chips < 1 || chips > bus->max_chips) {
+		printf("# of chips must be 1 .. %d on the %s bus\n", bus->max_chips, bus->name);
+		return -1;
+	}
+
+	chip_pages_read = chip_write_failed = 0;
+	chip_pages_total = chips * number_of_pages;
+
+	// bring up the CE# and R/B# lines of the extra chips
+	chip_count = chips;
+	InitFlash();
+	SelectChip(-1);
+
+	for (chip = 0; chip < chips; chip++) {
+		struct chip_reader *r = &reader[chip];
+
+		SelectChip(chip);
+		if (read_id(id) < 0) {
+			SelectChip(-1);
+			goto out;
+		}
+		SelectChip(-1);
+		printf("Chip %d ID: ", chip);
+		for (i = 0; i < 6; i++)
+			printf("0x%02X ", id[i]);
+		printf("\n");
+
+		snprintf(filename, sizeof(filename), "%s_ce%d.bin", outprefix, chip);
+		if ((r->out = fopen(filename, "w+")) == NULL) {
+			perror("fopen output file");
+			goto out;
+		}
+		opened++;
+		memset(&r->op, 0, sizeof(r->op));
+		r->op.Type = Op_ReadPage;
+		r->op.Chip = chip;
+		r->op.Page = first_page_number;
+		r->op.DataBuf = r->buf;
+		r->op.Length = PAGE_SIZE;
+		r->op.State = OpState_Idle;
+		r->op.Callback = chip_read_done;
+		r->op.Context = r;
+		r->end_page = first_page_number + number_of_pages;
+		r->retries = 0;
+		ops[chip] = &r->op;
+		if (skip_bad_pages(r) < 0)
+			goto out;
+		if ((int)r->op.Page >= r->end_page)
+			r->op.State = OpState_Done;
+	}
+
+	printf("\nStart reading %d pages from %d chips...\n\n", number_of_pages, chips);
+	start = clock();
+
+	RunFlashOps(ops, chips, NULL, NULL);
+
+	end = clock();
+	if (!chip_write_failed) {
+		printf("\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+		ret = 0;
+	}
+out:
+	// the files of the chips set up so far, also when a later one failed
+	for (chip = 0; chip < opened; chip++)
+		fclose(reader[chip].out);
+	return ret;
+}
+
+// read_bbt: bbt_build() on the chip, 8 page reads for the table and its
+// mirror and sector 3 of pages 0 and 1 of every block for the markers
+static int bbt_chip_read(void *ctx, unsigned int page, unsigned int sectors, unsigned char *buf) {
+	FlashOp op;
+	ReturnMsg rtMsg;
+
+	(void)ctx;
+	memset(&op, 0, sizeof(op));
+	op.Chip = 0;
+	op.Type = Op_ReadSectors;
+	op.Page = page;
+	op.DataBuf = buf;
+	op.Sectors = sectors;
+	if ((rtMsg = WaitOP(&op)) != Flash_Success) {
+		printf("\nReading page %lu failed (%d)\n", op.Page, rtMsg);
+		return -1;
+	}
+	return 0;
+}
+
+int read_bbt(void) {
+	struct bbt_reader rd;
+	double start = wall_clock();
+
+	rd.read = bbt_chip_read;
+	rd.ctx = NULL;
+	rd.blocks = CHIP_BLOCKS;
+	if (bbt_build(&bbt, &rd, NULL, XOR_DIR) < 0)
+		return -1;
+	bbt_print(&bbt);
+	if (bbt_save(&bbt) < 0)
+		return -1;
+	printf("Written to " BBT_FILE " in %.1f s\n", wall_clock() - start);
+	return 0;
+}
@@ -0,0 +1,253 @@
+/*
+    scan command for rpi-raw-nand
+
+    Finds the known signatures in a (descrambled) dump in one pass over
+    the mapped file, where dumpreader.js runs findBinSeq() once per
+    pattern:
+
+        squashfs    hsqs            SquashFS superblock
+        ubi_ec      UBI#            UBI erase counter header
+        ubi_vid     UBI!            UBI volume id header
+        android     ANDROID!        boot image
+        brhgptpl    BOOTLOADER!     NAND preloader header
+        gpt         EFI PART        GPT header
+
+    32 positions at a time, each signature's first and last byte are
+    compared against the data at the position and len - 1 past it; only
+    where both match is the whole signature compared. A wrong position
+    passes that filter 1 in 65536 times.
+
+    The file is scanned one block per item on all cores. A block looks
+    up to SCAN_MAX_LEN - 1 bytes into the next one, so a signature across
+    the border is found, by the block it starts in only. Hits go to a JSON
+    file with file offset, page, sector, offset in the sector and the
+    partition the page belongs to.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "nand_dump.h"
+
+#define SCAN_MAX_LEN 16 // no signature is longer
+
+typedef unsigned char scan_vec __attribute__((vector_size(32)));
+
+static const struct {
+	const char *name;
+	const char *magic;
+	int len;
+} signatures[] = {
+	{ "squashfs", "hsqs", 4 },
+	{ "ubi_ec", "UBI#", 4 },
+	{ "ubi_vid", "UBI!", 4 },
+	{ "android", "ANDROID!", 8 },
+	{ "brhgptpl", "BOOTLOADER!", 11 },
+	{ "gpt", "EFI PART", 8 },
+};
+
+#define SIGNATURES (int)(sizeof(signatures) / sizeof(signatures[0]))
+
+struct scan_hit {
+	size_t offset;
+	int sig;
+};
+
+// per worker, no locking
+struct scan_hits {
+	struct scan_hit *hit;
+	size_t count, alloc;
+};
+
+struct scan_job {
+	const struct dump_image *img;
+	struct scan_hits found[MAX_WORKERS];
+	int failed;
+};
+
+static void add_hit(struct scan_job *job, int worker, size_t offset, int sig) {
+	struct scan_hits *h = &job->found[worker];
+	struct scan_hit *grown;
+
+	if (h->count == h->alloc) {
+		h->alloc = h->alloc ? 2 * h->alloc : 1024;
+		if ((grown = (struct scan_hit *)realloc(h->hit, h->alloc * sizeof(*grown))) == NULL) {
+			perror("realloc");
+			job->failed = 1;
+			h->alloc = h->count;
+			return;
+		}
+		h->hit = grown;
+	}
+	h->hit[h->count].offset = offset;
+	h->hit[h->count].sig = sig;
+	h->count++;
+}
+
+static int any_lane(scan_vec v) {
+	uint64_t w[sizeof(scan_vec) / 8];
+	unsigned int i;
+
+	memcpy(w, &v, sizeof(w));
+	for (i = 1; i < sizeof(w) / 8; i++)
+		w[0] |= w[i];
+	return w[0] != 0;
+}
+
+static void scan_block(void *ctx, unsigned long block, int worker) {
+	struct scan_job *job = (struct scan_job *)ctx;
+	const unsigned char *data = job->img->data;
+	size_t size = job->img->size, pos = block * BLOCK_SIZE, end = pos + BLOCK_SIZE;
+	scan_vec head, tail, first[SIGNATURES], last[SIGNATURES], match[SIGNATURES], any;
+	unsigned int lane;
+	int s;
+
+	if (end > size)
+		end = size;
+	// on the stack, calloc() does not align the job for vectors
+	for (s = 0; s < SIGNATURES; s++) {
+		first[s] = (scan_vec){ 0 } + (unsigned char)signatures[s].magic[0];
+		last[s] = (scan_vec){ 0 } + (unsigned char)signatures[s].magic[signatures[s].len - 1];
+	}
+	// whole vectors while the tail loads stay inside the file
+	for (; pos < end && pos + sizeof(scan_vec) + SCAN_MAX_LEN - 1 <= size; pos += sizeof(scan_vec)) {
+		memcpy(&head, data + pos, sizeof(head));
+		any = (scan_vec){ 0 };
+		for (s = 0; s < SIGNATURES; s++) {
+			memcpy(&tail, data + pos + signatures[s].len - 1, sizeof(tail));
+			match[s] = (scan_vec)((head == first[s]) & (tail == last[s]));
+			any |= match[s];
+		}
+		if (!any_lane(any))
+			continue;
+		for (s = 0; s < SIGNATURES; s++)
+			for (lane = 0; lane < sizeof(scan_vec); lane++)
+				// lanes past the end belong to the next block
+				if (match[s][lane] && pos + lane < end &&
+				    memcmp(data + pos + lane, signatures[s].magic, signatures[s].len) == 0)
+					add_hit(job, worker, pos + lane, s);
+	}
+	// the last bytes of the file
+	for (; pos < end; pos++)
+		for (s = 0; s < SIGNATURES; s++)
+			if (pos + signatures[s].len <= size && memcmp(data + pos, signatures[s].magic, signatures[s].len) == 0)
+				add_hit(job, worker, pos, s);
+}
+
+static int hit_order(const void *a, const void *b) {
+	const struct scan_hit *x = (const struct scan_hit *)a, *y = (const struct scan_hit *)b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return x->sig - y->sig;
+}
+
+static void json_string(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+int scan_dump(char *infile, char *jsonfile) {
+	struct dump_image img;
+	struct partition parts[MAX_PARTITIONS];
+	struct scan_job *job;
+	struct scan_hit *all = NULL;
+	unsigned long count[SIGNATURES];
+	size_t hits = 0, i;
+	unsigned int page;
+	double start, seconds;
+	int n, p, s, w, ret = -1;
+	FILE *fp;
+
+	if (dump_open(&img, infile) < 0)
+		return -1;
+	if ((job = (struct scan_job *)calloc(1, sizeof(*job))) == NULL) {
+		perror("calloc");
+		dump_close(&img);
+		return -1;
+	}
+	job->img = &img;
+	n = read_partitions(&img, parts, MAX_PARTITIONS);
+
+	printf("Scanning %s for %d signatures\n", infile, SIGNATURES);
+	start = wall_clock();
+	run_parallel((img.size + BLOCK_SIZE - 1) / BLOCK_SIZE, 0, scan_block, job);
+	seconds = wall_clock() - start;
+	printf("Scanned in %.2f s (%.0f MB/s)\n", seconds, seconds > 0 ? img.size / (double)(1 << 20) / seconds : 0.0);
+	if (job->failed)
+		goto out;
+
+	// the workers took blocks in any order
+	for (w = 0; w < MAX_WORKERS; w++)
+		hits += job->found[w].count;
+	if (hits && (all = (struct scan_hit *)malloc(hits * sizeof(*all))) == NULL) {
+		perror("malloc");
+		goto out;
+	}
+	for (w = 0, hits = 0; w < MAX_WORKERS; w++) {
+		if (job->found[w].count)
+			memcpy(all + hits, job->found[w].hit, job->found[w].count * sizeof(*all));
+		hits += job->found[w].count;
+	}
+	qsort(all, hits, sizeof(*all), hit_order);
+
+	if ((fp = fopen(jsonfile, "w")) == NULL) {
+		perror(jsonfile);
+		goto out;
+	}
+	memset(count, 0, sizeof(count));
+	fprintf(fp, "{\n  \"dump\": ");
+	json_string(fp, infile);
+	fprintf(fp, ",\n  \"size\": %lu,\n  \"hits\": [", (unsigned long)img.size);
+	for (i = 0; i < hits; i++) {
+		page = all[i].offset / PAGE_SIZE;
+		for (p = 0; p < n && !(page >= parts[p].first_page && page - parts[p].first_page < parts[p].pages); p++)
+			;
+		fprintf(fp, "%s\n    { \"signature\": \"%s\", \"offset\": %lu, \"page\": %u, \"sector\": %lu, \"sector_offset\": %lu, \"partition\": ",
+		    i ? "," : "", signatures[all[i].sig].name, (unsigned long)all[i].offset, page,
+		    (unsigned long)(all[i].offset % PAGE_SIZE / SECTOR_SIZE), (unsigned long)(all[i].offset % SECTOR_SIZE));
+		if (p < n) {
+			json_string(fp, parts[p].name);
+			fprintf(fp, ", \"partition_page\": %u }", page - parts[p].first_page);
+		} else {
+			fprintf(fp, "null }");
+		}
+		count[all[i].sig]++;
+	}
+	fprintf(fp, "%s],\n  \"counts\": {", hits ? "\n  " : "");
+	for (s = 0; s < SIGNATURES; s++)
+		fprintf(fp, "%s \"%s\": %lu", s ? "," : "", signatures[s].name, count[s]);
+	fprintf(fp, " }\n}\n");
+	if (fclose(fp) != 0) {
+		perror(jsonfile);
+		goto out;
+	}
+
+	for (s = 0; s < SIGNATURES; s++)
+		printf("%-10s %8lu\n", signatures[s].name, count[s]);
+	printf("%lu hits written to %s\n", (unsigned long)hits, jsonfile);
+	ret = 0;
+
+out:
+	for (w = 0; w < MAX_WORKERS; w++)
+		free(job->found[w].hit);
+	free(all);
+	free(job);
+	dump_close(&img);
+	return ret;
+}
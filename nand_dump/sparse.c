@@ -0,0 +1,212 @@
+/*
+    Android sparse images of partitions for rpi-raw-nand
+
+    partitions ... sparse writes <name>.simg: the same bytes the data export
+    writes, in the sparse format fastboot takes, so a reflash moves only
+    the data. In 4096 byte blocks:
+
+        DONT_CARE   all 0xFF, what an erased NAND page reads anyway
+        FILL        one 32 bit value repeated (the zero padding of the UBI
+                    layout, empty file system space)
+        RAW         the rest
+
+    Runs of the same kind are one chunk. The image is built one NAND block
+    (one UBI PEB) at a time into a buffer and each 4 KB checked with
+    vectors, the chunk headers are filled in once a run ends; memory use
+    is the same for any partition.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "nand_dump.h"
+
+#define SPARSE_MAGIC     0xED26FF3A
+#define SPARSE_BLOCK     4096
+#define CHUNK_RAW        0xCAC1
+#define CHUNK_FILL       0xCAC2
+#define CHUNK_DONT_CARE  0xCAC3
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version, minor_version;
+	uint16_t file_hdr_sz, chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;  // 0, not checked by fastboot
+};
+
+struct chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved;
+	uint32_t chunk_sz;        // blocks
+	uint32_t total_sz;        // bytes, header included
+};
+
+_Static_assert(sizeof(struct sparse_header) == 28, "sparse header is 28 bytes");
+_Static_assert(sizeof(struct chunk_header) == 12, "chunk header is 12 bytes");
+
+typedef uint32_t fill_vec __attribute__((vector_size(32)));
+
+struct sparse_writer {
+	int fd;
+	off_t offset;             // end of the output
+	off_t chunk_at;           // header of the open chunk
+	int type;                 // of the open chunk, 0: none
+	uint32_t fill;
+	uint32_t blocks;          // in the open chunk
+	uint32_t total_blocks, chunks;
+};
+
+// CHUNK_DONT_CARE, CHUNK_FILL with *fill set or CHUNK_RAW
+static int block_kind(const unsigned char *b, uint32_t *fill) {
+	fill_vec v, splat, diff = { 0 };
+	uint32_t w[sizeof(fill_vec) / 4];
+	unsigned int i;
+
+	memcpy(fill, b, sizeof(*fill));
+	splat = (fill_vec){ 0 } + *fill;
+	for (i = 0; i < SPARSE_BLOCK; i += sizeof(v)) {
+		memcpy(&v, b + i, sizeof(v));
+		diff |= v ^ splat;
+	}
+	memcpy(w, &diff, sizeof(w));
+	for (i = 1; i < sizeof(w) / 4; i++)
+		w[0] |= w[i];
+	if (w[0])
+		return CHUNK_RAW;
+	return *fill == 0xFFFFFFFF ? CHUNK_DONT_CARE : CHUNK_FILL;
+}
+
+static int close_chunk(struct sparse_writer *w) {
+	struct chunk_header ch;
+
+	if (w->type == 0)
+		return 0;
+	ch.chunk_type = w->type;
+	ch.reserved = 0;
+	ch.chunk_sz = w->blocks;
+	ch.total_sz = w->offset - w->chunk_at;
+	w->type = 0;
+	w->chunks++;
+	return write_all(w->fd, &ch, sizeof(ch), w->chunk_at);
+}
+
+// <blocks> blocks of one kind; data is only read for CHUNK_RAW
+static int add_run(struct sparse_writer *w, int type, uint32_t fill, const unsigned char *data, uint32_t blocks) {
+	if (w->type != type || (type == CHUNK_FILL && w->fill != fill)) {
+		if (close_chunk(w) < 0)
+			return -1;
+		w->type = type;
+		w->fill = fill;
+		w->blocks = 0;
+		w->chunk_at = w->offset;
+		w->offset += sizeof(struct chunk_header);
+		if (type == CHUNK_FILL) {
+			if (write_all(w->fd, &fill, sizeof(fill), w->offset) < 0)
+				return -1;
+			w->offset += sizeof(fill);
+		}
+	}
+	if (type == CHUNK_RAW) {
+		if (write_all(w->fd, data, (size_t)blocks * SPARSE_BLOCK, w->offset) < 0)
+			return -1;
+		w->offset += (off_t)blocks * SPARSE_BLOCK;
+	}
+	w->blocks += blocks;
+	w->total_blocks += blocks;
+	return 0;
+}
+
+// the data export of NAND block <block> of the partition into buf, its length
+static size_t image_block(const struct dump_image *img, const struct partition *part, int ubi, unsigned int block, unsigned char *buf) {
+	unsigned int page = part->first_page + block * PAGES_PER_BLOCK, p, pages;
+	size_t len = 0;
+	int s;
+
+	pages = part->pages - block * PAGES_PER_BLOCK;
+	if (pages > PAGES_PER_BLOCK)
+		pages = PAGES_PER_BLOCK;
+	for (p = 0; p < pages; p++) {
+		for (s = 0; s < 3; s++, len += SECTOR_DATA)
+			memcpy(buf + len, dump_page(img, page + p) + s * SECTOR_SIZE, SECTOR_DATA);
+		// ubiData(), as export_data() in gpt.c
+		if (ubi && p < 2) {
+			memset(buf + len, 0, 4096 - PAGE_DATA);
+			len += 4096 - PAGE_DATA;
+		}
+	}
+	if (ubi) {
+		memset(buf + len, 0, UBI_PEB_SIZE - len);
+		len = UBI_PEB_SIZE;
+	} else if (len % SPARSE_BLOCK) {
+		// only a partition cut short by the end of the dump; padded as img2simg does
+		memset(buf + len, 0, SPARSE_BLOCK - len % SPARSE_BLOCK);
+		len += SPARSE_BLOCK - len % SPARSE_BLOCK;
+	}
+	return len;
+}
+
+int export_sparse(const struct dump_image *img, int fd, const struct partition *part) {
+	struct sparse_writer w;
+	struct sparse_header hdr;
+	unsigned char *buf;
+	unsigned int block, blocks = (part->pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+	size_t len, b, run;
+	uint32_t fill, run_fill = 0;
+	int kind, run_kind = 0, ubi = is_ubi(part), ret = -1;
+
+	if ((buf = (unsigned char *)malloc(UBI_PEB_SIZE)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(&w, 0, sizeof(w));
+	w.fd = fd;
+	w.offset = sizeof(hdr);
+	for (block = 0; block < blocks; block++) {
+		len = image_block(img, part, ubi, block, buf);
+		for (b = 0, run = 0; b < len; b += SPARSE_BLOCK) {
+			kind = block_kind(buf + b, &fill);
+			if (run && (kind != run_kind || (kind == CHUNK_FILL && fill != run_fill))) {
+				if (add_run(&w, run_kind, run_fill, buf + b - run * SPARSE_BLOCK, run) < 0)
+					goto out;
+				run = 0;
+			}
+			if (run++ == 0) {
+				run_kind = kind;
+				run_fill = fill;
+			}
+		}
+		// runs go on into the next block, add_run() joins them
+		if (run && add_run(&w, run_kind, run_fill, buf + len - run * SPARSE_BLOCK, run) < 0)
+			goto out;
+	}
+	if (close_chunk(&w) < 0)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SPARSE_MAGIC;
+	hdr.major_version = 1;
+	hdr.minor_version = 0;
+	hdr.file_hdr_sz = sizeof(struct sparse_header);
+	hdr.chunk_hdr_sz = sizeof(struct chunk_header);
+	hdr.blk_sz = SPARSE_BLOCK;
+	hdr.total_blks = w.total_blocks;
+	hdr.total_chunks = w.chunks;
+	if (write_all(fd, &hdr, sizeof(hdr), 0) < 0)
+		goto out;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
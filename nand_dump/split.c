@@ -0,0 +1,237 @@
+/*
+    split command for rpi-raw-nand
+
+    Splits a dump into a data file and an OOB file, what extractCleanFile()
+    in descramble/dumpreader.js and nanddump/python/extract_partitions.py do
+    page by page. Per page:
+
+        data file   the 3 * 1024 data bytes of sectors 0 .. 2 (ubiData())
+        OOB file    the 64 spare bytes of sectors 0 .. 2, then all of
+                    sector 3: OOB_PER_PAGE bytes
+
+    so the two files together hold every byte of the dump.
+
+    The dump is read SPLIT_CHUNK bytes at a time (16 blocks, a multiple of
+    the 4 KB file system block) with pread, into page aligned buffers. Two
+    sets of buffers alternate: while one chunk is split the next is read
+    and the previous one written, each by a helper thread, so the disk
+    never waits for the CPU. Memory use is the same for any dump size.
+    From an archive the reading thread inflates the chunk's blocks instead.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "nand_dump.h"
+
+#define SPLIT_CHUNK     (16 * BLOCK_SIZE)
+#define SPLIT_PAGES     (SPLIT_CHUNK / PAGE_SIZE)
+#define DATA_PER_PAGE   (3 * SECTOR_DATA)
+#define OOB_PER_PAGE    (PAGE_SIZE - DATA_PER_PAGE)
+#define SPARE_SIZE      (SECTOR_SIZE - SECTOR_DATA)
+
+typedef unsigned char copy_vec __attribute__((vector_size(32)));
+
+// one pread or pwrite on a helper thread
+struct split_io {
+	int fd;
+	off_t offset;
+	size_t len;
+	unsigned char *buf;
+	int write;
+	const struct dump_archive *ar; // read from this, not fd
+	ssize_t done;
+	pthread_t thread;
+	int running;
+};
+
+static void *split_io_run(void *arg) {
+	struct split_io *io = (struct split_io *)arg;
+	ssize_t n;
+
+	io->done = 0;
+	if (io->ar != NULL) {
+		if (archive_read_pages(io->ar, io->offset / PAGE_SIZE, io->len / PAGE_SIZE, io->buf) == 0)
+			io->done = io->len;
+		return NULL;
+	}
+	while ((size_t)io->done < io->len) {
+		if (io->write)
+			n = pwrite(io->fd, io->buf + io->done, io->len - io->done, io->offset + io->done);
+		else
+			n = pread(io->fd, io->buf + io->done, io->len - io->done, io->offset + io->done);
+		if (n <= 0) {
+			if (n < 0)
+				perror(io->write ? "pwrite" : "pread");
+			break;
+		}
+		io->done += n;
+	}
+	return NULL;
+}
+
+static int split_io_start(struct split_io *io, int fd, off_t offset, unsigned char *buf, size_t len, int write) {
+	io->fd = fd;
+	io->offset = offset;
+	io->buf = buf;
+	io->len = len;
+	io->write = write;
+	if (pthread_create(&io->thread, NULL, split_io_run, io) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	io->running = 1;
+	return 0;
+}
+
+// wait for it, 0 if all of it went through
+static int split_io_wait(struct split_io *io) {
+	if (!io->running)
+		return 0;
+	pthread_join(io->thread, NULL);
+	io->running = 0;
+	return (size_t)io->done == io->len ? 0 : -1;
+}
+
+static inline void copy_1k(unsigned char *dst, const unsigned char *src) {
+	copy_vec v;
+	int i;
+
+	for (i = 0; i < SECTOR_DATA; i += sizeof(v)) {
+		memcpy(&v, src + i, sizeof(v));
+		memcpy(dst + i, &v, sizeof(v));
+	}
+}
+
+static void split_pages(const unsigned char *in, unsigned int pages, unsigned char *data, unsigned char *oob) {
+	unsigned int p;
+	int s;
+
+	for (p = 0; p < pages; p++, in += PAGE_SIZE, data += DATA_PER_PAGE, oob += OOB_PER_PAGE) {
+		for (s = 0; s < 3; s++) {
+			copy_1k(data + s * SECTOR_DATA, in + s * SECTOR_SIZE);
+			memcpy(oob + s * SPARE_SIZE, in + s * SECTOR_SIZE + SECTOR_DATA, SPARE_SIZE);
+		}
+		memcpy(oob + 3 * SPARE_SIZE, in + 3 * SECTOR_SIZE, SECTOR_SIZE);
+	}
+}
+
+int split_dump(char *infile, char *datafile, char *oobfile) {
+	unsigned char *in[2] = { NULL, NULL }, *data[2] = { NULL, NULL }, *oob[2] = { NULL, NULL };
+	struct split_io rd[2], wr_data[2], wr_oob[2];
+	struct dump_archive ar;
+	struct stat st;
+	unsigned long chunks, c, pages, total_pages;
+	int fd_in = -1, fd_data = -1, fd_oob = -1, i, cur, ret = -1;
+	double start, seconds;
+
+	memset(rd, 0, sizeof(rd));
+	memset(wr_data, 0, sizeof(wr_data));
+	memset(wr_oob, 0, sizeof(wr_oob));
+	ar.fd = -1;
+	ar.table = NULL;
+	if (is_archive(infile)) {
+		if (archive_open(&ar, infile) < 0)
+			return -1;
+		rd[0].ar = rd[1].ar = &ar;
+		total_pages = ar.hdr.pages;
+	} else {
+		if ((fd_in = open(infile, O_RDONLY)) < 0 || fstat(fd_in, &st) < 0) {
+			perror("open dump");
+			return -1;
+		}
+		total_pages = st.st_size / PAGE_SIZE;
+		if (st.st_size % PAGE_SIZE)
+			printf("%s: ignoring %lu bytes after the last whole page\n", infile, (unsigned long)(st.st_size % PAGE_SIZE));
+		posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	if ((fd_data = open(datafile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open data file");
+		goto out;
+	}
+	if ((fd_oob = open(oobfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open OOB file");
+		goto out;
+	}
+	for (i = 0; i < 2; i++) {
+		if (posix_memalign((void **)&in[i], 4096, SPLIT_CHUNK) != 0 ||
+		    posix_memalign((void **)&data[i], 4096, SPLIT_PAGES * DATA_PER_PAGE) != 0 ||
+		    posix_memalign((void **)&oob[i], 4096, SPLIT_PAGES * OOB_PER_PAGE) != 0) {
+			perror("posix_memalign");
+			goto out;
+		}
+	}
+
+	printf("Splitting %lu pages into %s (%d bytes/page) and %s (%d bytes/page)\n",
+	    total_pages, datafile, DATA_PER_PAGE, oobfile, OOB_PER_PAGE);
+	start = wall_clock();
+	chunks = (total_pages + SPLIT_PAGES - 1) / SPLIT_PAGES;
+	if (chunks > 0 && split_io_start(&rd[0], fd_in, 0, in[0], (total_pages < SPLIT_PAGES ? total_pages : SPLIT_PAGES) * PAGE_SIZE, 0) < 0)
+		goto out;
+	for (c = 0; c < chunks; c++) {
+		cur = c % 2;
+		pages = total_pages - c * SPLIT_PAGES;
+		if (pages > SPLIT_PAGES)
+			pages = SPLIT_PAGES;
+		if (split_io_wait(&rd[cur]) < 0) {
+			printf("short read at page %lu\n", c * SPLIT_PAGES);
+			goto out;
+		}
+		// next chunk in while this one is split
+		if (c + 1 < chunks) {
+			unsigned long next = total_pages - (c + 1) * SPLIT_PAGES;
+			if (split_io_start(&rd[!cur], fd_in, (off_t)(c + 1) * SPLIT_CHUNK, in[!cur],
+			    (next > SPLIT_PAGES ? SPLIT_PAGES : next) * PAGE_SIZE, 0) < 0)
+				goto out;
+		}
+		// the output buffers of two chunks ago must be out
+		if (split_io_wait(&wr_data[cur]) < 0 || split_io_wait(&wr_oob[cur]) < 0)
+			goto out;
+		split_pages(in[cur], pages, data[cur], oob[cur]);
+		if (split_io_start(&wr_data[cur], fd_data, (off_t)c * SPLIT_PAGES * DATA_PER_PAGE, data[cur], pages * DATA_PER_PAGE, 1) < 0 ||
+		    split_io_start(&wr_oob[cur], fd_oob, (off_t)c * SPLIT_PAGES * OOB_PER_PAGE, oob[cur], pages * OOB_PER_PAGE, 1) < 0)
+			goto out;
+		if (c % 8 == 7 || c + 1 == chunks) {
+			printf("Split %lu of %lu pages, %lu%%\r", c * SPLIT_PAGES + pages, total_pages,
+			    100 * (c * SPLIT_PAGES + pages) / total_pages);
+			fflush(stdout);
+		}
+	}
+	ret = 0;
+	for (i = 0; i < 2; i++)
+		if (split_io_wait(&wr_data[i]) < 0 || split_io_wait(&wr_oob[i]) < 0)
+			ret = -1;
+	seconds = wall_clock() - start;
+	printf("\nSplit %lu MB in %.2f s (%.0f MB/s)\n", (unsigned long)(total_pages * PAGE_SIZE >> 20), seconds,
+	    seconds > 0 ? total_pages * (double)PAGE_SIZE / (1 << 20) / seconds : 0.0);
+
+out:
+	for (i = 0; i < 2; i++) {
+		split_io_wait(&rd[i]);
+		split_io_wait(&wr_data[i]);
+		split_io_wait(&wr_oob[i]);
+		free(in[i]);
+		free(data[i]);
+		free(oob[i]);
+	}
+	if (fd_oob >= 0 && close(fd_oob) < 0)
+		ret = -1;
+	if (fd_data >= 0 && close(fd_data) < 0)
+		ret = -1;
+	if (fd_in >= 0)
+		close(fd_in);
+	archive_close(&ar);
+	return ret;
+}
@@ -0,0 +1,397 @@
+/*
+    Streaming a dump over a pipe and the receive command for rpi-raw-nand
+
+    read_full - writes the dump to stdout instead of a file, for the SD card
+    of a Pi is slower than the bus and wears out; ssh, nc or a USB gadget
+    link carries it to a workstation, where receive writes the file:
+
+        rpi-raw-nand 50 read_full 0 131072 - | ssh host rpi-raw-nand 0 receive dump.bin
+
+    Every message then goes to stderr, stdout holds only the stream:
+
+        header          magic, page size, first chip page, page count,
+                        chip ID
+        frames          per block a struct stream_frame, its pages and
+                        zeros up to the next memory page
+        end frame       block and page count, hash of all block hashes
+
+    A frame's hash is XXH64 of its pages seeded with the block number, so a
+    block that got mangled, lost or repeated shows, and a stream without
+    its end frame was cut short. receive writes what it got either way and
+    says which blocks are off.
+
+    The frames are built in a pool of page aligned buffers and handed to
+    the pipe with vmsplice(), which maps the pages into it instead of
+    copying them. A buffer is filled again only once the pipe has given
+    its bytes to the reader (FIONREAD), before that the reader would see
+    the new pages. ssh, nc and receive read() the pipe; a reader that
+    splice()s it on into a socket would still hold the pages after that.
+    A reader that quits early fails the dump instead of leaving it waiting
+    on bytes nobody takes. When stdout is not a pipe it is plain write().
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "nand_dump.h"
+
+#define STREAM_MAGIC     "NDSTR01"
+#define FRAME_BLOCK      "NDBK"
+#define FRAME_END        "NDEN"
+#define STREAM_PIPE_SIZE (1 << 20) // asked for, pipe-max-size may give less
+
+_Static_assert(sizeof(struct stream_frame) == 24, "stream frame is 24 bytes");
+
+static size_t round_up(size_t n, size_t to) {
+	return (n + to - 1) / to * to;
+}
+
+int stream_redirect(void) {
+	int fd;
+
+	fflush(stdout);
+	if ((fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		perror("dup stdout");
+		return -1;
+	}
+	// a terminal is no place for 570 MB
+	if (isatty(fd)) {
+		printf("stdout is a terminal, pipe it into ssh, nc or receive\n");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// bytes the reader has not taken out of the pipe yet
+static size_t in_pipe(const struct stream_writer *s) {
+	int n;
+
+	if (ioctl(s->fd, FIONREAD, &n) < 0)
+		return 0;
+	return n;
+}
+
+// until the reader has taken the stream up to byte upto, -1 once it is
+// gone: what it left in the pipe stays there and FIONREAD never drops
+static int wait_reader(struct stream_writer *s, uint64_t upto, long pause_ns) {
+	struct timespec pause = { 0, pause_ns };
+	struct pollfd pfd;
+	double start = wall_clock();
+
+	while (s->sent - in_pipe(s) < upto) {
+		// the write end of a pipe without readers polls POLLERR
+		pfd.fd = s->fd;
+		pfd.events = 0;
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR | POLLHUP))) {
+			printf("\nThe reader is gone, %lu bytes of the stream never left the pipe\n",
+			    (unsigned long)in_pipe(s));
+			return -1;
+		}
+		nanosleep(&pause, NULL);
+	}
+	s->waited += wall_clock() - start;
+	return 0;
+}
+
+// spliced: buf stays as it is until the reader has it, see frame()
+static int send_all(struct stream_writer *s, const unsigned char *buf, size_t len, int spliced) {
+	struct iovec iov;
+	double start = wall_clock();
+	ssize_t n;
+
+	while (len > 0) {
+		if (spliced && s->splice) {
+			iov.iov_base = (void *)buf;
+			iov.iov_len = len;
+			n = vmsplice(s->fd, &iov, 1, 0);
+			// not a pipe after all, or no vmsplice in this kernel
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EBADF)) {
+				s->splice = 0;
+				continue;
+			}
+		} else {
+			n = write(s->fd, buf, len);
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror(spliced && s->splice ? "vmsplice" : "write stream");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		s->sent += n;
+	}
+	s->waited += wall_clock() - start;
+	return 0;
+}
+
+int stream_open(struct stream_writer *s, int fd, const unsigned char id[8], unsigned int first_page,
+    unsigned int pages, unsigned int page_bytes) {
+	struct stream_header hdr;
+	struct stat st;
+	long size;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->page_bytes = page_bytes;
+	s->align = sysconf(_SC_PAGESIZE) > 0 ? sysconf(_SC_PAGESIZE) : 4096;
+	s->frame_size = round_up(sizeof(struct stream_frame) + (size_t)PAGES_PER_BLOCK * page_bytes, s->align);
+	// a reader that goes away is EPIPE from send_all(), not the end of the dumper
+	signal(SIGPIPE, SIG_IGN);
+	if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		s->pipe = s->splice = 1;
+		fcntl(fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+		if ((size = fcntl(fd, F_GETPIPE_SZ)) > 0)
+			s->pipe_size = size;
+	}
+	// enough that the pipe can be full while the next frame is built
+	s->buffers = s->pipe_size / s->frame_size + 2;
+	if ((s->end = (uint64_t *)calloc(s->buffers, sizeof(*s->end))) == NULL ||
+	    posix_memalign((void **)&s->pool, s->align, s->buffers * s->frame_size) != 0) {
+		perror("malloc");
+		stream_free(s);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STREAM_MAGIC, sizeof(hdr.magic));
+	hdr.page_bytes = page_bytes;
+	hdr.pages_per_block = PAGES_PER_BLOCK;
+	hdr.first_page = first_page;
+	hdr.pages = pages;
+	if (id != NULL)
+		memcpy(hdr.id, id, sizeof(hdr.id));
+	s->start = wall_clock();
+	if (send_all(s, (const unsigned char *)&hdr, sizeof(hdr), 0) < 0) {
+		stream_free(s);
+		return -1;
+	}
+	printf("Streaming to %s, %u byte frames, %u buffers%s\n", s->pipe ? "a pipe" : "stdout",
+	    (unsigned int)s->frame_size, s->buffers, s->splice ? ", vmsplice" : "");
+	return 0;
+}
+
+// the frame being filled, once the pipe is done with its last contents;
+// NULL when the reader is gone
+static struct stream_frame *frame(struct stream_writer *s) {
+	unsigned char *buf = s->pool + (size_t)s->next * s->frame_size;
+
+	if (s->fill == 0 && s->splice && s->sent - in_pipe(s) < s->end[s->next] &&
+	    wait_reader(s, s->end[s->next], 100000) < 0)
+		return NULL;
+	return (struct stream_frame *)buf;
+}
+
+static int flush_frame(struct stream_writer *s) {
+	struct stream_frame *f;
+	unsigned char *pages;
+	size_t len;
+
+	if (s->fill == 0)
+		return 0;
+	if ((f = frame(s)) == NULL)
+		return -1;
+	pages = (unsigned char *)(f + 1);
+	len = (size_t)s->fill * s->page_bytes;
+	memcpy(f->magic, FRAME_BLOCK, sizeof(f->magic));
+	f->block = s->block;
+	f->pages = s->fill;
+	f->size = round_up(sizeof(*f) + len, s->align);
+	f->hash = hash64(pages, len, s->block);
+	memset(pages + len, 0, f->size - sizeof(*f) - len);
+	if (send_all(s, (const unsigned char *)f, f->size, 1) < 0)
+		return -1;
+	s->end[s->next] = s->sent;
+	s->next = (s->next + 1) % s->buffers;
+	s->chain = hash64(&f->hash, sizeof(f->hash), s->chain);
+	s->pages += s->fill;
+	s->block++;
+	s->fill = 0;
+	return 0;
+}
+
+int stream_write_page(struct stream_writer *s, const unsigned char *page) {
+	struct stream_frame *f;
+
+	if ((f = frame(s)) == NULL)
+		return -1;
+	memcpy((unsigned char *)(f + 1) + (size_t)s->fill * s->page_bytes, page, s->page_bytes);
+	if (++s->fill < PAGES_PER_BLOCK)
+		return 0;
+	return flush_frame(s);
+}
+
+void stream_free(struct stream_writer *s) {
+	free(s->pool);
+	free(s->end);
+	s->pool = NULL;
+	s->end = NULL;
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+}
+
+int stream_finish(struct stream_writer *s) {
+	struct stream_frame end;
+	double seconds;
+	int ret = -1;
+
+	if (flush_frame(s) < 0)
+		goto out;
+	memset(&end, 0, sizeof(end));
+	memcpy(end.magic, FRAME_END, sizeof(end.magic));
+	end.block = s->block;
+	end.pages = s->pages;
+	end.size = sizeof(end);
+	end.hash = s->chain;
+	if (send_all(s, (const unsigned char *)&end, sizeof(end), 0) < 0)
+		goto out;
+	// the pool still backs what vmsplice put in the pipe
+	if (s->pipe && wait_reader(s, s->sent, 1000000) < 0)
+		goto out;
+	seconds = wall_clock() - s->start;
+	printf("Streamed %lu pages in %u blocks, %.2f MB in %.2f s (%.2f MB/s), %.2f s waiting for the reader\n",
+	    s->pages, s->block, s->sent / (double)(1 << 20), seconds,
+	    seconds > 0 ? s->sent / (double)(1 << 20) / seconds : 0.0, s->waited);
+	ret = 0;
+out:
+	stream_free(s);
+	return ret;
+}
+
+// len bytes from fd; fewer only at the end of the stream
+static size_t read_stream(int fd, void *buf, size_t len) {
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		if ((n = read(fd, (unsigned char *)buf + got, len - got)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read stream");
+			break;
+		}
+		if (n == 0)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+int stream_receive(char *outfile) {
+	struct stream_header hdr;
+	struct stream_frame f;
+	unsigned char *buf = NULL;
+	unsigned long pages = 0, bad = 0;
+	uint64_t chain = 0, bytes = 0;
+	unsigned int block = 0, blocks, max_frame;
+	double start, seconds;
+	size_t len;
+	FILE *out = NULL;
+	int ret = -1, ended = 0;
+
+	if (read_stream(STDIN_FILENO, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, STREAM_MAGIC, sizeof(hdr.magic)) != 0) {
+		printf("stdin is not a read_full - stream\n");
+		return -1;
+	}
+	if (hdr.pages_per_block != PAGES_PER_BLOCK || (hdr.page_bytes != PAGE_SIZE && hdr.page_bytes != 512 * (PAGE_SIZE / 512))) {
+		printf("Stream of %u byte pages, %u per block, not this chip\n", hdr.page_bytes, hdr.pages_per_block);
+		return -1;
+	}
+	blocks = (hdr.pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+	printf("Receiving pages %u .. %u (%u blocks) of chip %02x %02x %02x %02x %02x, %u bytes each\n",
+	    hdr.first_page, hdr.first_page + hdr.pages - 1, blocks, hdr.id[0], hdr.id[1], hdr.id[2], hdr.id[3], hdr.id[4], hdr.page_bytes);
+	// a frame is padded to the sender's memory pages, 64 KB at most
+	max_frame = sizeof(f) + PAGES_PER_BLOCK * hdr.page_bytes + 65536;
+	if ((buf = (unsigned char *)malloc(max_frame)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((out = fopen(outfile, "wb")) == NULL) {
+		perror(outfile);
+		goto out;
+	}
+
+	start = wall_clock();
+	while (!ended) {
+		if ((len = read_stream(STDIN_FILENO, &f, sizeof(f))) != sizeof(f))
+			break;
+		bytes += len;
+		if (memcmp(f.magic, FRAME_END, sizeof(f.magic)) == 0) {
+			ended = 1;
+			if (f.block != block || f.pages != pages)
+				printf("\nThe sender sent %u blocks (%u pages), %u (%lu) came\n", f.block, f.pages, block, pages);
+			else if (f.hash != chain)
+				printf("\nThe block hashes do not add up to the sender's\n");
+			else
+				ret = 0;
+			break;
+		}
+		if (memcmp(f.magic, FRAME_BLOCK, sizeof(f.magic)) != 0 || f.pages == 0 || f.pages > PAGES_PER_BLOCK ||
+		    f.size < sizeof(f) + f.pages * hdr.page_bytes || f.size > max_frame) {
+			printf("\nNo frame where block %u should start, the stream is garbled\n", block);
+			break;
+		}
+		if ((len = read_stream(STDIN_FILENO, buf, f.size - sizeof(f))) != f.size - sizeof(f))
+			break;
+		bytes += len;
+		if (f.block != block) {
+			printf("\nBlock %u where %u was expected\n", f.block, block);
+			bad++;
+		} else if (hash64(buf, (size_t)f.pages * hdr.page_bytes, f.block) != f.hash) {
+			printf("\nBlock %u (pages %lu ..) does not match its hash\n", f.block, hdr.first_page + pages);
+			bad++;
+		}
+		// written as it came, a damaged block keeps its place
+		if (fwrite(buf, (size_t)f.pages * hdr.page_bytes, 1, out) != 1) {
+			perror(outfile);
+			goto out;
+		}
+		chain = hash64(&f.hash, sizeof(f.hash), chain);
+		pages += f.pages;
+		block++;
+		if (block % 64 == 0 || block == blocks) {
+			seconds = wall_clock() - start;
+			printf("Block %u of %u, %.2f MB/s\r", block, blocks, seconds > 0 ? bytes / (double)(1 << 20) / seconds : 0.0);
+			fflush(stdout);
+		}
+	}
+	seconds = wall_clock() - start;
+	printf("\n");
+	if (!ended)
+		printf("The stream ends after block %u without an end frame, %s holds %lu of %u pages\n",
+		    block, outfile, pages, hdr.pages);
+	if (bad) {
+		printf("%lu blocks damaged on the way, read them again\n", bad);
+		ret = -1;
+	}
+	printf("Received %lu pages, %.2f MB in %.2f s (%.2f MB/s)%s\n", pages, bytes / (double)(1 << 20), seconds,
+	    seconds > 0 ? bytes / (double)(1 << 20) / seconds : 0.0, ret == 0 ? ", complete" : "");
+out:
+	if (out != NULL && fclose(out) != 0) {
+		perror(outfile);
+		ret = -1;
+	}
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,540 @@
+/*
+    UBI scanner and the ubi command for rpi-raw-nand
+
+    Reads the UBI volumes straight out of a descrambled dump, without the
+    ubiData() export and a Python UBI reader over it. A block of the
+    partition is one PEB, seen through the ubiData() layout (see gpt.c):
+
+        0    .. 4095     page 0: EC header, 3072 data bytes and zero fill
+        4096 .. 8191     page 1: VID header, the same
+        8192 ..          pages 2 .. 63, 3072 data bytes each
+        .. UBI_PEB_SIZE  zero fill
+
+    so the offsets in the headers (vid_hdr_offset, data_offset) are the ones
+    UBI wrote. All PEBs are scanned in parallel. Of the PEBs that claim the
+    same LEB of a volume the one with the highest sqnum wins, unless it is
+    a copy (copy_flag) whose data CRC does not match, as in the kernel's
+    ubi_compare_lebs(). The volume table in the layout volume gives the
+    names. Each volume is then written as <dir>/<name>.img with pwritev()
+    straight from the mapped dump; LEBs no PEB holds are left 0xFF (erased).
+
+    A header with a bad CRC gets its sector run through the BCH ECC first,
+    so a dump that was descrambled but not corrected still scans. If that
+    does not help the PEB is dropped, and what <dump>.idx knows about the
+    page (ECC status, read confidence) is listed with it.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "nand_dump.h"
+#include "mtk_ecc.h"
+
+#define UBI_EC_MAGIC      0x55424923 // "UBI#"
+#define UBI_VID_MAGIC     0x55424921 // "UBI!"
+#define UBI_HDR_SIZE      64
+#define UBI_LAYOUT_VOLUME 0x7FFFEFFF
+#define UBI_MAX_VOLUMES   128
+#define UBI_VTBL_RECORD   172
+#define UBI_VID_STATIC    2
+#define UBI_HEADER_PAGES  2 // EC and VID header pages of the ubiData() layout
+
+enum { PEB_EMPTY, PEB_OK, PEB_BAD_VID, PEB_NO_VID };
+
+struct peb {
+	int state;
+	int bad_ec;             // EC header unreadable, the usual offsets assumed
+	int fixed;              // a header needed ECC correction
+	unsigned int page;      // first page in the dump
+	uint64_t ec;
+	uint32_t vid_hdr_offset, data_offset;
+	uint32_t vol_id, lnum, data_size, used_ebs, data_pad, data_crc;
+	uint64_t sqnum;
+	int vol_type, copy_flag;
+};
+
+struct volume {
+	char name[UBI_MAX_VOLUMES + 1];
+	int vol_type;
+	uint32_t reserved_pebs, data_pad, used_ebs;
+	uint32_t lebs;          // highest LEB found + 1
+	int *leb;               // PEB per LEB, -1 for none
+};
+
+struct ubi_scan {
+	const struct dump_image *img;
+	struct peb *pebs;
+	unsigned int count;
+	uint32_t data_offset;   // from the first good EC header, for PEBs without one
+	struct volume vol[UBI_MAX_VOLUMES];
+	const char *outdir;
+	int failed;
+};
+
+static uint32_t get_be32(const unsigned char *p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+	return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+// UBI's crc32(UBI_CRC32_INIT, ...) is the zlib one without the final inversion
+static uint32_t ubi_crc(uint32_t crc, const void *buf, size_t len) {
+	return ~crc32_update(~crc, buf, len);
+}
+
+// where byte <off> of a PEB in the ubiData() layout is in the dump: page of
+// the block and sector, -1 for the zero fill; *len is how far it goes on from there
+static int peb_locate(unsigned int off, unsigned int *page, unsigned int *sector, unsigned int *byte, unsigned int *len) {
+	unsigned int in;
+
+	if (off < UBI_HEADER_PAGES * 4096) {
+		*page = off / 4096;
+		in = off % 4096;
+		if (in >= PAGE_DATA) {
+			*len = 4096 - in;
+			return -1;
+		}
+	} else if (off < UBI_HEADER_PAGES * 4096 + (PAGES_PER_BLOCK - UBI_HEADER_PAGES) * PAGE_DATA) {
+		off -= UBI_HEADER_PAGES * 4096;
+		*page = UBI_HEADER_PAGES + off / PAGE_DATA;
+		in = off % PAGE_DATA;
+	} else {
+		*len = UBI_PEB_SIZE - off;
+		return -1;
+	}
+	*sector = in / SECTOR_DATA;
+	*byte = in % SECTOR_DATA;
+	*len = SECTOR_DATA - *byte;
+	return 0;
+}
+
+// NULL for zero fill, or for pages past the end of the dump
+static const unsigned char *peb_bytes(const struct dump_image *img, const struct peb *peb, unsigned int off, unsigned int *len) {
+	unsigned int page, sector, byte;
+
+	if (peb_locate(off, &page, &sector, &byte, len) < 0 || peb->page + page >= img->pages)
+		return NULL;
+	return dump_page(img, peb->page + page) + sector * SECTOR_SIZE + byte;
+}
+
+// a 64 byte header at <off>, ECC corrected if its CRC says so; 1 if good
+static int read_header(const struct dump_image *img, struct peb *peb, unsigned int off, unsigned char hdr[UBI_HDR_SIZE]) {
+	unsigned char sector[SECTOR_SIZE];
+	unsigned int page, s, byte, len;
+	int flips;
+
+	if (off % 8 || peb_locate(off, &page, &s, &byte, &len) < 0 || len < UBI_HDR_SIZE || peb->page + page >= img->pages) {
+		memset(hdr, 0xFF, UBI_HDR_SIZE);
+		return 0;
+	}
+	memcpy(hdr, dump_page(img, peb->page + page) + s * SECTOR_SIZE + byte, UBI_HDR_SIZE);
+	if (ubi_crc(UINT32_MAX, hdr, UBI_HDR_SIZE - 4) == get_be32(hdr + UBI_HDR_SIZE - 4))
+		return 1;
+	memcpy(sector, dump_page(img, peb->page + page) + s * SECTOR_SIZE, SECTOR_SIZE);
+	if (ecc_check_sector(sector, 1, &flips) != ECC_CORRECTED)
+		return 0;
+	memcpy(hdr, sector + byte, UBI_HDR_SIZE);
+	if (ubi_crc(UINT32_MAX, hdr, UBI_HDR_SIZE - 4) != get_be32(hdr + UBI_HDR_SIZE - 4))
+		return 0;
+	peb->fixed = 1;
+	return 1;
+}
+
+static void scan_peb(void *ctx, unsigned long item, int worker) {
+	struct ubi_scan *scan = (struct ubi_scan *)ctx;
+	struct peb *peb = &scan->pebs[item];
+	unsigned char hdr[UBI_HDR_SIZE];
+
+	(void)worker;
+	if (!read_header(scan->img, peb, 0, hdr)) {
+		if (all_ff(hdr, UBI_HDR_SIZE)) {
+			peb->state = PEB_EMPTY;
+			return;
+		}
+		// the EC header only has the erase counter, go on with the usual offsets
+		peb->bad_ec = 1;
+		peb->vid_hdr_offset = 4096;
+		peb->data_offset = 0;
+	} else {
+		peb->ec = get_be64(hdr + 8);
+		peb->vid_hdr_offset = get_be32(hdr + 16);
+		peb->data_offset = get_be32(hdr + 20);
+	}
+
+	if (!read_header(scan->img, peb, peb->vid_hdr_offset, hdr)) {
+		if (all_ff(hdr, UBI_HDR_SIZE))
+			peb->state = PEB_NO_VID; // erased, not written to yet
+		else
+			peb->state = PEB_BAD_VID;
+		return;
+	}
+	if (get_be32(hdr) != UBI_VID_MAGIC) {
+		peb->state = PEB_BAD_VID;
+		return;
+	}
+	peb->vol_type = hdr[5];
+	peb->copy_flag = hdr[6];
+	peb->vol_id = get_be32(hdr + 8);
+	peb->lnum = get_be32(hdr + 12);
+	peb->data_size = get_be32(hdr + 20);
+	peb->used_ebs = get_be32(hdr + 24);
+	peb->data_pad = get_be32(hdr + 28);
+	peb->data_crc = get_be32(hdr + 32);
+	peb->sqnum = get_be64(hdr + 40);
+	peb->state = PEB_OK;
+}
+
+static uint32_t leb_size(const struct ubi_scan *scan, const struct peb *peb) {
+	return UBI_PEB_SIZE - (peb->data_offset ? peb->data_offset : scan->data_offset);
+}
+
+// <len> bytes of a LEB from <off> on, to a buffer or iov writer
+static int leb_read(const struct ubi_scan *scan, const struct peb *peb, unsigned int off, unsigned int len,
+    unsigned char *buf, struct iov_writer *w, uint32_t *crc) {
+	static const unsigned char zero[SECTOR_DATA];
+	const unsigned char *p;
+	unsigned int n, pos = UBI_PEB_SIZE - leb_size(scan, peb) + off;
+
+	while (len > 0) {
+		p = peb_bytes(scan->img, peb, pos, &n);
+		if (n > len)
+			n = len;
+		if (p == NULL) {
+			p = zero;
+			if (n > sizeof(zero))
+				n = sizeof(zero);
+		}
+		if (buf != NULL) {
+			memcpy(buf, p, n);
+			buf += n;
+		}
+		if (w != NULL && iov_add(w, p, n) < 0)
+			return -1;
+		if (crc != NULL)
+			*crc = ubi_crc(*crc, p, n);
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// which of two PEBs with the same LEB is the one to use, ubi_compare_lebs()
+static int newer(const struct ubi_scan *scan, const struct peb *a, const struct peb *b) {
+	const struct peb *young = a->sqnum > b->sqnum ? a : b;
+	uint32_t crc = UINT32_MAX;
+
+	if (!young->copy_flag)
+		return young == a;
+	// a copy that did not finish: its data CRC tells
+	if (young->data_size > leb_size(scan, young) || leb_read(scan, young, 0, young->data_size, NULL, NULL, &crc) < 0)
+		return young != a;
+	return (crc == young->data_crc) == (young == a);
+}
+
+static void read_vtbl(struct ubi_scan *scan) {
+	unsigned char *rec;
+	const struct peb *peb = NULL;
+	unsigned int i, records, l;
+
+	for (i = 0; i < scan->count; i++) {
+		if (scan->pebs[i].state == PEB_OK && scan->pebs[i].vol_id == UBI_LAYOUT_VOLUME &&
+		    (peb == NULL || newer(scan, &scan->pebs[i], peb)))
+			peb = &scan->pebs[i];
+	}
+	if (peb == NULL) {
+		printf("no volume table (layout volume) found, volumes get numbers as names\n");
+		return;
+	}
+	records = leb_size(scan, peb) / UBI_VTBL_RECORD;
+	if (records > UBI_MAX_VOLUMES)
+		records = UBI_MAX_VOLUMES;
+	if ((rec = malloc(records * UBI_VTBL_RECORD)) == NULL) {
+		perror("malloc");
+		return;
+	}
+	leb_read(scan, peb, 0, records * UBI_VTBL_RECORD, rec, NULL, NULL);
+	for (i = 0; i < records; i++) {
+		const unsigned char *r = rec + i * UBI_VTBL_RECORD;
+		struct volume *vol = &scan->vol[i];
+
+		if (ubi_crc(UINT32_MAX, r, UBI_VTBL_RECORD - 4) != get_be32(r + UBI_VTBL_RECORD - 4) || get_be32(r) == 0)
+			continue;
+		vol->reserved_pebs = get_be32(r);
+		vol->data_pad = get_be32(r + 8);
+		vol->vol_type = r[12];
+		l = r[14] << 8 | r[15];
+		if (l > UBI_MAX_VOLUMES)
+			l = UBI_MAX_VOLUMES;
+		memcpy(vol->name, r + 16, l);
+		vol->name[l] = '\0';
+	}
+	free(rec);
+}
+
+// the PEB for every LEB of every volume
+static int map_lebs(struct ubi_scan *scan, unsigned long *stale) {
+	struct volume *vol;
+	struct peb *peb;
+	unsigned int i, l, limit;
+	unsigned long corrupt = 0;
+
+	for (i = 0; i < scan->count; i++) {
+		peb = &scan->pebs[i];
+		if (peb->state != PEB_OK || peb->vol_id >= UBI_MAX_VOLUMES)
+			continue;
+		vol = &scan->vol[peb->vol_id];
+		// a volume has no more LEBs than it reserved PEBs, nor than the partition has
+		limit = vol->reserved_pebs && vol->reserved_pebs < scan->count ? vol->reserved_pebs : scan->count;
+		if (peb->lnum >= limit) {
+			peb->state = PEB_BAD_VID;
+			corrupt++;
+			continue;
+		}
+		if (peb->lnum >= vol->lebs)
+			vol->lebs = peb->lnum + 1;
+	}
+	if (corrupt)
+		printf("%lu PEBs with a LEB number past their volume, left out\n", corrupt);
+	for (i = 0; i < UBI_MAX_VOLUMES; i++) {
+		vol = &scan->vol[i];
+		if (vol->lebs < vol->reserved_pebs && vol->vol_type != UBI_VID_STATIC)
+			vol->lebs = vol->reserved_pebs < scan->count ? vol->reserved_pebs : scan->count;
+		if (vol->lebs == 0)
+			continue;
+		if ((vol->leb = malloc(vol->lebs * sizeof(int))) == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		for (l = 0; l < vol->lebs; l++)
+			vol->leb[l] = -1;
+	}
+	for (i = 0; i < scan->count; i++) {
+		peb = &scan->pebs[i];
+		if (peb->state != PEB_OK || peb->vol_id >= UBI_MAX_VOLUMES)
+			continue;
+		vol = &scan->vol[peb->vol_id];
+		vol->vol_type = peb->vol_type;
+		if (peb->vol_type == UBI_VID_STATIC)
+			vol->used_ebs = peb->used_ebs;
+		if (vol->leb[peb->lnum] >= 0) {
+			(*stale)++;
+			if (!newer(scan, peb, &scan->pebs[vol->leb[peb->lnum]]))
+				continue;
+		}
+		vol->leb[peb->lnum] = i;
+	}
+	return 0;
+}
+
+// the volume name as a file name: it comes off the flash, a '/' or a name of dots would leave outdir
+static void safe_name(const char *name, char *out) {
+	int i, lead = 1;
+
+	for (i = 0; name[i]; i++) {
+		lead = lead && name[i] == '.';
+		out[i] = lead || name[i] == '/' || (unsigned char)name[i] < 0x20 ? '_' : name[i];
+	}
+	out[i] = '\0';
+}
+
+static void write_volume(void *ctx, unsigned long item, int worker) {
+	struct ubi_scan *scan = (struct ubi_scan *)ctx;
+	struct volume *vol;
+	struct iov_writer *w;
+	static const unsigned char erased[SECTOR_DATA] = { [0 ... SECTOR_DATA - 1] = 0xFF };
+	const struct peb *peb;
+	char file[512], name[UBI_MAX_VOLUMES + 1];
+	unsigned int v, l, size, n, missing = 0;
+	uint32_t usable;
+
+	(void)worker;
+	// item: the item'th volume that has LEBs
+	for (v = 0; v < UBI_MAX_VOLUMES; v++)
+		if (scan->vol[v].lebs && item-- == 0)
+			break;
+	vol = &scan->vol[v];
+	usable = UBI_PEB_SIZE - scan->data_offset - vol->data_pad;
+	safe_name(vol->name, name);
+	if (vol->name[0])
+		snprintf(file, sizeof(file), "%s/%s.img", scan->outdir, name);
+	else
+		snprintf(file, sizeof(file), "%s/vol%u.img", scan->outdir, v);
+	if ((w = (struct iov_writer *)malloc(sizeof(*w))) == NULL) {
+		perror("malloc");
+		scan->failed = 1;
+		return;
+	}
+	if ((w->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(file);
+		free(w);
+		scan->failed = 1;
+		return;
+	}
+	w->offset = 0;
+	w->count = 0;
+	for (l = 0; l < vol->lebs; l++) {
+		if (vol->vol_type == UBI_VID_STATIC && vol->used_ebs && l >= vol->used_ebs)
+			break;
+		size = usable;
+		if (vol->leb[l] < 0) {
+			missing++;
+			for (; size > 0; size -= n) {
+				n = size > sizeof(erased) ? sizeof(erased) : size;
+				if (iov_add(w, erased, n) < 0)
+					goto fail;
+			}
+			continue;
+		}
+		peb = &scan->pebs[vol->leb[l]];
+		if (vol->vol_type == UBI_VID_STATIC && peb->data_size < size)
+			size = peb->data_size;
+		if (leb_read(scan, peb, 0, size, NULL, w, NULL) < 0)
+			goto fail;
+	}
+	if (iov_flush(w) < 0 || close(w->fd) < 0) {
+		w->fd = -1;
+		goto fail;
+	}
+	printf("volume %u (%s, %s): %u LEBs of %u bytes to %s", v, vol->name[0] ? vol->name : "no name",
+	    vol->vol_type == UBI_VID_STATIC ? "static" : "dynamic", l, usable, file);
+	if (missing)
+		printf(", %u not on flash, left erased", missing);
+	printf("\n");
+	free(w);
+	return;
+
+fail:
+	printf("writing volume %u failed\n", v);
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w);
+	scan->failed = 1;
+}
+
+static void list_bad(const struct ubi_scan *scan, const char *dumpfile) {
+	static const char *ecc[] = { "clean", "corrected", "erased", "uncorrectable" };
+	struct page_index idx;
+	char file[512];
+	unsigned int i, shown = 0, p;
+	int have_idx = 0;
+
+	snprintf(file, sizeof(file), "%s.idx", dumpfile);
+	// only if there is one, index_open() would make an empty one
+	have_idx = access(file, R_OK) == 0 && index_open(&idx, dumpfile, scan->img->pages) == 0;
+	for (i = 0; i < scan->count && shown < 32; i++) {
+		const struct peb *peb = &scan->pebs[i];
+
+		if (peb->state != PEB_BAD_VID && !peb->bad_ec)
+			continue;
+		printf("PEB %u (page %u): %s", i, peb->page, peb->state == PEB_BAD_VID ? "bad VID header" : "bad EC header");
+		p = peb->page + (peb->state == PEB_BAD_VID);
+		if (have_idx && p < idx.hdr->pages) {
+			if (idx.page[p].flags & IDX_ECC_CHECKED)
+				printf(", page ECC %s", ecc[idx.page[p].ecc_status & 3]);
+			if (idx.page[p].confidence)
+				printf(", read confidence %d", idx.page[p].confidence);
+			if (idx.page[p].flags & IDX_DISPUTED)
+				printf(", dumps disagree");
+		}
+		printf("\n");
+		shown++;
+	}
+	if (have_idx)
+		index_close(&idx);
+}
+
+int ubi_scan(char *infile, char *outdir, char *partname) {
+	struct dump_image img;
+	struct partition parts[MAX_PARTITIONS], *part = NULL;
+	struct ubi_scan *scan;
+	unsigned long count[PEB_NO_VID + 1], stale = 0, fixed = 0, bad_ec = 0;
+	unsigned int i, volumes = 0;
+	double start, seconds;
+	int n, ret = -1;
+
+	if (ecc_init() < 0 || dump_open(&img, infile) < 0)
+		return -1;
+	n = read_partitions(&img, parts, MAX_PARTITIONS);
+	for (i = 0; i < (unsigned int)n; i++)
+		if (strcmp(parts[i].name, partname) == 0)
+			part = &parts[i];
+	if (part == NULL) {
+		printf("no partition %s\n", partname);
+		dump_close(&img);
+		return -1;
+	}
+	if (part->first_page % PAGES_PER_BLOCK || part->first_page + part->pages > img.pages) {
+		printf("%s: pages %u .. %u are not whole blocks within the dump\n", partname, part->first_page,
+		    part->first_page + part->pages - 1);
+		dump_close(&img);
+		return -1;
+	}
+	if (make_dirs(outdir) < 0 || (scan = (struct ubi_scan *)calloc(1, sizeof(*scan))) == NULL) {
+		dump_close(&img);
+		return -1;
+	}
+	scan->img = &img;
+	scan->outdir = outdir;
+	scan->count = part->pages / PAGES_PER_BLOCK;
+	if ((scan->pebs = (struct peb *)calloc(scan->count, sizeof(struct peb))) == NULL) {
+		perror("calloc");
+		goto out;
+	}
+	for (i = 0; i < scan->count; i++)
+		scan->pebs[i].page = part->first_page + i * PAGES_PER_BLOCK;
+
+	printf("Scanning %u PEBs of %s\n", scan->count, partname);
+	start = wall_clock();
+	run_parallel(scan->count, 0, scan_peb, scan);
+	seconds = wall_clock() - start;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < scan->count; i++) {
+		count[scan->pebs[i].state]++;
+		fixed += scan->pebs[i].fixed;
+		bad_ec += scan->pebs[i].bad_ec;
+		if (!scan->data_offset && scan->pebs[i].data_offset)
+			scan->data_offset = scan->pebs[i].data_offset;
+	}
+	printf("Scanned in %.2f s: %lu in use, %lu erased, %lu without VID header, %lu bad EC, %lu bad VID header",
+	    seconds, count[PEB_OK], count[PEB_EMPTY], count[PEB_NO_VID], bad_ec, count[PEB_BAD_VID]);
+	if (fixed)
+		printf(" (%lu headers ECC corrected)", fixed);
+	printf("\n");
+	if (scan->data_offset == 0 || scan->data_offset >= UBI_PEB_SIZE) {
+		printf("no usable EC header, is %s UBI and the dump descrambled?\n", partname);
+		goto out;
+	}
+	list_bad(scan, infile);
+
+	read_vtbl(scan);
+	if (map_lebs(scan, &stale) < 0)
+		goto out;
+	if (stale)
+		printf("%lu LEBs held by more than one PEB, the newest copy used\n", stale);
+	for (i = 0; i < UBI_MAX_VOLUMES; i++)
+		volumes += scan->vol[i].lebs > 0;
+	run_parallel(volumes, 0, write_volume, scan);
+	ret = scan->failed ? -1 : 0;
+
+out:
+	for (i = 0; i < UBI_MAX_VOLUMES; i++)
+		free(scan->vol[i].leb);
+	free(scan->pebs);
+	free(scan);
+	dump_close(&img);
+	return ret;
+}
@@ -0,0 +1,222 @@
+/*
+    xor_keys command for rpi-raw-nand
+
+    The native version of FlashDumpReader.createXorData() in
+    descramble/dumpreader.js. For every page % 64 and every byte offset in a
+    sector it counts how often each of the 256 values shows up over all
+    sectors of all pages in the range. Most sectors are padding, so the
+    value that dominates an offset is the key byte there.
+
+    Every thread counts into its own shard of 16 bit counters
+    (64 * 1088 * 256 of them, 35 MB), so the counting needs no locks. A
+    shard slice is added to the 32 bit totals before a counter can overflow,
+    and once more at the end. The number of shards is capped at
+    XOR_MAX_SHARDS to bound the memory, counting is memory bound anyway.
+
+    As in createXorData() erased pages and sectors (first byte 0xFF) are
+    skipped, and a key byte is only taken if its value was seen more than
+    min_occurs times, else it is 0x00. Written to <xordir>:
+
+        <mod>_xor.bin    the key, what descramble loads
+        <mod>_conf.bin   per key byte: count of the winning value * 255 /
+                         all samples at that offset
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "nand_dump.h"
+
+#define XOR_MAX_SHARDS  8
+#define XOR_MIN_OCCURS  9 // createXorData() minOccurs
+#define HIST_CELLS      (PAGES_PER_BLOCK * SECTOR_SIZE * 256)
+#define HIST_FLUSH      (65535 - SECTORS_PER_PAGE) // sectors a shard slice takes before it is flushed
+
+struct xor_job {
+	const struct dump_image *img;
+	unsigned int first_page;
+	unsigned int last_page;
+	uint16_t *shard[XOR_MAX_SHARDS];
+	unsigned int shard_sectors[XOR_MAX_SHARDS][PAGES_PER_BLOCK];  // counted into the slice since the last flush
+	uint32_t *total;
+	unsigned long sectors[PAGES_PER_BLOCK];
+	pthread_mutex_t lock;
+};
+
+// add one page % 64 slice of a shard to the totals and clear it
+static void flush_slice(struct xor_job *job, int worker, int mod) {
+	uint16_t *slice = job->shard[worker] + (size_t)mod * SECTOR_SIZE * 256;
+	uint32_t *total = job->total + (size_t)mod * SECTOR_SIZE * 256;
+	unsigned int i;
+
+	pthread_mutex_lock(&job->lock);
+	for (i = 0; i < SECTOR_SIZE * 256; i++)
+		total[i] += slice[i];
+	job->sectors[mod] += job->shard_sectors[worker][mod];
+	pthread_mutex_unlock(&job->lock);
+	memset(slice, 0, SECTOR_SIZE * 256 * sizeof(*slice));
+	job->shard_sectors[worker][mod] = 0;
+}
+
+static void count_block(void *ctx, unsigned long item, int worker) {
+	struct xor_job *job = (struct xor_job *)ctx;
+	unsigned int page = job->first_page + item * PAGES_PER_BLOCK;
+	unsigned int last = page + PAGES_PER_BLOCK;
+	const unsigned char *data, *sector;
+	uint16_t *hist;
+	int mod, s, i;
+
+	if (last > job->last_page)
+		last = job->last_page;
+	for (; page < last; page++) {
+		data = dump_page(job->img, page);
+		if (data[0] == 0xFF)
+			continue;
+		mod = page % PAGES_PER_BLOCK;
+		if (job->shard_sectors[worker][mod] >= HIST_FLUSH)
+			flush_slice(job, worker, mod);
+		hist = job->shard[worker] + (size_t)mod * SECTOR_SIZE * 256;
+		for (s = 0; s < SECTORS_PER_PAGE; s++) {
+			sector = data + s * SECTOR_SIZE;
+			if (sector[0] == 0xFF)
+				continue;
+			for (i = 0; i < SECTOR_SIZE; i++)
+				hist[i * 256 + sector[i]]++;
+			job->shard_sectors[worker][mod]++;
+		}
+	}
+}
+
+static int write_file(const char *dir, int mod, const char *suffix, const unsigned char *buf) {
+	char file[256];
+	FILE *fp;
+
+	snprintf(file, sizeof(file), "%s/%d_%s.bin", dir, mod, suffix);
+	if ((fp = fopen(file, "wb")) == NULL) {
+		perror(file);
+		return -1;
+	}
+	if (fwrite(buf, 1, SECTOR_SIZE, fp) != SECTOR_SIZE) {
+		perror(file);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+int derive_xor_keys(char *infile, char *xordir, int first_page_number, int number_of_pages) {
+	struct dump_image img;
+	struct xor_job job;
+	unsigned char key[SECTOR_SIZE], conf[SECTOR_SIZE];
+	const uint32_t *hist;
+	uint32_t best, count;
+	unsigned long samples, conf_sum, covered = 0;
+	unsigned int blocks, full_keys = 0;
+	int shards, mod, i, v, m, conf_min, ret = 0;
+	double start, seconds;
+
+	if (dump_open(&img, infile) < 0)
+		return -1;
+	if (first_page_number < 0 || (unsigned int)first_page_number >= img.pages) {
+		printf("page %d is not in the dump (%u pages)\n", first_page_number, img.pages);
+		dump_close(&img);
+		return -1;
+	}
+	if (number_of_pages <= 0 || (unsigned int)(first_page_number + number_of_pages) > img.pages)
+		number_of_pages = img.pages - first_page_number;
+
+	memset(&job, 0, sizeof(job));
+	job.img = &img;
+	job.first_page = first_page_number;
+	job.last_page = first_page_number + number_of_pages;
+	pthread_mutex_init(&job.lock, NULL);
+
+	shards = worker_count();
+	if (shards > XOR_MAX_SHARDS)
+		shards = XOR_MAX_SHARDS;
+	job.total = (uint32_t *)calloc(HIST_CELLS, sizeof(uint32_t));
+	for (i = 0; i < shards; i++)
+		job.shard[i] = (uint16_t *)calloc(HIST_CELLS, sizeof(uint16_t));
+	for (i = 0; i < shards; i++) {
+		if (job.total == NULL || job.shard[i] == NULL) {
+			perror("calloc histograms");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	blocks = (number_of_pages + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK;
+	printf("Counting pages %d .. %d on %d threads\n", first_page_number, first_page_number + number_of_pages - 1, shards);
+	start = wall_clock();
+	run_parallel(blocks, shards, count_block, &job);
+	for (i = 0; i < shards; i++)
+		for (mod = 0; mod < PAGES_PER_BLOCK; mod++)
+			flush_slice(&job, i, mod);
+	seconds = wall_clock() - start;
+	printf("Counted %u pages in %.2f s (%.0f MB/s)\n", number_of_pages, seconds,
+	    seconds > 0 ? number_of_pages * (double)PAGE_SIZE / (1 << 20) / seconds : 0.0);
+
+	if (make_dirs(xordir) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	for (mod = 0; mod < PAGES_PER_BLOCK; mod++) {
+		hist = job.total + (size_t)mod * SECTOR_SIZE * 256;
+		m = 0;
+		conf_sum = 0;
+		conf_min = 255;
+		for (i = 0; i < SECTOR_SIZE; i++, hist += 256) {
+			best = 0;
+			samples = 0;
+			key[i] = 0x00;
+			for (v = 0; v < 256; v++) {
+				count = hist[v];
+				samples += count;
+				if (count > best) {
+					best = count;
+					key[i] = v;
+				}
+			}
+			if (best <= XOR_MIN_OCCURS) {
+				key[i] = 0x00;
+				best = 0;
+			} else {
+				m++;
+			}
+			conf[i] = samples ? best * 255 / samples : 0;
+			conf_sum += conf[i];
+			if (conf[i] < conf_min)
+				conf_min = conf[i];
+		}
+		if (write_file(xordir, mod, "xor", key) < 0 || write_file(xordir, mod, "conf", conf) < 0) {
+			ret = -1;
+			goto out;
+		}
+		printf("key %2d: %4d/%d bytes (%5.1f%%) from %6lu sectors, confidence min %3d%% avg %3lu%%\n",
+		    mod, m, SECTOR_SIZE, 100.0 * m / SECTOR_SIZE, job.sectors[mod],
+		    conf_min * 100 / 255, conf_sum * 100 / 255 / SECTOR_SIZE);
+		covered += m;
+		if (m == SECTOR_SIZE)
+			full_keys++;
+	}
+	printf("page coverage %u keys at 100%% [%.2f%%]\n", full_keys, 100.0 * full_keys / PAGES_PER_BLOCK);
+	printf("xor coverage %.2f%%, keys written to %s\n", 100.0 * covered / (PAGES_PER_BLOCK * SECTOR_SIZE), xordir);
+
+out:
+	for (i = 0; i < shards; i++)
+		free(job.shard[i]);
+	free(job.total);
+	pthread_mutex_destroy(&job.lock);
+	dump_close(&img);
+	return ret;
+}